@@ -2,7 +2,10 @@
 #include "Image.h"
 #include "vec2.h"
 #include "Block.h"
+#include "rle_simd.h"
 #include <iostream>
+#include <algorithm>
+#include <new>
 
 #ifdef USE_BLOCK_ITERATOR
 #include <iterator>
@@ -12,23 +15,49 @@ using namespace std;
 
 namespace imaging {
 
+    atomic<BlockAllocator *> Block::default_allocator(nullptr);
+
     // Constructors 
     
     Block::Block(const size_t & block_size)
-        : size(block_size) {
-        data = new Component[size];
+        : size(block_size), error_margin(0), allocator(&getDefaultAllocator()) {
+        data = allocator->allocate(size);
+    }
+
+    Block::Block(const size_t & block_size, BlockAllocator & block_allocator)
+        : size(block_size), error_margin(0), allocator(&block_allocator) {
+        data = allocator->allocate(size);
     }
 
     Block::Block(const Block & src) {
         size = src.size;
-        data = new Component[size];
+        error_margin = src.error_margin;
+        allocator = src.allocator;
+        data = allocator->allocate(size);
         setData(src.data);
     }
 
+    Block::Block(Block && src)
+        : data(src.data), size(src.size), error_margin(src.error_margin), allocator(src.allocator) {
+        src.data = nullptr;
+        src.size = 0;
+    }
+
     // Destructor
 
     Block::~Block() {
-        delete[] data;
+        if (data != nullptr) {
+            allocator->deallocate(data, size);
+        }
+    }
+
+    void Block::setDefaultAllocator(BlockAllocator * block_allocator) {
+        default_allocator.store(block_allocator, memory_order_release);
+    }
+
+    BlockAllocator & Block::getDefaultAllocator() {
+        BlockAllocator * chosen = default_allocator.load(memory_order_acquire);
+        return chosen != nullptr ? *chosen : BlockAllocator::getHeap();
     }
 
     // Generates and returns a block of appropriate size according to a user-defined region on an NON-INTERLACED
@@ -40,22 +69,19 @@ namespace imaging {
     // If size > image.width - pos.x, then the block actual size becomes image.width - pos.x
     Block * Block::copyFromImage(Image & src, Image::channel_t channel,
            const vecmath::ivec2 & pos, const size_t & size) {
-        unsigned int chanel_size = src.getWidth() * src.getHeight();
-        unsigned int chanel_offset = channel * chanel_size;
-        unsigned int pos_offset = pos.y * src.getWidth() + pos.x;
-        const Component * pos_address = src.getRawDataPtr() + chanel_offset + pos_offset;
-        
-        if (size == 0 || pos.y >= src.getHeight() || pos.x >= src.getWidth()) {
+        //the region is the one of BlockView, so the copy never reads past the end of the row
+        BlockView view = BlockView::fromImage(src, channel, pos, size);
+        if (view.getSize() == 0) {
             return nullptr;
         }
         
-        Block * result = new Block(size);
-//        Component * data =  new (nothrow) Component[size];
-//        if (data == nullptr) {
-//            return nullptr;
-//        }
-//        copy(pos_address, pos_address+size, data);
-        result->setData(pos_address);
+        Block * result;
+        try {
+            result = new Block(view.getSize());
+        } catch (const bad_alloc &) {
+            return nullptr;
+        }
+        result->setData(view.getDataPtr());
         
         return result;
         
@@ -78,11 +104,9 @@ namespace imaging {
 
     // Creates a COPY of the current block and reverses the order of its elements.
     Block Block::reverse() const {
-        Block result(size);
-        
-        for (int i = 0; i < size/2; ++i ) {
-            result.data[i] = data[size-i];
-        }
+        Block result(size, *allocator);
+        result.error_margin = error_margin;
+        reverse_copy(data, data + size, result.data);
         
         return result;
     }
@@ -119,21 +143,9 @@ namespace imaging {
         if (size != rhs.size) {
             return false;
         }
-        if (error_margin == 0) {
-            for (int i = 0; i < size; i++) {
-                if (data[i] != rhs.data[i]) {
-                    return false;
-                }
-            }
-        } else {
-            for (int i = 0; i < size; i++) {
-                if (abs( ((int) data[i]) - ((int) rhs.data[i]) ) <= error_margin ) {
-                    return false;
-                }
-            }
-        }
-        
-        return true;
+        //the vectorized kernels compare 16 or 32 components per step and
+        //take the plain equality path themselves when the margin is 0
+        return segmentsEqual(data, rhs.data, size, error_margin);
     }
 
     // The "not equal" operator. Should return true if ANY of the elements in the two blocks differ.
@@ -144,13 +156,56 @@ namespace imaging {
 
     // Assignment operator. Be careful: You need to to perform a deep copy of the buffer.
     Block & Block::operator=(const Block & src) {
-        if (size != src.size) {
-            delete[] data;
+        if (this == &src) {
+            return *this;
+        }
+        if (size != src.size || data == nullptr) {
+            if (data != nullptr) {
+                allocator->deallocate(data, size);
+            }
             size = src.size;
-            data = new Component[size];
+            data = allocator->allocate(size);
         }
         
+        error_margin = src.error_margin;
         setData(src.data);
+        return *this;
+    }
+
+    // Move assignment: releases the buffer of the block and takes over the one of src, which is left empty
+    Block & Block::operator=(Block && src) {
+        if (this == &src) {
+            return *this;
+        }
+        if (data != nullptr) {
+            allocator->deallocate(data, size);
+        }
+        data = src.data;
+        size = src.size;
+        allocator = src.allocator;
+        error_margin = src.error_margin;
+        src.data = nullptr;
+        src.size = 0;
+        return *this;
+    }
+
+
+    // Same region semantics as Block::copyFromImage, but nothing is copied. Returns an empty view (size 0)
+    // where copyFromImage would return nullptr. If size > image.width - pos.x, the view is clipped to the
+    // right margin of the image.
+    BlockView BlockView::fromImage(Image & src, Image::channel_t channel,
+           const vecmath::ivec2 & pos, const size_t & size) {
+        if (size == 0 || pos.x < 0 || pos.y < 0 ||
+                (unsigned int) pos.y >= src.getHeight() || (unsigned int) pos.x >= src.getWidth()) {
+            return BlockView(nullptr, 0);
+        }
+
+        size_t chanel_size = (size_t) src.getWidth() * src.getHeight();
+        size_t chanel_offset = channel * chanel_size;
+        size_t pos_offset = (size_t) pos.y * src.getWidth() + pos.x;
+        size_t length = min(size, (size_t) (src.getWidth() - pos.x));
+
+        return BlockView(src.getRawDataPtr() + chanel_offset + pos_offset, length);
     }
 
 
@@ -194,7 +249,7 @@ namespace imaging {
     
     Block::iterator Block::iterator::operator++(int) {
         Block::iterator result(*this);
-        result.iter++;
+        ++iter;
         return result;
     }
     
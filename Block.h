@@ -2,6 +2,8 @@
 
 #include "Image.h"
 #include "vec2.h"
+#include "block_pool.h"
+#include <atomic>
 
 //
 // Bonus!
@@ -30,11 +32,16 @@ namespace imaging
 		size_t size;            // size of (length of) block
 		Component error_margin; // The allowed difference when comparing the cells of two blocks. 
 		                        // This is used in the == operator and allows a "relaxed" equality.
+		BlockAllocator * allocator; // Where the buffer comes from and goes back to
+
+		static std::atomic<BlockAllocator *> default_allocator;
 
 	public:
 		// Constructors 
 		Block(const size_t & block_size);   // Create an emlty block. There is no default constructor. It doesn't make sense.
+		Block(const size_t & block_size, BlockAllocator & block_allocator); // Same, with the buffer taken from block_allocator
 		Block(const Block & src);           // Copy constructor: remember, you need a deep copy of the buffer
+		Block(Block && src);                // Move constructor: takes over the buffer of src, which is left empty (size 0)
 		
 		// Destructor
 		~Block();
@@ -85,6 +92,15 @@ namespace imaging
 
 		// Assignment operator. Be careful: You need to to perform a deep copy of the buffer.
 		Block & operator=(const Block & src);
+
+		// Move assignment: releases the buffer of the block and takes over the one of src, which is left empty
+		Block & operator=(Block && src);
+
+		// Allocator of the blocks made without an explicit one. nullptr restores the heap. Every block keeps the
+		// allocator it was made with (copies too) and gives its buffer back to it, so the default may be changed
+		// at any time, from any thread; the allocator must outlive the blocks made with it.
+		static void setDefaultAllocator(BlockAllocator * block_allocator);
+		static BlockAllocator & getDefaultAllocator();
 		
 		
 	#ifdef USE_BLOCK_ITERATOR
@@ -97,6 +113,38 @@ namespace imaging
 
 	};
 
+	// A non-owning view of a 1 X "size" row segment of an image channel. Unlike Block, the view does not
+	// allocate or copy anything: it keeps a pointer to the first component, the number of components and the
+	// distance (stride) between two consecutive components of the channel. For a NON-INTERLACED image the
+	// stride is 1. The viewed buffer must outlive the view.
+	class BlockView
+	{
+	protected:
+		const Component * data; // First component of the segment (not owned)
+		size_t size;            // Number of components in the segment
+		size_t stride;          // Distance between two consecutive components of the segment
+
+	public:
+		// Constructors
+		BlockView(const Component * src, const size_t & length, const size_t & component_stride = 1)
+			: data(src), size(length), stride(component_stride) {}
+		BlockView(const Block & src)  // View over the contents of an existing block
+			: data(src.getDataPtr()), size(src.getSize()), stride(1) {}
+
+		// Same region semantics as Block::copyFromImage, but nothing is copied. Returns an empty view (size 0)
+		// where copyFromImage would return nullptr. If size > image.width - pos.x, the view is clipped to the
+		// right margin of the image.
+		static BlockView fromImage(Image & src, Image::channel_t channel, const ivec2 & pos, const size_t & size);
+
+		// Accessors
+		size_t getSize() const {return size;}
+		size_t getStride() const {return stride;}
+		const Component * getDataPtr() const {return data;}
+
+		// Return the index-th component of the segment. No bounds are checked, for speed.
+		const Component & operator[] (const size_t index) const {return data[index * stride];}
+	};
+
 
 #ifdef USE_BLOCK_ITERATOR		
 	// Optional
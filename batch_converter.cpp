@@ -0,0 +1,324 @@
+#include "batch_converter.h"
+#include "output_file.h"
+#include "rle_metrics.h"
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <exception>
+
+using namespace std;
+
+namespace imaging {
+
+    //FIFO queue of limited capacity: push blocks while the queue is full, pop blocks
+    //while it is empty. After close, pop drains the remaining items and then fails
+    template <typename T>
+    class BoundedQueue {
+        mutex lock;
+        condition_variable not_empty, not_full;
+        deque<T> items;
+        size_t capacity;
+        bool closed;
+
+    public:
+        BoundedQueue(size_t max_items) : capacity(max_items), closed(false) {}
+
+        void push(T item) {
+            unique_lock<mutex> guard(lock);
+            not_full.wait(guard, [&] () { return items.size() < capacity; });
+            items.push_back(std::move(item));
+            not_empty.notify_one();
+        }
+
+        bool pop(T & item) {
+            unique_lock<mutex> guard(lock);
+            not_empty.wait(guard, [&] () { return !items.empty() || closed; });
+            if (items.empty()) {
+                return false;
+            }
+            item = std::move(items.front());
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        void close() {
+            lock_guard<mutex> guard(lock);
+            closed = true;
+            not_empty.notify_all();
+        }
+    };
+
+    //bounded queue with one deque per consumer. Producers deal items round robin to the
+    //deques; a consumer takes from the front of its own deque and, when that is empty, 
+    //steals from the back of another one, so a worker stuck on a large image does not 
+    //hold up the images queued behind it
+    template <typename T>
+    class WorkStealingQueue {
+        struct Local {
+            mutex lock;
+            deque<T> items;
+        };
+
+        vector<unique_ptr<Local> > locals;
+        mutex lock;
+        condition_variable not_empty, not_full;
+        size_t capacity;
+        size_t queued;       // items pushed and not yet taken, including pushes in progress
+        size_t available;    // items in the deques that no consumer has claimed yet
+        bool closed;
+        atomic<size_t> next_owner;
+
+        bool take(Local & local, bool from_front, T & item) {
+            lock_guard<mutex> guard(local.lock);
+            if (local.items.empty()) {
+                return false;
+            }
+            if (from_front) {
+                item = std::move(local.items.front());
+                local.items.pop_front();
+            } else {
+                item = std::move(local.items.back());
+                local.items.pop_back();
+            }
+            return true;
+        }
+
+    public:
+        WorkStealingQueue(size_t consumers, size_t max_items)
+            : capacity(max_items), queued(0), available(0), closed(false), next_owner(0) {
+            for (size_t i = 0; i < consumers; ++i) {
+                locals.push_back(unique_ptr<Local>(new Local()));
+            }
+        }
+
+        void push(T item) {
+            {
+                unique_lock<mutex> guard(lock);
+                not_full.wait(guard, [&] () { return queued < capacity; });
+                ++queued;
+            }
+            Local & local = *locals[next_owner++ % locals.size()];
+            {
+                lock_guard<mutex> guard(local.lock);
+                local.items.push_back(std::move(item));
+            }
+            lock_guard<mutex> guard(lock);
+            ++available;
+            not_empty.notify_one();
+        }
+
+        bool pop(size_t consumer, T & item) {
+            {
+                unique_lock<mutex> guard(lock);
+                not_empty.wait(guard, [&] () { return available > 0 || closed; });
+                if (available == 0) {
+                    return false;
+                }
+                --available;  // one of the deques holds an item for us now
+            }
+            
+            for (size_t attempt = 0; ; ++attempt) {
+                size_t victim = (consumer + attempt) % locals.size();
+                if (take(*locals[victim], victim == consumer, item)) {
+                    break;
+                }
+            }
+            
+            lock_guard<mutex> guard(lock);
+            --queued;
+            not_full.notify_one();
+            return true;
+        }
+
+        void close() {
+            lock_guard<mutex> guard(lock);
+            closed = true;
+            not_empty.notify_all();
+        }
+    };
+
+    double BatchStageStats::getUtilization(double wall_seconds) const {
+        if (threads == 0 || wall_seconds <= 0) {
+            return 0;
+        }
+        return min(1.0, busy_seconds / (threads * wall_seconds));
+    }
+
+    BatchConverter::BatchConverter()
+        : reader_threads(2), encoder_threads(0), writer_threads(2), queue_capacity(8) {
+        reader_factory = [] () -> ImageReader * { return new RLEImageReader(); };
+    }
+
+    static double secondsSince(chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    BatchReport BatchConverter::run(const std::vector<BatchJob> & jobs) {
+        struct Loaded {
+            size_t job;
+            Image * image;
+        };
+        struct Encoded {
+            size_t job;
+            vector<unsigned char> data;
+        };
+        
+        BatchReport report;
+        unsigned int encoders = encoder_threads ? encoder_threads : max(1u, thread::hardware_concurrency());
+        report.read.threads = reader_threads;
+        report.encode.threads = encoders;
+        report.write.threads = writer_threads;
+        
+        WorkStealingQueue<Loaded> loaded(encoders, queue_capacity);
+        BoundedQueue<Encoded> encoded(queue_capacity);
+        
+        mutex report_lock;
+        auto fail = [&] (size_t job, const string & reason) {
+            lock_guard<mutex> guard(report_lock);
+            report.failed++;
+            report.errors.push_back(jobs[job].input + " -> " + jobs[job].output + ": " + reason);
+        };
+        auto account = [&] (BatchStageStats & stage, double seconds) {
+            lock_guard<mutex> guard(report_lock);
+            stage.items++;
+            stage.busy_seconds += seconds;
+        };
+        
+        atomic<size_t> next_job(0);
+        atomic<unsigned int> active_readers(reader_threads), active_encoders(encoders);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        
+        auto read_stage = [&] () {
+            unique_ptr<ImageReader> reader(reader_factory());
+            for (size_t job = next_job++; job < jobs.size(); job = next_job++) {
+                chrono::steady_clock::time_point t = chrono::steady_clock::now();
+                Image * image = nullptr;
+                try {
+                    image = reader ? reader->read(jobs[job].input) : nullptr;
+                    account(report.read, secondsSince(t));
+                    if (image == nullptr) {
+                        fail(job, "cannot read input");
+                        continue;
+                    }
+                    Loaded item = {job, image};
+                    loaded.push(item);
+                } catch (const exception & e) {
+                    //one bad input fails its own job, not the batch
+                    delete image;
+                    fail(job, e.what());
+                }
+            }
+            if (--active_readers == 0) {
+                loaded.close();
+            }
+        };
+        
+        auto encode_stage = [&] (size_t consumer) {
+            RLEImageWriter writer(settings);
+            Loaded item;
+            while (loaded.pop(consumer, item)) {
+                chrono::steady_clock::time_point t = chrono::steady_clock::now();
+                try {
+                    Encoded result;
+                    result.job = item.job;
+                    writer.encode(*item.image, result.data);
+                    delete item.image;
+                    item.image = nullptr;
+                    account(report.encode, secondsSince(t));
+                    encoded.push(std::move(result));
+                } catch (const exception & e) {
+                    delete item.image;
+                    fail(item.job, e.what());
+                }
+            }
+            if (--active_encoders == 0) {
+                encoded.close();
+            }
+        };
+        
+        auto write_stage = [&] () {
+            Encoded item;
+            while (encoded.pop(item)) {
+                chrono::steady_clock::time_point t = chrono::steady_clock::now();
+                string error = "cannot write output";
+                bool ok;
+                try {
+                    StageTimer timer(STAGE_WRITE);
+                    OutputFile out;
+                    ok = out.open(jobs[item.job].output, settings.getOutputPolicy()) &&
+                         out.writeReference(item.data.data(), item.data.size());
+                    ok = out.close() && ok;
+                } catch (const exception & e) {
+                    error = e.what();
+                    ok = false;
+                }
+                account(report.write, secondsSince(t));
+                if (ok) {
+                    lock_guard<mutex> guard(report_lock);
+                    report.converted++;
+                } else {
+                    addMetric(COUNTER_ERRORS, 1);
+                    fail(item.job, error);
+                }
+            }
+        };
+        
+        vector<thread> pool;
+        for (unsigned int i = 0; i < reader_threads; ++i) {
+            pool.push_back(thread(read_stage));
+        }
+        for (unsigned int i = 0; i < encoders; ++i) {
+            pool.push_back(thread(encode_stage, (size_t) i));
+        }
+        for (unsigned int i = 0; i < writer_threads; ++i) {
+            pool.push_back(thread(write_stage));
+        }
+        for (thread & t : pool) {
+            t.join();
+        }
+        
+        report.wall_seconds = secondsSince(start);
+        return report;
+    }
+
+    bool BatchConverter::loadManifest(const std::string & filename, std::vector<BatchJob> & jobs) {
+        ifstream in(filename);
+        if (!in) {
+            return false;
+        }
+        
+        string line;
+        while (getline(in, line)) {
+            if (!line.empty() && line[line.size() - 1] == '\r') {
+                line.erase(line.size() - 1);
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            
+            //a tab separates paths that may contain spaces
+            BatchJob job;
+            size_t tab = line.find('\t');
+            if (tab != string::npos) {
+                job.input = line.substr(0, tab);
+                job.output = line.substr(tab + 1);
+            } else {
+                stringstream fields(line);
+                fields >> job.input >> job.output;
+            }
+            if (!job.input.empty() && !job.output.empty()) {
+                jobs.push_back(job);
+            }
+        }
+        return true;
+    }
+
+} //namespace imaging
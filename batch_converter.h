@@ -0,0 +1,93 @@
+//------------------------------------------------------------
+//
+// Batch conversion of many images to the RLE format with a 
+// three stage pipeline:
+//
+//   readers  --[bounded queue]-->  encoders  --[bounded queue]-->  writers
+//
+// Reader threads load the input images, a work-stealing pool
+// of encoder threads runs RLEImageWriter::encode and writer
+// threads store the encoded files. The queues are bounded, so
+// a slow stage holds back the stages that feed it instead of 
+// letting decoded images pile up in memory.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include "Image.h"
+#include "rle_format.h"
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace imaging
+{
+	// One conversion: read input, write it as an RLE image to output
+	struct BatchJob
+	{
+		std::string input;
+		std::string output;
+	};
+
+	// Timing of one pipeline stage
+	struct BatchStageStats
+	{
+		unsigned int threads;
+		size_t items;         // Images that went through the stage
+		double busy_seconds;  // Time spent working, summed over the stage threads (queue waits excluded)
+
+		// Fraction of the available thread time the stage was busy, in [0, 1]
+		double getUtilization(double wall_seconds) const;
+
+		BatchStageStats() : threads(0), items(0), busy_seconds(0) {}
+	};
+
+	struct BatchReport
+	{
+		size_t converted;
+		size_t failed;
+		double wall_seconds;
+		BatchStageStats read, encode, write;
+		std::vector<std::string> errors;  // One entry per failed job
+
+		BatchReport() : converted(0), failed(0), wall_seconds(0) {}
+	};
+
+	class BatchConverter
+	{
+	protected:
+		unsigned int reader_threads, encoder_threads, writer_threads;
+		size_t queue_capacity;
+		RLEImageWriter settings;
+		std::function<ImageReader * ()> reader_factory;
+
+	public:
+		// Threads per stage. 0 uses one thread per hardware thread (encoders only; readers and writers
+		// are I/O bound and default to 2).
+		void setReaderThreads(unsigned int count) {reader_threads = count > 0 ? count : 1;}
+		void setEncoderThreads(unsigned int count) {encoder_threads = count;}
+		void setWriterThreads(unsigned int count) {writer_threads = count > 0 ? count : 1;}
+
+		// Maximum number of images waiting between two stages.
+		void setQueueCapacity(size_t images) {queue_capacity = images > 0 ? images : 1;}
+
+		// The encoder settings (block length, threshold, format options and output policy). Every encoder 
+		// thread works on a copy of this writer.
+		RLEImageWriter & getWriterSettings() {return settings;}
+
+		// Creates the reader used by each reader thread. The converter deletes the readers it creates.
+		// Default: RLEImageReader.
+		void setReaderFactory(const std::function<ImageReader * ()> & factory) {reader_factory = factory;}
+
+		// Converts all jobs and returns once every output has been written (or has failed). A job whose read,
+		// encode or write throws fails alone, with the message of the exception as its error.
+		BatchReport run(const std::vector<BatchJob> & jobs);
+
+		// Loads a manifest: one job per line, the input and the output path separated by white space or a tab.
+		// Empty lines and lines starting with '#' are skipped. Returns false if the file cannot be read.
+		static bool loadManifest(const std::string & filename, std::vector<BatchJob> & jobs);
+
+		BatchConverter();
+	};
+
+} //namespace imaging
@@ -0,0 +1,99 @@
+#include "block_pool.h"
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+using namespace std;
+
+namespace imaging {
+
+    class HeapBlockAllocator : public BlockAllocator {
+    public:
+        virtual Component * allocate(size_t size) {
+            return new Component[size];
+        }
+        virtual void deallocate(Component * data, size_t) {
+            delete[] data;
+        }
+    };
+
+    BlockAllocator & BlockAllocator::getHeap() {
+        static HeapBlockAllocator heap;
+        return heap;
+    }
+
+    //the free lists of a thread. The buffers left in them go back to the heap when the thread ends
+    struct BlockFreeLists {
+        unordered_map<size_t, vector<Component *> > lists;
+        
+        void clear() {
+            for (auto & list : lists) {
+                for (Component * data : list.second) {
+                    delete[] data;
+                }
+            }
+            lists.clear();
+        }
+        
+        ~BlockFreeLists() {
+            clear();
+        }
+    };
+
+    //free buffers kept per size and thread, shared by every pool
+    static atomic<size_t> max_cached(64);
+
+    static BlockFreeLists & getFreeLists() {
+        static thread_local BlockFreeLists free_lists;
+        return free_lists;
+    }
+
+    Component * BlockPool::allocate(size_t size) {
+        if (size > 0 && size <= max_block_size) {
+            vector<Component *> & list = getFreeLists().lists[size];
+            if (!list.empty()) {
+                Component * data = list.back();
+                list.pop_back();
+                return data;
+            }
+        }
+        return new Component[size];
+    }
+
+    void BlockPool::deallocate(Component * data, size_t size) {
+        if (data != nullptr && size > 0 && size <= max_block_size) {
+            vector<Component *> & list = getFreeLists().lists[size];
+            size_t limit = max_cached.load(memory_order_relaxed);
+            if (list.size() < limit) {
+                //reserve once, so that a full list never reallocates
+                if (list.capacity() < limit) {
+                    list.reserve(limit);
+                }
+                list.push_back(data);
+                return;
+            }
+        }
+        delete[] data;
+    }
+
+    void BlockPool::setCachedPerSize(size_t buffers) {
+        max_cached = buffers;
+    }
+
+    size_t BlockPool::getCachedPerSize() {
+        return max_cached;
+    }
+
+    void BlockPool::trim() {
+        getFreeLists().clear();
+    }
+
+    size_t BlockPool::getCachedCount() {
+        size_t count = 0;
+        for (auto & list : getFreeLists().lists) {
+            count += list.second.size();
+        }
+        return count;
+    }
+
+} //namespace imaging
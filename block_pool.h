@@ -0,0 +1,59 @@
+//------------------------------------------------------------
+//
+// Allocators for the buffers of Block. The heap allocator is
+// plain new[] / delete[]. BlockPool keeps the buffers of 
+// destroyed blocks in free lists of the thread that destroyed
+// them, one list per block size, so that blocks made and
+// dropped once per segment reuse the same few buffers without
+// going to the global heap or taking a lock.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include "Image.h"
+#include <cstddef>
+
+namespace imaging
+{
+	// Interface of a Block buffer allocator. A buffer is always returned with the size it was allocated with.
+	class BlockAllocator
+	{
+	public:
+		virtual Component * allocate(size_t size) = 0;
+		virtual void deallocate(Component * data, size_t size) = 0;
+		virtual ~BlockAllocator() {}
+
+		// The new[] / delete[] allocator, used when no other is given
+		static BlockAllocator & getHeap();
+	};
+
+	// Pool with per-thread free lists keyed by block size. Buffers that are not in a free list come from
+	// and go to the heap, so a buffer may be released on another thread than the one that allocated it.
+	// The free lists belong to the thread, not to the pool: every BlockPool of a thread shares them, so the
+	// number of buffers they keep is a global setting (setCachedPerSize), and a pool holds no buffers of its
+	// own to release when it is destroyed. The cached buffers are freed when the thread ends (or on trim).
+	class BlockPool : public BlockAllocator
+	{
+	protected:
+		size_t max_block_size;  // Larger blocks are not cached
+
+	public:
+		explicit BlockPool(size_t largest_cached_size = 1 << 16)
+			: max_block_size(largest_cached_size) {}
+
+		virtual Component * allocate(size_t size);
+		virtual void deallocate(Component * data, size_t size);
+
+		// Free buffers kept per size by each thread, for every pool (64 by default). Lists that are
+		// already longer shrink as their buffers are taken.
+		static void setCachedPerSize(size_t buffers);
+		static size_t getCachedPerSize();
+
+		// Frees the buffers cached by the calling thread
+		static void trim();
+
+		// Number of buffers cached by the calling thread, over all sizes
+		static size_t getCachedCount();
+	};
+
+} //namespace imaging
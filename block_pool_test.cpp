@@ -0,0 +1,176 @@
+//------------------------------------------------------------
+//
+// block_pool_test: checks of the Block buffer allocators.
+//
+// The codec encodes through BlockView and never makes a Block,
+// so BlockPool and the buffer handling of Block are checked
+// here directly: the reuse of a freed buffer on the same
+// thread, the limit of setCachedPerSize, blocks too large to
+// cache, trim, buffers freed on another thread than the one
+// that allocated them, the default allocator, and moved-from
+// blocks.
+//
+// usage: block_pool_test
+//
+// Prints every mismatch and exits with 1 if there was any.
+//
+//-------------------------------------------------------------
+
+#include "Image.h"
+#include "vec2.h"
+#include "Block.h"
+#include "block_pool.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <utility>
+
+using namespace std;
+using namespace imaging;
+
+static unsigned int failures = 0;
+
+static void check(bool ok, const string & what) {
+    if (!ok) {
+        cout << "FAIL " << what << endl;
+        ++failures;
+    }
+}
+
+static void checkReuse() {
+    BlockPool::trim();
+    BlockPool pool;
+    Component * first = pool.allocate(100);
+    pool.deallocate(first, 100);
+    check(BlockPool::getCachedCount() == 1, "a freed buffer is cached");
+    Component * other_size = pool.allocate(50);
+    check(other_size != first, "a buffer of another size is not reused");
+    Component * second = pool.allocate(100);
+    check(second == first && BlockPool::getCachedCount() == 0, "a freed buffer is reused on the same thread");
+    pool.deallocate(other_size, 50);
+    BlockPool::trim();
+    pool.deallocate(second, 100);
+
+    //the free lists belong to the thread, so another pool reuses the buffer too
+    BlockPool other;
+    Component * shared = other.allocate(100);
+    check(shared == first, "pools of a thread share the free lists");
+    other.deallocate(shared, 100);
+
+    BlockPool small(64);
+    Component * large = small.allocate(128);
+    small.deallocate(large, 128);
+    check(BlockPool::getCachedCount() == 1, "a buffer above the largest cached size is not cached");
+
+    BlockPool::trim();
+    check(BlockPool::getCachedCount() == 0, "trim frees the cached buffers");
+}
+
+static void checkCacheLimit() {
+    BlockPool::trim();
+    size_t saved = BlockPool::getCachedPerSize();
+    BlockPool pool;
+    vector<Component *> buffers;
+    for (int i = 0; i < 5; ++i) {
+        buffers.push_back(pool.allocate(32));
+    }
+
+    BlockPool::setCachedPerSize(2);
+    check(BlockPool::getCachedPerSize() == 2, "setCachedPerSize");
+    for (Component * data : buffers) {
+        pool.deallocate(data, 32);
+    }
+    check(BlockPool::getCachedCount() == 2, "the free list of a size stops at setCachedPerSize");
+
+    //a smaller limit applies to the buffers freed from then on
+    BlockPool::setCachedPerSize(0);
+    pool.deallocate(pool.allocate(16), 16);
+    check(BlockPool::getCachedCount() == 2, "no buffer is cached with a limit of 0");
+
+    BlockPool::setCachedPerSize(saved);
+    BlockPool::trim();
+}
+
+static void checkOtherThread() {
+    BlockPool::trim();
+    BlockPool pool;
+
+    //allocated here, freed on a thread that caches it in its own list and frees it when it ends
+    Component * here = pool.allocate(200);
+    size_t cached_there = 0;
+    thread([&] () {
+        pool.deallocate(here, 200);
+        cached_there = BlockPool::getCachedCount();
+    }).join();
+    check(cached_there == 1 && BlockPool::getCachedCount() == 0, "a buffer freed on another thread goes to its list");
+
+    //allocated on another thread, freed and reused here
+    Component * there = nullptr;
+    thread([&] () {
+        there = pool.allocate(200);
+    }).join();
+    pool.deallocate(there, 200);
+    check(BlockPool::getCachedCount() == 1 && pool.allocate(200) == there,
+        "a buffer allocated on another thread is reused after it is freed here");
+    pool.deallocate(there, 200);
+    BlockPool::trim();
+}
+
+static void checkBlocks() {
+    BlockPool::trim();
+    BlockPool pool;
+
+    Component * buffer;
+    {
+        Block block(64, pool);
+        buffer = block.getDataPtr();
+    }
+    check(BlockPool::getCachedCount() == 1, "a destroyed block gives its buffer back to its pool");
+    {
+        Block block(64, pool);
+        check(block.getDataPtr() == buffer, "a block reuses the buffer of a destroyed one");
+        Block copy(block);
+        check(copy.getDataPtr() != buffer && copy.getSize() == 64, "a copy gets a buffer of its own");
+    }
+
+    Block::setDefaultAllocator(&pool);
+    check(&Block::getDefaultAllocator() == &pool, "setDefaultAllocator");
+    BlockPool::trim();
+    {
+        Block block(24);
+    }
+    check(BlockPool::getCachedCount() == 1, "blocks made without an allocator use the default one");
+    Block::setDefaultAllocator(nullptr);
+    check(&Block::getDefaultAllocator() == &BlockAllocator::getHeap(), "nullptr restores the heap");
+
+    Component values[] = {1, 2, 3, 4};
+    Block source(4, pool);
+    source.setData(values);
+    buffer = source.getDataPtr();
+    Block moved(std::move(source));
+    check(moved.getDataPtr() == buffer && moved.getSize() == 4 && moved[3] == 4, "the move constructor takes the buffer");
+    check(source.getSize() == 0 && source.getDataPtr() == nullptr, "a moved-from block is empty");
+
+    Block target(8);
+    target = std::move(moved);
+    check(target.getDataPtr() == buffer && target.getSize() == 4 && target[0] == 1, "move assignment takes the buffer");
+    check(moved.getSize() == 0 && moved.getDataPtr() == nullptr, "a block moved from by assignment is empty");
+
+    //moved-from blocks can still be copied, assigned and destroyed
+    Block empty(source);
+    check(empty.getSize() == 0, "a copy of a moved-from block is empty");
+    moved = target;
+    check(moved.getSize() == 4 && moved.getDataPtr() != buffer && moved == target, "assignment to a moved-from block");
+}
+
+int main() {
+    checkReuse();
+    checkCacheLimit();
+    checkOtherThread();
+    checkBlocks();
+    BlockPool::trim();
+
+    cout << failures << " failures" << endl;
+    return failures == 0 ? 0 : 1;
+}
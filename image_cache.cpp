@@ -0,0 +1,186 @@
+#include "image_cache.h"
+#include "rle_metrics.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX_IO
+#include <sys/stat.h>
+#elif __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define HAVE_FILESYSTEM
+#include <filesystem>
+#include <cstdint>
+#include <chrono>
+#else
+#include <fstream>
+#endif
+
+using namespace std;
+
+namespace imaging {
+
+    //without stat there is no device and inode, and the file is known by its size
+    //and modification time only (by its size only, where even that is missing)
+    bool FileIdentity::get(const std::string & filename, FileIdentity & identity) {
+#ifdef HAVE_POSIX_IO
+        struct stat info;
+        if (stat(filename.c_str(), &info) != 0) {
+            return false;
+        }
+        identity.device = (unsigned long long) info.st_dev;
+        identity.inode = (unsigned long long) info.st_ino;
+        identity.size = (unsigned long long) info.st_size;
+        
+        //whole seconds only where the nanoseconds are not reported
+#if defined(__APPLE__)
+        identity.modified = (long long) info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+        identity.modified = (long long) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#else
+        identity.modified = (long long) info.st_mtime * 1000000000;
+#endif
+        return true;
+#elif defined(HAVE_FILESYSTEM)
+        std::error_code error;
+        std::filesystem::path path(filename);
+        uintmax_t size = std::filesystem::file_size(path, error);
+        if (error) {
+            return false;
+        }
+        std::filesystem::file_time_type modified = std::filesystem::last_write_time(path, error);
+        if (error) {
+            return false;
+        }
+        identity.device = 0;
+        identity.inode = 0;
+        identity.size = (unsigned long long) size;
+        identity.modified = (long long) chrono::duration_cast<chrono::nanoseconds>(modified.time_since_epoch()).count();
+        return true;
+#else
+        ifstream file(filename, ios_base::in | ios_base::binary | ios_base::ate);
+        if (!file) {
+            return false;
+        }
+        identity.device = 0;
+        identity.inode = 0;
+        identity.size = (unsigned long long) file.tellg();
+        identity.modified = 0;
+        return true;
+#endif
+    }
+
+    //the pixels and the image object itself
+    static size_t imageBytes(const Image & image) {
+        return (size_t) image.getWidth() * image.getHeight() * 3 * sizeof(Component) + sizeof(Image);
+    }
+
+    ImageCache::ImageCache(size_t byte_budget) 
+        : budget(byte_budget), used(0), hits(0), misses(0), evictions(0) {}
+
+    void ImageCache::erase(std::list<Entry>::iterator entry) {
+        used -= entry->bytes;
+        lookup.erase(entry->filename);
+        entries.erase(entry);
+    }
+
+    void ImageCache::shrink(size_t limit) {
+        while (used > limit && !entries.empty()) {
+            erase(--entries.end());
+            ++evictions;
+        }
+    }
+
+    std::shared_ptr<const Image> ImageCache::get(const std::string & filename, const std::function<Image * ()> & load) {
+        FileIdentity identity;
+        bool known = FileIdentity::get(filename, identity);
+        {
+            lock_guard<mutex> guard(lock);
+            auto found = lookup.find(filename);
+            if (found != lookup.end()) {
+                if (known && found->second->identity == identity) {
+                    entries.splice(entries.begin(), entries, found->second);
+                    ++hits;
+                    addMetric(COUNTER_CACHE_HITS, 1);
+                    return found->second->image;
+                }
+                //the file changed or is gone, its image is of no more use
+                erase(found->second);
+            }
+            ++misses;
+        }
+        addMetric(COUNTER_CACHE_MISSES, 1);
+        
+        shared_ptr<const Image> image(load());
+        
+        //a file rewritten during the load may have been read half old, half new
+        FileIdentity loaded;
+        if (!image || !known || !FileIdentity::get(filename, loaded) || loaded != identity) {
+            return image;
+        }
+        
+        size_t bytes = imageBytes(*image);
+        lock_guard<mutex> guard(lock);
+        if (bytes > budget) {
+            return image;
+        }
+        auto found = lookup.find(filename);
+        if (found != lookup.end()) {
+            erase(found->second);
+        }
+        shrink(budget - bytes);
+        entries.push_front(Entry{filename, identity, image, bytes});
+        lookup[filename] = entries.begin();
+        used += bytes;
+        return image;
+    }
+
+    void ImageCache::remove(const std::string & filename) {
+        lock_guard<mutex> guard(lock);
+        auto found = lookup.find(filename);
+        if (found != lookup.end()) {
+            erase(found->second);
+        }
+    }
+
+    void ImageCache::clear() {
+        lock_guard<mutex> guard(lock);
+        entries.clear();
+        lookup.clear();
+        used = 0;
+    }
+
+    void ImageCache::setBudget(size_t bytes) {
+        lock_guard<mutex> guard(lock);
+        budget = bytes;
+        shrink(budget);
+    }
+
+    size_t ImageCache::getBudget() {
+        lock_guard<mutex> guard(lock);
+        return budget;
+    }
+
+    size_t ImageCache::getSize() {
+        lock_guard<mutex> guard(lock);
+        return used;
+    }
+
+    size_t ImageCache::getCount() {
+        lock_guard<mutex> guard(lock);
+        return entries.size();
+    }
+
+    unsigned long long ImageCache::getHits() {
+        lock_guard<mutex> guard(lock);
+        return hits;
+    }
+
+    unsigned long long ImageCache::getMisses() {
+        lock_guard<mutex> guard(lock);
+        return misses;
+    }
+
+    unsigned long long ImageCache::getEvictions() {
+        lock_guard<mutex> guard(lock);
+        return evictions;
+    }
+
+} //namespace imaging
@@ -0,0 +1,93 @@
+//------------------------------------------------------------
+//
+// Cache of decoded images, shared by any number of readers and
+// threads. An image is cached under its path together with the
+// device, inode, modification time and size of the file, so a
+// file that is replaced or rewritten is decoded again instead
+// of being served stale. The cache holds up to a byte budget of
+// decoded pixels and drops the least recently used images to
+// stay within it. The images are handed out read-only, shared
+// with the cache, so a hit costs a stat and a lookup.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include "Image.h"
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+namespace imaging
+{
+	// The identity of a file: equal identities mean the contents have not changed. Where stat is not available
+	// the device and inode are 0, so only the size and modification time tell files apart.
+	struct FileIdentity
+	{
+		unsigned long long device;
+		unsigned long long inode;
+		long long modified;         // Modification time in nanoseconds
+		unsigned long long size;
+
+		bool operator==(const FileIdentity & other) const {
+			return device == other.device && inode == other.inode && modified == other.modified && size == other.size;
+		}
+		bool operator!=(const FileIdentity & other) const {return !(*this == other);}
+
+		// Returns false if the file does not exist or cannot be queried
+		static bool get(const std::string & filename, FileIdentity & identity);
+	};
+
+	class ImageCache
+	{
+	protected:
+		struct Entry
+		{
+			std::string filename;
+			FileIdentity identity;
+			std::shared_ptr<const Image> image;
+			size_t bytes;
+		};
+
+		std::mutex lock;
+		std::list<Entry> entries;                                            // Most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator> lookup;  // By file name
+		size_t budget;
+		size_t used;
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long evictions;
+
+		void erase(std::list<Entry>::iterator entry);
+		void shrink(size_t limit);
+
+	public:
+		explicit ImageCache(size_t byte_budget);
+
+		// Returns the cached image of the file if the file has not changed since it was cached. Otherwise calls
+		// load (without holding the cache) and caches the image it returns, unless the image alone is over
+		// the budget or the file changed while it was loaded. Returns nullptr, caching nothing, if load does.
+		// Two threads missing the same file at once both load it.
+		std::shared_ptr<const Image> get(const std::string & filename, const std::function<Image * ()> & load);
+
+		// Drops the image of the file, if any
+		void remove(const std::string & filename);
+		void clear();
+
+		// Bytes of decoded pixels the cache may hold. Lowering it drops images right away.
+		void setBudget(size_t bytes);
+		size_t getBudget();
+
+		// Bytes of the cached images
+		size_t getSize();
+		size_t getCount();
+
+		unsigned long long getHits();
+		unsigned long long getMisses();
+		// Images dropped to stay within the budget
+		unsigned long long getEvictions();
+	};
+
+} //namespace imaging
@@ -0,0 +1,491 @@
+#include "io_ring.h"
+#include "task_pool.h"
+#include "rle_metrics.h"
+#include <fstream>
+#include <atomic>
+#include <exception>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#endif
+#endif
+#endif
+
+using namespace std;
+
+namespace imaging {
+
+    static atomic<bool> ring_enabled(true);
+
+    //the blocking versions, for the I/O pool
+    static void readOnPool(const string & filename, const function<void(FileData)> & done) {
+        getIOPool().submit([filename, done] () {
+            FileData data;
+            try {
+                StageTimer read_timer(STAGE_PAYLOAD_READ);
+                ifstream in(filename, ios_base::in | ios_base::binary | ios_base::ate);
+                if (in) {
+                    data = make_shared<vector<unsigned char> >((size_t) in.tellg());
+                    in.seekg(0, ifstream::beg);
+                    in.read((char*) data->data(), data->size());
+                }
+                if (!in) {
+                    data.reset();
+                }
+            } catch (const exception &) {
+                data.reset();
+            }
+            done(data);
+        });
+    }
+
+    static void writeOnPool(const string & filename, const OutputPolicy & policy,
+            shared_ptr<const vector<unsigned char> > data, const function<void(bool)> & done) {
+        getIOPool().submit([filename, policy, data, done] () {
+            bool written;
+            try {
+                StageTimer write_timer(STAGE_WRITE);
+                OutputFile out;
+                written = out.open(filename, policy) && out.writeReference(data->data(), data->size());
+                written = out.close() && written;
+            } catch (const exception &) {
+                written = false;
+            }
+            done(written);
+        });
+    }
+
+#ifdef HAVE_IO_URING
+    //slots of the ring; more requests wait in a queue of their own
+    static const unsigned int RING_ENTRIES = 64;
+    //the largest transfer of one submission, longer ones are split
+    static const size_t RING_CHUNK = 1 << 30;
+
+    //one file being read or written. A request has a single submission in the ring
+    //at a time: the next part of the transfer, the sync, or a no-op that reports a
+    //file that could not be opened
+    struct RingRequest {
+        int file;
+        bool write;
+        bool syncing;
+        OutputPolicy::sync_t sync;
+        FileData buffer;                                // what a read fills
+        shared_ptr<const vector<unsigned char> > source; // what a write sends
+        unsigned char * data;
+        size_t size;
+        size_t transferred;
+        struct iovec transfer;                           // the part of the data the ring is moving
+        function<void(FileData)> read_done;
+        function<void(bool)> write_done;
+        StageTimer timer;
+
+        RingRequest(bool is_write)
+            : file(-1), write(is_write), syncing(false), sync(OutputPolicy::SYNC_NONE), data(nullptr), size(0),
+              transferred(0), timer(is_write ? STAGE_WRITE : STAGE_PAYLOAD_READ) {}
+    };
+
+    class IORing {
+    protected:
+        int fd;
+        unsigned int entries;
+        unsigned char * sq_ring;
+        size_t sq_ring_size;
+        unsigned char * cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe * sqes;
+        size_t sqes_size;
+        unsigned int * sq_tail;
+        unsigned int sq_mask;
+        unsigned int * sq_array;
+        unsigned int * cq_head;
+        unsigned int * cq_tail;
+        unsigned int cq_mask;
+        struct io_uring_cqe * cqes;
+
+        mutex lock;
+        unsigned int in_flight;          // requests holding a slot
+        unsigned int unsubmitted;        // entries at the tail of the submission queue the kernel has not taken
+        deque<RingRequest *> waiting;    // requests for the slots that free up
+        deque<RingRequest *> rejected;   // requests whose submission the kernel refused, to finish as failed
+        bool stopping;
+        thread completion;
+
+        void release();
+        bool queue(RingRequest * request);
+        void flushRejected();
+        void finish(RingRequest * request, bool ok);
+        void complete(RingRequest * request, int result);
+        void work();
+
+    public:
+        explicit IORing(unsigned int requested_entries);
+        ~IORing();
+
+        bool isOpen() const {return fd >= 0;}
+        void start(RingRequest * request);
+    };
+
+    static int ringSetup(unsigned int entries, struct io_uring_params * params) {
+        return (int) syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    static int ringEnter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+        return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    //a ring the kernel refuses leaves fd at -1, and the caller falls back to the pool
+    IORing::IORing(unsigned int requested_entries)
+        : fd(-1), entries(0), sq_ring(nullptr), sq_ring_size(0), cq_ring(nullptr), cq_ring_size(0), sqes(nullptr),
+          sqes_size(0), in_flight(0), unsubmitted(0), stopping(false) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = ringSetup(requested_entries, &params);
+        if (fd < 0) {
+            fd = -1;
+            return;
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+        }
+        void * sq = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void * cq = single_mmap ? sq :
+                mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        void * entries_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        sq_ring = sq == MAP_FAILED ? nullptr : (unsigned char *) sq;
+        cq_ring = cq == MAP_FAILED ? nullptr : (unsigned char *) cq;
+        sqes = entries_map == MAP_FAILED ? nullptr : (struct io_uring_sqe *) entries_map;
+
+        if (sq_ring != nullptr && cq_ring != nullptr && sqes != nullptr) {
+            entries = params.sq_entries;
+            sq_tail = (unsigned int *) (sq_ring + params.sq_off.tail);
+            sq_mask = *(unsigned int *) (sq_ring + params.sq_off.ring_mask);
+            sq_array = (unsigned int *) (sq_ring + params.sq_off.array);
+            cq_head = (unsigned int *) (cq_ring + params.cq_off.head);
+            cq_tail = (unsigned int *) (cq_ring + params.cq_off.tail);
+            cq_mask = *(unsigned int *) (cq_ring + params.cq_off.ring_mask);
+            cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+            try {
+                completion = thread([this] () { work(); });
+                return;
+            } catch (const exception &) {
+            }
+        }
+        release();
+    }
+
+    void IORing::release() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != nullptr && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != nullptr) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        sqes = nullptr;
+        sq_ring = cq_ring = nullptr;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        fd = -1;
+    }
+
+    //the requests still in the ring complete first. A no-op wakes the completion thread; if the
+    //kernel refuses it, nothing would, so the thread and the ring are left to the end of the process
+    IORing::~IORing() {
+        if (!isOpen()) {
+            return;
+        }
+        bool woken;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+            woken = queue(nullptr);
+        }
+        flushRejected();
+        if (!woken) {
+            completion.detach();
+            return;
+        }
+        completion.join();
+        release();
+    }
+
+    //takes a slot for the request, or leaves it to the next slot that frees up. Never waits,
+    //so that the callbacks on the completion thread may start requests of their own
+    void IORing::start(RingRequest * request) {
+        {
+            lock_guard<mutex> guard(lock);
+            if (in_flight == entries) {
+                waiting.push_back(request);
+                return;
+            }
+            ++in_flight;
+            queue(request);
+        }
+        flushRejected();
+    }
+
+    //submits the next step of a request, with any entries the kernel has not taken before it; the
+    //caller holds the lock. There are never more requests in flight than entries, so the submission
+    //queue always has room, and the completion queue (twice as large) never overflows. Entries the
+    //kernel refuses for good are taken back from the queue and their requests go to rejected, for
+    //the caller to finish once it lets go of the lock. Returns false if that happened
+    bool IORing::queue(RingRequest * request) {
+        unsigned int tail = *sq_tail;
+        unsigned int index = tail & sq_mask;
+        struct io_uring_sqe & sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.user_data = (unsigned long long) (uintptr_t) request;
+
+        if (request == nullptr || request->file < 0) {
+            sqe.opcode = IORING_OP_NOP;
+        } else if (request->syncing) {
+            sqe.opcode = IORING_OP_FSYNC;
+            sqe.fd = request->file;
+            sqe.fsync_flags = request->sync == OutputPolicy::SYNC_DATA ? IORING_FSYNC_DATASYNC : 0;
+        } else {
+            request->transfer.iov_base = request->data + request->transferred;
+            request->transfer.iov_len = min(request->size - request->transferred, RING_CHUNK);
+            sqe.opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe.fd = request->file;
+            sqe.addr = (unsigned long long) (uintptr_t) &request->transfer;
+            sqe.len = 1;
+            sqe.off = request->transferred;
+        }
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++unsubmitted;
+
+        //the kernel may take fewer entries than offered, or none for a while
+        for (int attempt = 0; unsubmitted > 0 && attempt < 100; ) {
+            int submitted = ringEnter(fd, unsubmitted, 0, 0);
+            if (submitted > 0) {
+                unsubmitted -= min((unsigned int) submitted, unsubmitted);
+                attempt = 0;
+                continue;
+            }
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                break;
+            }
+            ++attempt;
+            this_thread::yield();
+        }
+        if (unsubmitted == 0) {
+            return true;
+        }
+
+        //the kernel has not seen these entries, so moving the tail back withdraws them
+        tail += 1;
+        for (unsigned int i = unsubmitted; i > 0; --i) {
+            RingRequest * refused = (RingRequest *) (uintptr_t) sqes[(tail - i) & sq_mask].user_data;
+            if (refused != nullptr) {
+                rejected.push_back(refused);
+            }
+        }
+        __atomic_store_n(sq_tail, tail - unsubmitted, __ATOMIC_RELEASE);
+        unsubmitted = 0;
+        return false;
+    }
+
+    //finishes the requests the kernel refused as failed. Their slots go to waiting requests,
+    //which may be refused in turn
+    void IORing::flushRejected() {
+        for (;;) {
+            RingRequest * request;
+            {
+                lock_guard<mutex> guard(lock);
+                if (rejected.empty()) {
+                    return;
+                }
+                request = rejected.front();
+                rejected.pop_front();
+            }
+            finish(request, false);
+        }
+    }
+
+    //runs on the completion thread with the result of the last submission of the request
+    void IORing::complete(RingRequest * request, int result) {
+        if (result == -EINTR || result == -EAGAIN) {
+            lock_guard<mutex> guard(lock);
+            queue(request);
+            return;
+        }
+        if (request->file < 0 || result < 0) {
+            finish(request, false);
+            return;
+        }
+        if (!request->syncing) {
+            //a transfer that stops short means the file has changed under the read, or the disk is full
+            if (result == 0 && request->transferred < request->size) {
+                finish(request, false);
+                return;
+            }
+            request->transferred += (size_t) result;
+            if (request->transferred < request->size) {
+                lock_guard<mutex> guard(lock);
+                queue(request);
+                return;
+            }
+            if (request->write && request->sync != OutputPolicy::SYNC_NONE) {
+                request->syncing = true;
+                lock_guard<mutex> guard(lock);
+                queue(request);
+                return;
+            }
+        }
+        finish(request, true);
+    }
+
+    //closes the file, hands the slot to a waiting request and calls back. A callback that throws
+    //is dropped, as on the pools
+    void IORing::finish(RingRequest * request, bool ok) {
+        if (request->file >= 0 && ::close(request->file) != 0 && request->write) {
+            ok = false;
+        }
+        request->timer.stop();
+        {
+            lock_guard<mutex> guard(lock);
+            if (waiting.empty()) {
+                --in_flight;
+            } else {
+                queue(waiting.front());
+                waiting.pop_front();
+            }
+        }
+        try {
+            if (request->write) {
+                request->write_done(ok);
+            } else {
+                request->read_done(ok ? request->buffer : FileData());
+            }
+        } catch (...) {
+        }
+        delete request;
+    }
+
+    void IORing::work() {
+        for (;;) {
+            unsigned int head = *cq_head;
+            unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                {
+                    lock_guard<mutex> guard(lock);
+                    if (stopping && in_flight == 0) {
+                        return;
+                    }
+                }
+                ringEnter(fd, 0, 1, IORING_ENTER_GETEVENTS);
+                continue;
+            }
+            struct io_uring_cqe event = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            RingRequest * request = (RingRequest *) (uintptr_t) event.user_data;
+            if (request != nullptr) {
+                complete(request, event.res);
+                flushRejected();
+            }
+        }
+    }
+
+    //made after the compute pool, so it is destroyed first and its last callbacks still find the pool
+    static IORing * getRing() {
+        if (!ring_enabled) {
+            return nullptr;
+        }
+        getComputePool();
+        static IORing ring(RING_ENTRIES);
+        return ring.isOpen() ? &ring : nullptr;
+    }
+
+    //a file that cannot be opened still completes on the ring, as a no-op
+    void readFileAsync(const std::string & filename, const std::function<void(FileData)> & done) {
+        IORing * ring = getRing();
+        if (ring == nullptr) {
+            readOnPool(filename, done);
+            return;
+        }
+        RingRequest * request = new RingRequest(false);
+        request->read_done = done;
+        request->file = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        try {
+            if (request->file >= 0 && fstat(request->file, &info) == 0) {
+                request->buffer = make_shared<vector<unsigned char> >((size_t) info.st_size);
+                request->data = request->buffer->data();
+                request->size = request->buffer->size();
+            } else if (request->file >= 0) {
+                ::close(request->file);
+                request->file = -1;
+            }
+        } catch (const exception &) {
+            ::close(request->file);
+            request->file = -1;
+            request->buffer.reset();
+        }
+        ring->start(request);
+    }
+
+    void writeFileAsync(const std::string & filename, const OutputPolicy & policy,
+            std::shared_ptr<const std::vector<unsigned char> > data, const std::function<void(bool)> & done) {
+        IORing * ring = policy.direct_io ? nullptr : getRing();
+        if (ring == nullptr) {
+            writeOnPool(filename, policy, data, done);
+            return;
+        }
+        RingRequest * request = new RingRequest(true);
+        request->write_done = done;
+        request->sync = policy.sync;
+        request->source = data;
+        request->data = (unsigned char *) data->data();
+        request->size = data->size();
+        request->file = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        ring->start(request);
+    }
+
+    bool isIORingEnabled() {
+        return getRing() != nullptr;
+    }
+#else
+    void readFileAsync(const std::string & filename, const std::function<void(FileData)> & done) {
+        readOnPool(filename, done);
+    }
+
+    void writeFileAsync(const std::string & filename, const OutputPolicy & policy,
+            std::shared_ptr<const std::vector<unsigned char> > data, const std::function<void(bool)> & done) {
+        writeOnPool(filename, policy, data, done);
+    }
+
+    bool isIORingEnabled() {
+        return false;
+    }
+#endif
+
+    void setIORingEnabled(bool enable) {
+        ring_enabled = enable;
+    }
+
+} //namespace imaging
@@ -0,0 +1,42 @@
+//------------------------------------------------------------
+//
+// Whole file reads and writes of the asynchronous calls of the
+// RLE reader and writer. On Linux the transfers go through an
+// io_uring submission ring, set up with the raw system calls:
+// the calling thread opens the file and queues the request,
+// and a single completion thread hands the results on, so no
+// thread blocks on the disk. Where io_uring is missing, or the
+// kernel refuses to set up a ring, the I/O pool of task_pool.h
+// does the same work with blocking calls.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include "output_file.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+namespace imaging
+{
+	typedef std::shared_ptr<std::vector<unsigned char> > FileData;
+
+	// Calls done with the contents of the file, or with nullptr if it cannot be read. done runs on an I/O
+	// thread (the completion thread of the ring or a thread of the I/O pool) and must not block. If the kernel
+	// refuses to take the request into the ring, done is called with the failure on the calling thread.
+	void readFileAsync(const std::string & filename, const std::function<void(FileData)> & done);
+
+	// Creates (or truncates) the file, writes data to it and applies the sync policy. done gets false if any
+	// of it fails, and runs as for readFileAsync. Direct I/O needs aligned buffers, so with direct_io set the
+	// file is written on the I/O pool through OutputFile.
+	void writeFileAsync(const std::string & filename, const OutputPolicy & policy,
+		std::shared_ptr<const std::vector<unsigned char> > data, const std::function<void(bool)> & done);
+
+	// Off sends the file I/O to the I/O pool even where io_uring is available. Default is on.
+	void setIORingEnabled(bool enable);
+
+	// true when the file I/O of the asynchronous calls goes through io_uring
+	bool isIORingEnabled();
+
+} //namespace imaging
@@ -0,0 +1,88 @@
+#include "mapped_file.h"
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace imaging {
+
+    bool MappedFile::open(const std::string & filename, access_t access) {
+        close();
+        
+#ifdef HAVE_MMAP
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        
+        size = (size_t) info.st_size;
+        if (size > 0) {
+            void * region = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (region != MAP_FAILED) {
+                madvise(region, size, access == SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+                data = (const unsigned char *) region;
+                mapped = true;
+                ::close(fd);  // the mapping keeps its own reference to the file
+                return true;
+            }
+        }
+        ::close(fd);
+#endif
+        
+        //empty file, or no mmap: fall back to a plain read
+        ifstream in(filename, ios_base::in | ios_base::binary);
+        if (!in) {
+            size = 0;
+            return false;
+        }
+        in.seekg(0, ifstream::end);
+        size = (size_t) in.tellg();
+        in.seekg(0, ifstream::beg);
+        buffer.resize(size);
+        in.read((char*) buffer.data(), size);
+        data = buffer.data();
+        return true;
+    }
+
+    void MappedFile::close() {
+#ifdef HAVE_MMAP
+        if (mapped) {
+            munmap((void *) data, size);
+        }
+#endif
+        buffer.clear();
+        data = nullptr;
+        size = 0;
+        mapped = false;
+    }
+
+    void MappedFile::willNeed(size_t offset, size_t length) const {
+#ifdef HAVE_MMAP
+        if (!mapped || offset >= size) {
+            return;
+        }
+        //madvise wants a page aligned start
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t begin = offset - offset % page;
+        size_t end = offset + length < size ? offset + length : size;
+        madvise((void *) (data + begin), end - begin, MADV_WILLNEED);
+#endif
+    }
+
+    MappedFile::~MappedFile() {
+        close();
+    }
+
+} //namespace imaging
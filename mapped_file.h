@@ -0,0 +1,57 @@
+//------------------------------------------------------------
+//
+// Read-only memory mapping of a whole file. On POSIX systems 
+// the file is mapped with mmap and its pages come straight
+// from the page cache; elsewhere the file is read into a
+// heap buffer, so callers can use the same code path.
+//
+// A mapped file must not be truncated while it is open. The
+// pages past the new end of the file are gone, and reading
+// one raises SIGBUS, which kills the process. A private
+// mapping would not help, since the pages it has not copied
+// still come from the file. Map only files that nothing
+// shrinks or rewrites in place while they are read.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include <string>
+#include <vector>
+
+namespace imaging
+{
+	class MappedFile
+	{
+	public:
+		// How the mapped data is going to be accessed. Passed on to the kernel as a readahead hint.
+		enum access_t {SEQUENTIAL, RANDOM};
+
+	protected:
+		const unsigned char * data;
+		size_t size;
+		bool mapped;                        // true if data points to an mmap-ed region
+		std::vector<unsigned char> buffer;  // Holds the file when it cannot be mapped
+
+	public:
+		// Maps the file. Returns false if the file cannot be opened. Any previous mapping is released.
+		bool open(const std::string & filename, access_t access = SEQUENTIAL);
+
+		// Releases the mapping
+		void close();
+
+		// Hints that the given byte range will be needed soon, so the kernel can start reading it in.
+		void willNeed(size_t offset, size_t length) const;
+
+		const unsigned char * getDataPtr() const {return data;}
+		size_t getSize() const {return size;}
+
+		MappedFile() : data(nullptr), size(0), mapped(false) {}
+		~MappedFile();
+
+	private:
+		// A mapping cannot be copied
+		MappedFile(const MappedFile &);
+		MappedFile & operator=(const MappedFile &);
+	};
+
+} //namespace imaging
@@ -0,0 +1,282 @@
+#include "output_file.h"
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX_IO
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+namespace imaging {
+
+    static const size_t OUTPUT_ALIGNMENT = 4096;
+    static const size_t OUTPUT_BUFFERS = 4;      // gather buffers filled before an automatic flush
+
+    bool OutputFile::open(const std::string & filename, const OutputPolicy & output_policy) {
+        if (isOpen()) {
+            close();
+        }
+        
+        size_t previous_size = policy.buffer_size;
+        policy = output_policy;
+        policy.buffer_size = max(policy.buffer_size, OUTPUT_ALIGNMENT);
+        policy.buffer_size = (policy.buffer_size + OUTPUT_ALIGNMENT - 1) / OUTPUT_ALIGNMENT * OUTPUT_ALIGNMENT;
+        //buffers of another size cannot be reused
+        if (policy.buffer_size != previous_size) {
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                free(buffers[i]);
+            }
+            buffers.clear();
+        }
+        failed = false;
+        position = 0;
+        current = 0;
+        used = 0;
+        queue.clear();
+        
+#ifdef HAVE_POSIX_IO
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        direct = false;
+    #ifdef O_DIRECT
+        if (policy.direct_io) {
+            fd = ::open(filename.c_str(), flags | O_DIRECT, 0666);
+            direct = fd >= 0;
+        }
+    #endif
+        //not every file system accepts O_DIRECT; write through the page cache then
+        if (fd < 0) {
+            fd = ::open(filename.c_str(), flags, 0666);
+        }
+        return fd >= 0;
+#else
+        stream.open(filename, ios_base::out | ios_base::binary | ios_base::trunc);
+        return stream.is_open();
+#endif
+    }
+
+    bool OutputFile::isOpen() const {
+        return fd >= 0 || stream.is_open();
+    }
+
+    unsigned char * OutputFile::getBuffer(size_t index) {
+        while (buffers.size() <= index) {
+            void * buffer = nullptr;
+#ifdef HAVE_POSIX_IO
+            if (posix_memalign(&buffer, OUTPUT_ALIGNMENT, policy.buffer_size) != 0) {
+                buffer = nullptr;
+            }
+#else
+            buffer = malloc(policy.buffer_size);
+#endif
+            if (buffer == nullptr) {
+                return nullptr;
+            }
+            buffers.push_back((unsigned char *) buffer);
+        }
+        return buffers[index];
+    }
+
+    bool OutputFile::write(const void * data, size_t size) {
+        const unsigned char * src = (const unsigned char *) data;
+        
+        while (size > 0 && !failed) {
+            unsigned char * buffer = getBuffer(current);
+            if (buffer == nullptr) {
+                failed = true;
+                break;
+            }
+            
+            size_t n = min(size, policy.buffer_size - used);
+            memcpy(buffer + used, src, n);
+            //extend the last segment if it ends where this copy starts
+            if (!queue.empty() && queue.back().data + queue.back().size == buffer + used) {
+                queue.back().size += n;
+            } else {
+                Segment segment = {buffer + used, n};
+                queue.push_back(segment);
+            }
+            used += n;
+            src += n;
+            size -= n;
+            
+            if (used == policy.buffer_size) {
+                ++current;
+                used = 0;
+                if (current == OUTPUT_BUFFERS) {
+                    flush();
+                }
+            }
+        }
+        return !failed;
+    }
+
+    bool OutputFile::writeReference(const void * data, size_t size) {
+        if (direct) {
+            return write(data, size);
+        }
+        if (size > 0) {
+            Segment segment = {(const unsigned char *) data, size};
+            queue.push_back(segment);
+        }
+        return !failed;
+    }
+
+    //writes the queued segments in order, as few system calls as possible
+    bool OutputFile::writeQueue() {
+#ifdef HAVE_POSIX_IO
+    #ifdef IOV_MAX
+        const size_t max_vectors = IOV_MAX;
+    #else
+        const size_t max_vectors = 1024;
+    #endif
+        vector<struct iovec> vectors;
+        size_t next = 0;
+        while (next < queue.size() && !failed) {
+            vectors.clear();
+            for (size_t i = next; i < queue.size() && vectors.size() < max_vectors; ++i) {
+                struct iovec v;
+                v.iov_base = (void *) queue[i].data;
+                v.iov_len = queue[i].size;
+                vectors.push_back(v);
+            }
+            next += vectors.size();
+            
+            //writev may write less than asked for: continue from where it stopped
+            size_t first = 0;
+            while (first < vectors.size()) {
+                ssize_t written = ::writev(fd, vectors.data() + first, (int) (vectors.size() - first));
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    failed = true;
+                    break;
+                }
+                position += (unsigned long long) written;
+                size_t left = (size_t) written;
+                while (first < vectors.size() && left >= vectors[first].iov_len) {
+                    left -= vectors[first].iov_len;
+                    ++first;
+                }
+                if (first < vectors.size()) {
+                    vectors[first].iov_base = (char *) vectors[first].iov_base + left;
+                    vectors[first].iov_len -= left;
+                }
+            }
+        }
+#else
+        for (size_t i = 0; i < queue.size(); ++i) {
+            stream.write((const char *) queue[i].data, queue[i].size);
+            position += queue[i].size;
+        }
+        failed = failed || !stream;
+#endif
+        return !failed;
+    }
+
+    bool OutputFile::flush() {
+        if (!isOpen()) {
+            return false;
+        }
+#if defined(HAVE_POSIX_IO) && defined(O_DIRECT)
+        //O_DIRECT needs whole pages: a partial tail (end of file) goes through the page cache
+        if (direct) {
+            size_t total = 0;
+            for (size_t i = 0; i < queue.size(); ++i) {
+                total += queue[i].size;
+            }
+            if (total % OUTPUT_ALIGNMENT != 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                direct = false;
+            }
+        }
+#endif
+        writeQueue();
+        queue.clear();
+        current = 0;
+        used = 0;
+        return !failed;
+    }
+
+    bool OutputFile::writeAt(unsigned long long offset, const void * data, size_t size) {
+        if (!flush()) {
+            return false;
+        }
+#ifdef HAVE_POSIX_IO
+    #ifdef O_DIRECT
+        if (direct) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            direct = false;
+        }
+    #endif
+        const unsigned char * src = (const unsigned char *) data;
+        while (size > 0) {
+            ssize_t written = ::pwrite(fd, src, size, (off_t) offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                break;
+            }
+            src += written;
+            offset += written;
+            size -= (size_t) written;
+        }
+#else
+        stream.seekp((streamoff) offset, ios_base::beg);
+        stream.write((const char *) data, size);
+        stream.seekp(0, ios_base::end);
+        failed = failed || !stream;
+#endif
+        return !failed;
+    }
+
+    bool OutputFile::close() {
+        if (!isOpen()) {
+            return false;
+        }
+        flush();
+#ifdef HAVE_POSIX_IO
+        if (policy.sync == OutputPolicy::SYNC_ALL && fsync(fd) != 0) {
+            failed = true;
+        }
+    #if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+        if (policy.sync == OutputPolicy::SYNC_DATA && fdatasync(fd) != 0) {
+            failed = true;
+        }
+    #else
+        if (policy.sync == OutputPolicy::SYNC_DATA && fsync(fd) != 0) {
+            failed = true;
+        }
+    #endif
+        if (::close(fd) != 0) {
+            failed = true;
+        }
+        fd = -1;
+        direct = false;
+#else
+        stream.flush();
+        failed = failed || !stream;
+        stream.close();
+#endif
+        return !failed;
+    }
+
+    OutputFile::~OutputFile() {
+        if (isOpen()) {
+            close();
+        }
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            free(buffers[i]);
+        }
+    }
+
+} //namespace imaging
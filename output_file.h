@@ -0,0 +1,87 @@
+//------------------------------------------------------------
+//
+// Buffered output file used by the image writers. Small writes
+// are gathered in large, page aligned buffers; large buffers
+// that outlive the write can be queued without a copy. Queued
+// data goes out with a single writev per flush. Optionally the
+// file is written with O_DIRECT and/or synced to disk on close.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+
+namespace imaging
+{
+	struct OutputPolicy
+	{
+		// What to do to make the file durable when it is closed
+		enum sync_t {
+			SYNC_NONE,  // leave it to the OS (default)
+			SYNC_DATA,  // fdatasync: file data and size
+			SYNC_ALL    // fsync: data and all metadata
+		};
+
+		size_t buffer_size;  // Size of a gather buffer. Rounded up to a multiple of 4096
+		bool direct_io;      // Bypass the page cache (O_DIRECT). Ignored where not supported
+		sync_t sync;
+
+		OutputPolicy() : buffer_size(1 << 20), direct_io(false), sync(SYNC_NONE) {}
+	};
+
+	class OutputFile
+	{
+	protected:
+		// A piece of queued data: either a range of one of our buffers or an external buffer
+		struct Segment {
+			const unsigned char * data;
+			size_t size;
+		};
+
+		OutputPolicy policy;
+		int fd;                                  // POSIX file descriptor, -1 if not open
+		std::ofstream stream;                    // Used where POSIX I/O is not available
+		bool direct;                             // The file is currently open with O_DIRECT
+		bool failed;
+		std::vector<unsigned char *> buffers;    // Aligned gather buffers, reused across flushes
+		size_t current;                          // Buffer being filled
+		size_t used;                             // Bytes used in the current buffer
+		std::vector<Segment> queue;              // Data waiting for the next flush, in file order
+		unsigned long long position;             // File offset of the first queued byte
+
+		unsigned char * getBuffer(size_t index);
+		bool writeQueue();
+
+	public:
+		// Creates (or truncates) the file. Returns false if it cannot be opened.
+		bool open(const std::string & filename, const OutputPolicy & output_policy = OutputPolicy());
+
+		// Appends size bytes, copying them to the gather buffers. 
+		bool write(const void * data, size_t size);
+
+		// Appends size bytes without copying them. The data must stay unchanged until the next flush or close.
+		// With direct I/O the data is copied, as O_DIRECT needs aligned buffers.
+		bool writeReference(const void * data, size_t size);
+
+		// Writes out everything queued so far
+		bool flush();
+
+		// Overwrites already written bytes at the given file offset (e.g. to fill in a header). Flushes first.
+		bool writeAt(unsigned long long offset, const void * data, size_t size);
+
+		// Flushes, applies the sync policy and closes the file. Returns false if any write failed.
+		bool close();
+
+		bool isOpen() const;
+
+		OutputFile() : fd(-1), direct(false), failed(false), current(0), used(0), position(0) {}
+		~OutputFile();
+
+	private:
+		OutputFile(const OutputFile &);
+		OutputFile & operator=(const OutputFile &);
+	};
+
+} //namespace imaging
@@ -0,0 +1,375 @@
+//------------------------------------------------------------
+//
+// rle_bench: throughput and size benchmark of the RLE codec.
+//
+// Generates synthetic images (flat, gradient, noisy, 
+// photographic-like and document-like) of several sizes, writes and reads each
+// one with RLEImageWriter / RLEImageReader for every block
+// length and threshold, and prints one JSON object with the
+// results, so that runs of different versions can be diffed.
+//
+// usage: rle_bench [--sizes 256,1024,4096,8192,16384] [--blocks 16,32,64,256]
+//                  [--thresholds 0,4,16] [--corpora flat,gradient,noise,photo,document]
+//                  [--threads N] [--varint] [--index ROWS] [--adaptive] [--dedup]
+//                  [--predict] [--interleaved] [--tile N] [--scan rows|serpentine|zorder|hilbert]
+//                  [--reps N] [--tmp DIR] [--out FILE]
+//
+// With --adaptive the writer picks the threshold of every segment
+// and the thresholds are the per-pixel error bound instead. With
+// --interleaved the images are written and read as RGBRGB pixels
+// (writeInterleaved / readInterleaved). --tile codes the channels in
+// tiles of N X N components, visited in the --scan order.
+// peak_rss_delta_kb is how far the resident size of a case rose
+// above the size at its start (on Linux; elsewhere only the growth
+// of the process peak is seen).
+//
+//-------------------------------------------------------------
+
+#include "Image.h"
+#include "rle_format.h"
+#include "rle_simd.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <new>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace imaging;
+
+//every heap allocation of the process goes through here, so the
+//benchmark can report allocations per encoded/decoded image
+static atomic<unsigned long long> allocation_count(0);
+
+void * operator new(size_t size) {
+    ++allocation_count;
+    void * p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void * operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void * p) noexcept {
+    free(p);
+}
+
+void operator delete[](void * p) noexcept {
+    free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void * p, size_t) noexcept {
+    free(p);
+}
+
+//a field of /proc/self/status in KiB, -1 where there is none
+static long readProcStatus(const string & field) {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, field.size() + 1, field + ":") == 0) {
+            return atol(line.c_str() + field.size() + 1);
+        }
+    }
+    return -1;
+}
+
+//peak resident set size of the process, in KiB (0 if unknown). On Linux it is the
+//peak since the last resetPeakRSS, elsewhere the peak since the process started
+static long getPeakRSS() {
+    long peak = readProcStatus("VmHWM");
+    if (peak >= 0) {
+        return peak;
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    #ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+    #else
+    return usage.ru_maxrss;
+    #endif
+#else
+    return 0;
+#endif
+}
+
+//current resident set size in KiB, or the peak where the current one is not known
+static long getCurrentRSS() {
+    long rss = readProcStatus("VmRSS");
+    return rss >= 0 ? rss : getPeakRSS();
+}
+
+//brings the peak of getPeakRSS down to the current size, where the system allows it
+static void resetPeakRSS() {
+    ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) {
+        clear_refs << "5";
+    }
+}
+
+//small deterministic generator, so every run sees the same corpus
+static unsigned int nextRandom(unsigned int & state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+static Component clampComponent(double v) {
+    return (Component) (v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+//generates a non interlaced image of the given kind
+static vector<Component> generateCorpus(const string & kind, unsigned int width, unsigned int height) {
+    vector<Component> data((size_t) width * height * 3);
+    unsigned int state = width * 31 + height;
+    
+    for (size_t c = 0; c < 3; ++c) {
+        Component * plane = data.data() + c * width * height;
+        for (unsigned int y = 0; y < height; ++y) {
+            for (unsigned int x = 0; x < width; ++x) {
+                double v;
+                if (kind == "flat") {
+                    v = 40 + 80 * c;
+                } else if (kind == "gradient") {
+                    v = 255.0 * (x + y) / (width + height);
+                } else if (kind == "noise") {
+                    v = nextRandom(state) & 0xFF;
+                } else if (kind == "document") {
+                    //"document": lines of text, i.e. the same few glyph rows over and over on a white page
+                    unsigned int line_y = y % 24, glyph_x = x % 64;
+                    bool ink = line_y >= 6 && line_y < 18 && ((glyph_x * 7 + line_y * 13) % 11 < 4) && x % 8 != 0;
+                    v = ink ? 30 + 10 * c : 245;
+                } else {
+                    //"photo": smooth shading, a few hard edges and mild sensor noise
+                    double u = x / (double) width, w = y / (double) height;
+                    v = 110 + 60 * sin(6.0 * u + c) * cos(4.0 * w) + 40 * (((int) (u * 5) + (int) (w * 3)) % 2);
+                    v += (int) (nextRandom(state) % 7) - 3;
+                }
+                plane[(size_t) y * width + x] = clampComponent(v);
+            }
+        }
+    }
+    return data;
+}
+
+static vector<unsigned int> parseList(const string & text) {
+    vector<unsigned int> result;
+    stringstream in(text);
+    string item;
+    while (getline(in, item, ',')) {
+        if (!item.empty()) {
+            result.push_back((unsigned int) strtoul(item.c_str(), nullptr, 10));
+        }
+    }
+    return result;
+}
+
+static vector<string> parseNames(const string & text) {
+    vector<string> result;
+    stringstream in(text);
+    string item;
+    while (getline(in, item, ',')) {
+        if (!item.empty()) {
+            result.push_back(item);
+        }
+    }
+    return result;
+}
+
+static long long getFileSize(const string & filename) {
+    ifstream in(filename, ios_base::in | ios_base::binary | ios_base::ate);
+    return in ? (long long) in.tellg() : -1;
+}
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char ** argv) {
+    vector<unsigned int> sizes = {256, 1024, 4096, 8192, 16384};
+    vector<unsigned int> blocks = {16, 32, 64, 256};
+    vector<unsigned int> thresholds = {0, 4, 16};
+    vector<string> corpora = {"flat", "gradient", "noise", "photo", "document"};
+    unsigned int threads = 1;
+    unsigned int index_rows = 0;
+    unsigned int reps = 3;
+    bool varint = false;
+    bool adaptive = false;
+    bool dedup = false;
+    bool interleaved = false;
+    bool predict = false;
+    unsigned int tile_size = 0;
+    string scan = "rows";
+    string tmp_dir = ".";
+    string out_file;
+    
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--sizes") { sizes = parseList(value); ++i; }
+        else if (arg == "--blocks") { blocks = parseList(value); ++i; }
+        else if (arg == "--thresholds") { thresholds = parseList(value); ++i; }
+        else if (arg == "--corpora") { corpora = parseNames(value); ++i; }
+        else if (arg == "--threads") { threads = (unsigned int) atoi(value.c_str()); ++i; }
+        else if (arg == "--index") { index_rows = (unsigned int) atoi(value.c_str()); ++i; }
+        else if (arg == "--tile") { tile_size = (unsigned int) atoi(value.c_str()); ++i; }
+        else if (arg == "--scan") { scan = value; ++i; }
+        else if (arg == "--reps") { reps = max(1, atoi(value.c_str())); ++i; }
+        else if (arg == "--tmp") { tmp_dir = value; ++i; }
+        else if (arg == "--out") { out_file = value; ++i; }
+        else if (arg == "--varint") { varint = true; }
+        else if (arg == "--adaptive") { adaptive = true; }
+        else if (arg == "--dedup") { dedup = true; }
+        else if (arg == "--interleaved") { interleaved = true; }
+        else if (arg == "--predict") { predict = true; }
+        else {
+            cerr << "usage: rle_bench [--sizes 256,1024] [--blocks 16,32] [--thresholds 0,4] [--corpora flat,noise]\n"
+                 << "                 [--threads N] [--varint] [--index ROWS] [--adaptive] [--dedup]\n"
+                 << "                 [--predict] [--interleaved] [--tile N] [--scan rows|serpentine|zorder|hilbert]\n"
+                 << "                 [--reps N] [--tmp DIR] [--out FILE]" << endl;
+            return 1;
+        }
+    }
+    const char * scan_names[CPI_SCAN_ORDER_COUNT] = {"rows", "serpentine", "zorder", "hilbert"};
+    cpi_scan_order_t scan_order = (cpi_scan_order_t) (find(scan_names, scan_names + CPI_SCAN_ORDER_COUNT, scan) - scan_names);
+    if (scan_order == CPI_SCAN_ORDER_COUNT) {
+        cerr << "unknown scan order " << scan << endl;
+        return 1;
+    }
+    
+    stringstream json;
+    json << "{\n  \"scanner\": \"" << getRunScannerName() << "\",\n"
+         << "  \"threads\": " << threads << ",\n  \"varint\": " << (varint ? "true" : "false") << ",\n"
+         << "  \"index_rows\": " << index_rows << ",\n  \"adaptive\": " << (adaptive ? "true" : "false")
+         << ",\n  \"dedup\": " << (dedup ? "true" : "false") << ",\n  \"predict\": " << (predict ? "true" : "false")
+         << ",\n  \"interleaved\": " << (interleaved ? "true" : "false")
+         << ",\n  \"tile_size\": " << tile_size << ",\n  \"scan\": \"" << scan << "\",\n  \"results\": [";
+    
+    string filename = tmp_dir + "/rle_bench.rle";
+    bool first = true;
+    
+    for (unsigned int size : sizes) {
+        for (const string & kind : corpora) {
+            vector<Component> pixels = generateCorpus(kind, size, size);
+            Image image(size, size, pixels.data(), false);
+            vector<Component> rgb;
+            if (interleaved) {
+                rgb.resize(pixels.size());
+                mergeChannels(pixels.data(), pixels.data() + size * size, pixels.data() + 2 * size * size,
+                        (size_t) size * size, rgb.data());
+            }
+            double raw_mb = (double) size * size * 3 / (1024.0 * 1024.0);
+            
+            for (unsigned int block : blocks) {
+                for (unsigned int threshold : thresholds) {
+                    RLEImageWriter writer;
+                    writer.setBlockDimension(block);
+                    if (adaptive) {
+                        writer.setAdaptive(true);
+                        writer.setQualityBound((Component) threshold);
+                    } else {
+                        writer.setThreshold((Component) threshold);
+                    }
+                    writer.setThreadCount(threads);
+                    writer.setVariableLengthCounts(varint);
+                    writer.setIndexBandRows(index_rows);
+                    writer.setDeduplication(dedup);
+                    writer.setPrediction(predict);
+                    writer.setTiles(tile_size, scan_order);
+                    //the writer reports every file on stdout; keep the JSON clean
+                    writer.setVerbose(false);
+                    RLEImageReader reader;
+                    reader.setThreadCount(threads);
+                    
+                    double encode_time = 1e30, decode_time = 1e30;
+                    unsigned long long encode_allocs = 0, decode_allocs = 0;
+                    bool exact = true;
+                    
+                    //memory the case adds to what the corpus already holds
+                    resetPeakRSS();
+                    long base_rss = getCurrentRSS();
+                    
+                    for (unsigned int rep = 0; rep < reps; ++rep) {
+                        unsigned long long allocs = allocation_count;
+                        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                        if (interleaved) {
+                            writer.writeInterleaved(filename, size, size, rgb.data());
+                        } else {
+                            writer.write(filename, image);
+                        }
+                        encode_time = min(encode_time, secondsSince(start));
+                        encode_allocs = allocation_count - allocs;
+                        
+                        allocs = allocation_count;
+                        start = chrono::steady_clock::now();
+                        if (interleaved) {
+                            vector<Component> decoded_rgb;
+                            unsigned int width, height;
+                            bool read = reader.readInterleaved(filename, decoded_rgb, width, height);
+                            decode_time = min(decode_time, secondsSince(start));
+                            decode_allocs = allocation_count - allocs;
+                            if (!read || (threshold == 0 && decoded_rgb != rgb)) {
+                                exact = false;
+                            }
+                            continue;
+                        }
+                        Image * decoded = reader.read(filename);
+                        decode_time = min(decode_time, secondsSince(start));
+                        decode_allocs = allocation_count - allocs;
+                        
+                        if (decoded == nullptr) {
+                            exact = false;
+                        } else {
+                            if (threshold == 0 && !equal(pixels.begin(), pixels.end(), decoded->getRawDataPtr())) {
+                                exact = false;
+                            }
+                            delete decoded;
+                        }
+                    }
+                    
+                    long long bytes = getFileSize(filename);
+                    json << (first ? "\n" : ",\n") << "    {\"corpus\": \"" << kind << "\", \"width\": " << size
+                         << ", \"height\": " << size << ", \"block_length\": " << block
+                         << ", \"threshold\": " << threshold << ", \"bytes\": " << bytes
+                         << ", \"bytes_per_pixel\": " << (double) bytes / ((double) size * size)
+                         << ", \"encode_mb_s\": " << raw_mb / encode_time
+                         << ", \"decode_mb_s\": " << raw_mb / decode_time
+                         << ", \"encode_allocations\": " << encode_allocs
+                         << ", \"decode_allocations\": " << decode_allocs
+                         << ", \"peak_rss_delta_kb\": " << max(0L, getPeakRSS() - base_rss)
+                         << ", \"lossless_ok\": " << (exact ? "true" : "false") << "}";
+                    first = false;
+                }
+            }
+        }
+    }
+    json << "\n  ]\n}\n";
+    remove(filename.c_str());
+    
+    if (out_file.empty()) {
+        cout << json.str();
+    } else {
+        ofstream out(out_file);
+        out << json.str();
+    }
+    return 0;
+}
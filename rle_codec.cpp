@@ -0,0 +1,920 @@
+#include "rle_codec.h"
+#include "rle_simd.h"
+#include "task_pool.h"
+#include <istream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <exception>
+
+using namespace std;
+
+namespace imaging {
+
+    static const unsigned short CPI_ENDIAN = 258;
+    static const size_t CPI_V2_HEADER_SIZE = 12;
+    static const size_t CPI_V3_HEADER_SIZE = 16;
+
+    //helpers to read/write native order binary fields
+    template <typename T>
+    static T readField(const unsigned char * data) {
+        T value;
+        memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    static void writeField(vector<unsigned char> & out, T value) {
+        const unsigned char * bytes = (const unsigned char *) &value;
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    unsigned int CPIHeader::getBandCount() const {
+        if (band_rows == 0 || height == 0) {
+            return 1;
+        }
+        return (height + band_rows - 1) / band_rows;
+    }
+
+    unsigned int CPIHeader::getBandFirstRow(unsigned int band) const {
+        if (band_rows == 0) {
+            return 0;
+        }
+        return min((unsigned int) height, band * band_rows);
+    }
+
+    unsigned int CPIHeader::getBandLastRow(unsigned int band) const {
+        if (band_rows == 0) {
+            return height;
+        }
+        return min((unsigned int) height, (band + 1) * band_rows);
+    }
+
+    size_t CPIHeader::getRunDataSize(size_t available) const {
+        if (flags & CPI_ADAPTIVE) {
+            return (size_t) min(segment_table, (unsigned long long) available);
+        }
+        return available;
+    }
+
+    //number of bytes of the header fields, judging from the first size bytes. The level
+    //table of a pyramid is sized by its first field: until that is there, the fields up 
+    //to it are counted. Returns 0 if the fixed part is not there yet or is not valid
+    static size_t getCPIHeaderSize(const unsigned char * data, size_t size) {
+        if (size < CPI_V2_HEADER_SIZE || data[0] != 'C' || data[1] != 'P' || data[2] != 'I' ||
+                readField<unsigned short>(data + 4) != CPI_ENDIAN) {
+            return 0;
+        }
+        if (data[3] == 2) {
+            return CPI_V2_HEADER_SIZE;
+        }
+        if (data[3] != 3 || size < CPI_V3_HEADER_SIZE) {
+            return 0;
+        }
+        
+        CPIHeader fixed;
+        fixed.height = readField<unsigned short>(data + 8);
+        fixed.band_rows = readField<unsigned short>(data + 14);
+        unsigned short flags = readField<unsigned short>(data + 12);
+        size_t header_size = CPI_V3_HEADER_SIZE;
+        if (flags & CPI_ADAPTIVE) {
+            header_size += sizeof(unsigned long long);
+        }
+        if (flags & CPI_TILED) {
+            header_size += 2 * sizeof(unsigned short);
+        }
+        if (flags & CPI_INDEXED) {
+            header_size += (3 * (size_t) fixed.getBandCount() + 1) * sizeof(unsigned long long);
+        }
+        if (flags & CPI_PYRAMID) {
+            header_size += sizeof(unsigned short);
+            if (size >= header_size) {
+                size_t levels = readField<unsigned short>(data + header_size - sizeof(unsigned short));
+                header_size += (levels + 1) * sizeof(unsigned long long);
+            }
+        }
+        return header_size;
+    }
+
+    //parses the header fields, with the levels of a pyramid left out of the check
+    static size_t parseCPIFields(const unsigned char * data, size_t size, CPIHeader & header) {
+        size_t header_size = getCPIHeaderSize(data, size);
+        if (header_size == 0 || header_size > size) {
+            return 0;
+        }
+        
+        header.version = data[3];
+        header.width = readField<unsigned short>(data + 6);
+        header.height = readField<unsigned short>(data + 8);
+        header.block_length = readField<unsigned short>(data + 10);
+        header.flags = 0;
+        header.band_rows = 0;
+        header.offsets.clear();
+        header.segment_table = 0;
+        header.tile_size = 0;
+        header.scan_order = CPI_SCAN_ROWS;
+        header.levels.clear();
+        header.size = header_size;
+        
+        if (header.version == 3) {
+            header.flags = readField<unsigned short>(data + 12);
+            header.band_rows = readField<unsigned short>(data + 14);
+            
+            //the extension fields follow in the order of their flags
+            const unsigned char * field = data + CPI_V3_HEADER_SIZE;
+            if (header.flags & CPI_ADAPTIVE) {
+                header.segment_table = readField<unsigned long long>(field);
+                field += sizeof(unsigned long long);
+            }
+            if (header.flags & CPI_TILED) {
+                header.tile_size = readField<unsigned short>(field);
+                header.scan_order = readField<unsigned short>(field + sizeof(unsigned short));
+                field += 2 * sizeof(unsigned short);
+                //bands are rows of tiles, and the curves need power of two tiles
+                bool power_of_two = (header.tile_size & (header.tile_size - 1)) == 0;
+                if (header.tile_size == 0 || header.band_rows != header.tile_size || header.scan_order >= CPI_SCAN_ORDER_COUNT ||
+                        (header.scan_order >= CPI_SCAN_ZORDER && !power_of_two)) {
+                    return 0;
+                }
+            }
+            if (header.flags & CPI_INDEXED) {
+                if (header.band_rows == 0) {
+                    return 0;
+                }
+                size_t entries = 3 * (size_t) header.getBandCount() + 1;
+                const unsigned char * table = field;
+                header.offsets.resize(entries);
+                for (size_t i = 0; i < entries; ++i) {
+                    header.offsets[i] = readField<unsigned long long>(table + i * sizeof(unsigned long long));
+                    //offsets must never go backwards
+                    if (i > 0 && header.offsets[i] < header.offsets[i-1]) {
+                        return 0;
+                    }
+                }
+                field += entries * sizeof(unsigned long long);
+            }
+            if (header.flags & CPI_PYRAMID) {
+                size_t levels = readField<unsigned short>(field);
+                const unsigned char * table = field + sizeof(unsigned short);
+                if (levels == 0 || levels > CPI_MAX_PYRAMID_LEVELS) {
+                    return 0;
+                }
+                header.levels.resize(levels + 1);
+                for (size_t i = 0; i <= levels; ++i) {
+                    header.levels[i] = readField<unsigned long long>(table + i * sizeof(unsigned long long));
+                    if (i > 0 && header.levels[i] < header.levels[i-1]) {
+                        return 0;
+                    }
+                }
+                //the image data starts after the levels
+                if (header.levels.back() > (unsigned long long) (SIZE_MAX - header_size)) {
+                    return 0;
+                }
+                header.size = header_size + (size_t) header.levels.back();
+            }
+        }
+        return header_size;
+    }
+
+    size_t parseCPIHeader(const unsigned char * data, size_t size, CPIHeader & header) {
+        if (parseCPIFields(data, size, header) == 0 || header.size > size) {
+            return 0;
+        }
+        return header.size;
+    }
+
+    bool readCPIHeader(istream & in, CPIHeader & header) {
+        vector<unsigned char> buffer(CPI_V3_HEADER_SIZE);
+        
+        in.read((char*) buffer.data(), CPI_V2_HEADER_SIZE);
+        if (!in) {
+            return false;
+        }
+        if (buffer[3] == 3) {
+            in.read((char*) buffer.data() + CPI_V2_HEADER_SIZE, CPI_V3_HEADER_SIZE - CPI_V2_HEADER_SIZE);
+            if (!in) {
+                return false;
+            }
+        }
+        
+        //the fields are read until the size of all of them is known
+        size_t have = buffer[3] == 3 ? CPI_V3_HEADER_SIZE : CPI_V2_HEADER_SIZE;
+        size_t header_size = getCPIHeaderSize(buffer.data(), have);
+        while (header_size > have) {
+            buffer.resize(header_size);
+            in.read((char*) buffer.data() + have, header_size - have);
+            if (!in) {
+                return false;
+            }
+            have = header_size;
+            header_size = getCPIHeaderSize(buffer.data(), have);
+        }
+        if (header_size == 0 || parseCPIFields(buffer.data(), header_size, header) == 0) {
+            return false;
+        }
+        
+        //leave the stream at the image data, past levels the file must hold
+        if (header.size > header_size) {
+            streampos levels = in.tellg();
+            in.seekg(0, ios_base::end);
+            if (levels < 0 || !in || (unsigned long long) (in.tellg() - levels) < header.size - header_size) {
+                return false;
+            }
+            in.seekg(levels + (streamoff) (header.size - header_size));
+        }
+        return (bool) in;
+    }
+
+    void serializeCPIHeader(const CPIHeader & header, vector<unsigned char> & out) {
+        out.push_back('C');
+        out.push_back('P');
+        out.push_back('I');
+        out.push_back(header.version);
+        writeField(out, CPI_ENDIAN);
+        writeField(out, header.width);
+        writeField(out, header.height);
+        writeField(out, header.block_length);
+        
+        if (header.version == 3) {
+            writeField(out, header.flags);
+            writeField(out, header.band_rows);
+            if (header.flags & CPI_ADAPTIVE) {
+                writeField(out, header.segment_table);
+            }
+            if (header.flags & CPI_TILED) {
+                writeField(out, header.tile_size);
+                writeField(out, header.scan_order);
+            }
+            if (header.flags & CPI_INDEXED) {
+                for (unsigned long long offset : header.offsets) {
+                    writeField(out, offset);
+                }
+            }
+            if (header.flags & CPI_PYRAMID) {
+                writeField(out, (unsigned short) (header.levels.size() - 1));
+                for (unsigned long long offset : header.levels) {
+                    writeField(out, offset);
+                }
+            }
+        }
+    }
+
+    //reads a LEB128 number starting at src[i]. Returns false if it does not end before size
+    //or does not fit in a size_t
+    static inline bool readVarint(const unsigned char * src, size_t size, size_t & i, size_t & value) {
+        value = 0;
+        for (unsigned int shift = 0; i < size && shift < 8 * sizeof(size_t); shift += 7) {
+            unsigned char b = src[i++];
+            value |= (size_t) (b & 0x7F) << shift;
+            if (!(b & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool parseSegmentTable(const unsigned char * data, size_t size, const CPIHeader & header,
+            vector<CPISegment> & segments) {
+        segments.clear();
+        size_t i = 0;
+        for (unsigned int row = 0; row < 3u * header.height; ++row) {
+            size_t count, length;
+            if (!readVarint(data, size, i, count)) {
+                return false;
+            }
+            size_t x = 0;
+            for (size_t s = 0; s < count; ++s) {
+                if (!readVarint(data, size, i, length) || i >= size || length == 0 || length > header.width - x) {
+                    return false;
+                }
+                CPISegment segment;
+                segment.row = row;
+                segment.x = (unsigned short) x;
+                segment.length = (unsigned short) length;
+                segment.threshold = data[i++];
+                segments.push_back(segment);
+                x += length;
+            }
+            if (x != header.width) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //stores a run of count components at dst, writing 16 components whatever the count: the
+    //fixed size store compiles to a single vector store, and most runs are short enough that
+    //memset is not called at all. The components past the run are overwritten by the next ones
+    static inline void putShortRun(Component * dst, Component value, size_t count) {
+        memset(dst, value, 16);
+        if (count > 16) {
+            memset(dst + 16, value, count - 16);
+        }
+    }
+
+    //while 16 components of capacity are left, runs go out with putShortRun; the last ones exactly.
+    //If the stream ends early, what the last stores spilled past the runs is cleared to 0
+    size_t decodeRuns(const unsigned char * src, size_t size, Component * dst, size_t capacity, bool varint_counts,
+            size_t * consumed) {
+        size_t j = 0;
+        size_t spilled = 0;
+        if (varint_counts) {
+            size_t i = 0;
+            size_t pair_end = 0;
+            size_t count;
+            while (i + 1 < size && j < capacity) {
+                Component value = src[i++];
+                if (!readVarint(src, size, i, count)) {
+                    break;
+                }
+                pair_end = i;
+                count = min(count, capacity - j);
+                if (j + 16 <= capacity) {
+                    putShortRun(dst + j, value, count);
+                    spilled = j + 16;
+                } else {
+                    memset(dst + j, value, count);
+                }
+                j += count;
+            }
+            if (spilled > j) {
+                memset(dst + j, 0, spilled - j);
+            }
+            if (consumed != nullptr) {
+                *consumed = pair_end;
+            }
+            return j;
+        }
+        
+        size_t i = 1;
+        for (; i < size && j + 16 <= capacity; i += 2) {
+            size_t count = min((size_t) src[i], capacity - j);
+            putShortRun(dst + j, src[i - 1], count);
+            spilled = j + 16;
+            j += count;
+        }
+        for (; i < size && j < capacity; i += 2) {
+            size_t count = min((size_t) src[i], capacity - j);
+            memset(dst + j, src[i - 1], count);
+            j += count;
+        }
+        if (spilled > j) {
+            memset(dst + j, 0, spilled - j);
+        }
+        if (consumed != nullptr) {
+            *consumed = min(i - 1, size & ~(size_t) 1);
+        }
+        return j;
+    }
+
+    //position (y << 16) | x of point d of the Hilbert curve that fills a size X size square
+    static unsigned int hilbertPoint(unsigned int size, unsigned int d) {
+        unsigned int x = 0, y = 0;
+        for (unsigned int s = 1; s < size; s *= 2, d /= 4) {
+            unsigned int rx = 1 & (d / 2);
+            unsigned int ry = 1 & (d ^ rx);
+            //rotate the quadrant
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                swap(x, y);
+            }
+            x += s * rx;
+            y += s * ry;
+        }
+        return (y << 16) | x;
+    }
+
+    //position of point d in Morton order: x takes the even bits of d, y the odd ones
+    static unsigned int mortonPoint(unsigned int d) {
+        unsigned int x = 0, y = 0;
+        for (unsigned int bit = 0; (d >> (2 * bit)) != 0; ++bit) {
+            x |= ((d >> (2 * bit)) & 1) << bit;
+            y |= ((d >> (2 * bit + 1)) & 1) << bit;
+        }
+        return (y << 16) | x;
+    }
+
+    TileScans::TileScans(unsigned short order, unsigned int size) : scan_order(order), tile_size(size) {
+        fill(widths, widths + 4, 0u);
+        fill(heights, heights + 4, 0u);
+    }
+
+    //the full tile is walked in scan order and the positions outside the clipped tile are left out
+    const vector<unsigned int> & TileScans::get(unsigned int tile_width, unsigned int tile_height) {
+        size_t slot = (tile_width < tile_size ? 1 : 0) + (tile_height < tile_size ? 2 : 0);
+        vector<unsigned int> & scan = scans[slot];
+        if (widths[slot] == tile_width && heights[slot] == tile_height && !scan.empty()) {
+            return scan;
+        }
+        
+        widths[slot] = tile_width;
+        heights[slot] = tile_height;
+        scan.clear();
+        for (unsigned int d = 0; d < tile_size * tile_size; ++d) {
+            unsigned int x = d % tile_size, y = d / tile_size;
+            if (scan_order == CPI_SCAN_SERPENTINE && y % 2 == 1) {
+                x = tile_size - 1 - x;
+            } else if (scan_order == CPI_SCAN_ZORDER || scan_order == CPI_SCAN_HILBERT) {
+                unsigned int point = scan_order == CPI_SCAN_ZORDER ? mortonPoint(d) : hilbertPoint(tile_size, d);
+                x = point & 0xFFFF;
+                y = point >> 16;
+            }
+            if (x < tile_width && y < tile_height) {
+                scan.push_back((y << 16) | x);
+            }
+        }
+        return scan;
+    }
+
+    //every tile is expanded in a buffer of its own, then moved to its place in the rows
+    size_t decodeTiles(const CPIHeader & header, const unsigned char * src, size_t size, unsigned int first_band,
+            Component * dst, size_t capacity, size_t * consumed) {
+        bool varint_counts = (header.flags & CPI_VARINT_COUNTS) != 0;
+        unsigned int bands = header.getBandCount();
+        unsigned int tile_size = header.tile_size;
+        size_t width = header.width;
+        size_t complete = 0;
+        size_t complete_bytes = 0;
+        bool truncated = false;
+        
+        TileScans scans(header.scan_order, tile_size);
+        vector<Component> tile((size_t) tile_size * tile_size);
+        size_t i = 0;
+        size_t j = 0;
+        
+        for (unsigned int band = first_band; band < 3 * bands && tile_size > 0; ++band) {
+            unsigned int rows = header.getBandLastRow(band % bands) - header.getBandFirstRow(band % bands);
+            size_t band_size = rows * width;
+            if (band_size > capacity - j) {
+                break;
+            }
+            Component * rows_dst = dst + j;
+            
+            for (size_t x = 0; x < width; x += tile_size) {
+                unsigned int tile_width = (unsigned int) min((size_t) tile_size, width - x);
+                const vector<unsigned int> & scan = scans.get(tile_width, rows);
+                size_t used = 0;
+                size_t decoded = decodeRuns(src + i, size - i, tile.data(), scan.size(), varint_counts, &used);
+                fill(tile.begin() + decoded, tile.begin() + scan.size(), 0);
+                truncated = truncated || decoded < scan.size();
+                i += used;
+                
+                if (header.scan_order == CPI_SCAN_ROWS) {
+                    for (unsigned int y = 0; y < rows; ++y) {
+                        memcpy(rows_dst + y * width + x, tile.data() + (size_t) y * tile_width, tile_width);
+                    }
+                } else {
+                    for (size_t k = 0; k < scan.size(); ++k) {
+                        rows_dst[(scan[k] >> 16) * width + x + (scan[k] & 0xFFFF)] = tile[k];
+                    }
+                }
+            }
+            j += band_size;
+            if (!truncated) {
+                complete = j;
+                complete_bytes = i;
+            }
+        }
+        if (consumed != nullptr) {
+            *consumed = complete_bytes;
+        }
+        return complete;
+    }
+
+    //adds the prediction of a CPI_SEGMENT_UP or CPI_SEGMENT_GRADIENT segment to its residuals at dst. The
+    //segment starts at component x of its row, and the row above it is width components before it
+    static void reconstructSegment(unsigned char op, Component * dst, size_t x, size_t length, size_t width) {
+        const Component * above = dst - width;
+        if (op == CPI_SEGMENT_UP) {
+            reconstructUp(dst, above, length);
+        } else {
+            reconstructGradient(dst, above, length, x > 0 ? dst[-1] : 0, x > 0 ? above[-1] : 0);
+        }
+    }
+
+    size_t decodeSegments(const unsigned char * src, size_t size, Component * dst, size_t capacity,
+            unsigned int width, unsigned short block_length, bool varint_counts) {
+        if (width == 0 || block_length == 0) {
+            return 0;
+        }
+        size_t i = 0;
+        size_t j = 0;
+        size_t spilled = 0;
+        while (i < size && j < capacity) {
+            size_t length = min(min((size_t) block_length, width - j % width), capacity - j);
+            unsigned char op = src[i++];
+            
+            if (op == CPI_SEGMENT_COPY) {
+                size_t distance;
+                if (!readVarint(src, size, i, distance) || distance == 0 || distance > j) {
+                    break;
+                }
+                if (distance >= length) {
+                    memcpy(dst + j, dst + j - distance, length);
+                } else {
+                    //overlapping copy: the source repeats
+                    for (size_t k = 0; k < length; ++k) {
+                        dst[j + k] = dst[j + k - distance];
+                    }
+                }
+                j += length;
+            } else if (op == CPI_SEGMENT_RUNS || op == CPI_SEGMENT_UP || op == CPI_SEGMENT_GRADIENT) {
+                //a prediction needs the row above, in the band
+                if (op != CPI_SEGMENT_RUNS && j < width) {
+                    break;
+                }
+                size_t start = j;
+                size_t end = j + length;
+                bool truncated = false;
+                while (j < end) {
+                    //a value and at least one byte of its count
+                    if (i + 1 >= size) {
+                        truncated = true;
+                        break;
+                    }
+                    Component value = src[i++];
+                    size_t count;
+                    if (!varint_counts) {
+                        count = src[i++];
+                    } else if (!readVarint(src, size, i, count)) {
+                        truncated = true;
+                        break;
+                    }
+                    count = min(count, end - j);
+                    //the spill of a short run lands on components not decoded yet
+                    if (j + 16 <= capacity) {
+                        putShortRun(dst + j, value, count);
+                        spilled = max(spilled, j + 16);
+                    } else {
+                        memset(dst + j, value, count);
+                    }
+                    j += count;
+                }
+                if (op != CPI_SEGMENT_RUNS) {
+                    reconstructSegment(op, dst + start, start % width, j - start, width);
+                }
+                if (truncated) {
+                    break;
+                }
+            } else {
+                break;
+            }
+        }
+        if (spilled > j) {
+            memset(dst + j, 0, spilled - j);
+        }
+        return j;
+    }
+
+    SegmentDictionary::SegmentDictionary(Component margin, unsigned int slot_bits)
+        : slots((size_t) 1 << slot_bits), error_margin(margin) {
+        clear();
+    }
+
+    void SegmentDictionary::clear() {
+        entry_t empty = {nullptr, 0};
+        fill(slots.begin(), slots.end(), empty);
+    }
+
+    //with a margin, components are hashed by groups of margin + 1 values, so segments within the
+    //margin usually (not always) share a slot. Without one, 8 components are mixed in at a time
+    size_t SegmentDictionary::hash(const Component * data, size_t length) const {
+        unsigned long long h = 0x9E3779B97F4A7C15ull ^ length;
+        size_t k = 0;
+        if (error_margin == 0) {
+            for (; k + 8 <= length; k += 8) {
+                unsigned long long word;
+                memcpy(&word, data + k, sizeof(word));
+                h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+                h ^= h >> 32;
+            }
+            for (; k < length; ++k) {
+                h = (h ^ data[k]) * 0x100000001B3ull;
+            }
+        } else {
+            unsigned int group = error_margin + 1u;
+            for (; k < length; ++k) {
+                h = (h ^ (data[k] / group)) * 0x100000001B3ull;
+            }
+        }
+        return (size_t) (h ^ (h >> 29)) & (slots.size() - 1);
+    }
+
+    const Component * SegmentDictionary::find(const Component * data, size_t length) const {
+        const entry_t & entry = slots[hash(data, length)];
+        if (entry.data != nullptr && entry.length == length && segmentsEqual(entry.data, data, length, error_margin)) {
+            return entry.data;
+        }
+        return nullptr;
+    }
+
+    void SegmentDictionary::insert(const Component * data, size_t length) {
+        entry_t entry = {data, length};
+        slots[hash(data, length)] = entry;
+    }
+
+    size_t countRunComponents(const unsigned char * src, size_t size) {
+        size_t total = 0;
+        for (size_t i = 1; i < size; i += 2) {
+            total += src[i];
+        }
+        return total;
+    }
+
+    size_t decodeRunsParallel(const unsigned char * src, size_t size, Component * dst, size_t capacity,
+            unsigned int threads) {
+        size_t pairs = size / 2;
+        size_t slices = min((size_t) resolveThreadCount(threads), pairs);
+        if (slices <= 1) {
+            return decodeRuns(src, size, dst, capacity);
+        }
+        
+        //slice boundaries fall on pairs, so every slice starts with a value byte
+        vector<size_t> bounds(slices + 1);
+        for (size_t i = 0; i <= slices; ++i) {
+            bounds[i] = 2 * (pairs * i / slices);
+        }
+        
+        vector<size_t> first(slices + 1, 0);
+        parallelFor(slices, threads, [&] (size_t slice) {
+            first[slice + 1] = countRunComponents(src + bounds[slice], bounds[slice + 1] - bounds[slice]);
+        });
+        for (size_t i = 1; i <= slices; ++i) {
+            first[i] += first[i - 1];
+        }
+        
+        parallelFor(slices, threads, [&] (size_t slice) {
+            //each slice stops at the next one: decodeRuns writes past its runs while it has capacity left
+            if (first[slice] < capacity) {
+                decodeRuns(src + bounds[slice], bounds[slice + 1] - bounds[slice], 
+                        dst + first[slice], min(first[slice + 1], capacity) - first[slice]);
+            }
+        });
+        return min(first[slices], capacity);
+    }
+
+    RowDecoder::RowDecoder(unsigned int width, size_t total_rows, 
+            const function<void(size_t, const Component *)> & callback, bool varint)
+        : row(width + 16), filled(0), rows(width > 0 ? total_rows : 0), rows_done(0), pending_value(-1),
+          pending_count(0), pending_shift(0), varint_counts(varint), on_row(callback), segment_state(NO_SEGMENTS),
+          segment_op(CPI_SEGMENT_RUNS), segment_start(0), segment_left(0), row_start(0), width(width), height(0), band_rows(0), block_length(0) {
+    }
+
+    void RowDecoder::setSegments(unsigned short segment_length, unsigned int image_height, unsigned int rows_per_band) {
+        block_length = max((unsigned short) 1, segment_length);
+        height = max(1u, image_height);
+        band_rows = rows_per_band > 0 ? min(rows_per_band, height) : height;
+        row.resize((size_t) band_rows * width);
+        segment_state = SEGMENT_OP;
+    }
+
+    //hands the current row out and moves to the next one, which in a band 
+    //of a CPI_DEDUP or CPI_PREDICTED stream goes after the rows before it
+    void RowDecoder::nextRow() {
+        on_row(rows_done++, row.data() + row_start);
+        filled = 0;
+        if (segment_state != NO_SEGMENTS) {
+            row_start = ((rows_done % height) % band_rows) * width;
+        }
+    }
+
+    void RowDecoder::putRun(Component value, size_t count) {
+        //a run may complete the current row and continue in the next ones
+        while (count > 0 && rows_done < rows) {
+            size_t n = min(count, width - filled);
+            memset(row.data() + row_start + filled, value, n);
+            filled += n;
+            count -= n;
+            if (filled == width) {
+                nextRow();
+            }
+        }
+    }
+
+    //byte at a time, like the variable length counts
+    void RowDecoder::feedSegments(const unsigned char * data, size_t size) {
+        for (size_t i = 0; i < size && rows_done < rows && segment_state != SEGMENT_ERROR; ++i) {
+            unsigned char b = data[i];
+            switch (segment_state) {
+            case SEGMENT_OP:
+                segment_left = min((size_t) block_length, width - filled);
+                segment_start = filled;
+                segment_op = b;
+                pending_count = 0;
+                pending_shift = 0;
+                if (b == CPI_SEGMENT_RUNS) {
+                    segment_state = SEGMENT_VALUE;
+                } else if ((b == CPI_SEGMENT_UP || b == CPI_SEGMENT_GRADIENT) && row_start > 0) {
+                    //predictions read the row above, which the first row of a band does not have
+                    segment_state = SEGMENT_VALUE;
+                } else if (b == CPI_SEGMENT_COPY) {
+                    segment_state = SEGMENT_DISTANCE;
+                } else {
+                    segment_state = SEGMENT_ERROR;
+                }
+                break;
+            case SEGMENT_VALUE:
+                pending_value = b;
+                pending_count = 0;
+                pending_shift = 0;
+                segment_state = SEGMENT_COUNT;
+                break;
+            case SEGMENT_COUNT:
+            case SEGMENT_DISTANCE:
+                if (segment_state == SEGMENT_COUNT && !varint_counts) {
+                    pending_count = b;
+                } else {
+                    if (pending_shift < 8 * sizeof(size_t)) {
+                        pending_count |= (size_t) (b & 0x7F) << pending_shift;
+                    }
+                    pending_shift += 7;
+                    if (b & 0x80) {
+                        break;
+                    }
+                }
+                
+                if (segment_state == SEGMENT_COUNT) {
+                    //the runs never go past the segment, so they stay in the row
+                    size_t count = min(pending_count, segment_left);
+                    memset(row.data() + row_start + filled, pending_value, count);
+                    filled += count;
+                    segment_left -= count;
+                    pending_value = -1;
+                    if (segment_left == 0 && segment_op != CPI_SEGMENT_RUNS) {
+                        reconstructSegment(segment_op, row.data() + row_start + segment_start, segment_start,
+                                filled - segment_start, width);
+                    }
+                    if (filled == width) {
+                        nextRow();
+                    }
+                } else {
+                    //the copy reads the band, up to the part of the current row decoded so far
+                    size_t position = row_start + filled;
+                    if (pending_count == 0 || pending_count > position) {
+                        segment_state = SEGMENT_ERROR;
+                        break;
+                    }
+                    for (size_t k = 0; k < segment_left; ++k) {
+                        row[position + k] = row[position + k - pending_count];
+                    }
+                    filled += segment_left;
+                    segment_left = 0;
+                    if (filled == width) {
+                        nextRow();
+                    }
+                }
+                segment_state = segment_left > 0 ? SEGMENT_VALUE : SEGMENT_OP;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    void RowDecoder::feed(const unsigned char * data, size_t size) {
+        if (segment_state != NO_SEGMENTS) {
+            feedSegments(data, size);
+            return;
+        }
+        
+        size_t i = 0;
+        if (varint_counts) {
+            //byte at a time: a count may be split between two pieces
+            while (i < size && rows_done < rows) {
+                unsigned char b = data[i++];
+                if (pending_value < 0) {
+                    pending_value = b;
+                    pending_count = 0;
+                    pending_shift = 0;
+                    continue;
+                }
+                if (pending_shift < 8 * sizeof(size_t)) {
+                    pending_count |= (size_t) (b & 0x7F) << pending_shift;
+                }
+                pending_shift += 7;
+                if (!(b & 0x80)) {
+                    putRun((Component) pending_value, pending_count);
+                    pending_value = -1;
+                }
+            }
+            return;
+        }
+        
+        while (i < size && rows_done < rows) {
+            if (pending_value >= 0) {
+                putRun((Component) pending_value, data[i]);
+                pending_value = -1;
+                i += 1;
+            } else if (i + 1 < size) {
+                //a run that ends inside the row is a single fixed size store (see putShortRun): the
+                //row has 16 spare components for the spill
+                size_t count = data[i + 1];
+                if (filled + count < width) {
+                    putShortRun(row.data() + filled, data[i], count);
+                    filled += count;
+                } else {
+                    putRun(data[i], count);
+                }
+                i += 2;
+            } else {
+                pending_value = data[i];
+                return;
+            }
+        }
+    }
+
+    void RowDecoder::finish() {
+        while (rows_done < rows) {
+            fill(row.begin() + row_start + filled, row.begin() + row_start + width, 0);
+            nextRow();
+        }
+    }
+
+    unsigned int resolveThreadCount(unsigned int requested) {
+        if (requested > 0) {
+            return requested;
+        }
+        return max(1u, thread::hardware_concurrency());
+    }
+
+    //the tasks of one parallelFor call. A helper may start on the pool after the call has returned,
+    //so helpers share the state and only touch the body for a task they claimed below "tasks"
+    struct ParallelForState {
+        const function<void(size_t)> * body;
+        size_t tasks;
+        atomic<size_t> next_task;
+        atomic<bool> failed;
+        mutex lock;
+        condition_variable all_done;
+        size_t done;
+        exception_ptr failure;
+    };
+
+    //runs tasks until none is left. After a failure the tasks still claimed are only counted
+    static void runParallelTasks(ParallelForState & state) {
+        for (size_t task = state.next_task++; task < state.tasks; task = state.next_task++) {
+            if (!state.failed) {
+                try {
+                    (*state.body)(task);
+                } catch (...) {
+                    lock_guard<mutex> guard(state.lock);
+                    if (!state.failure) {
+                        state.failure = current_exception();
+                    }
+                    state.failed = true;
+                }
+            }
+            lock_guard<mutex> guard(state.lock);
+            if (++state.done == state.tasks) {
+                state.all_done.notify_all();
+            }
+        }
+    }
+
+    //the helpers are tasks of the compute pool, so no thread is started per call. The calling
+    //thread works too and only waits for the tasks the helpers are already running
+    void parallelFor(size_t tasks, unsigned int threads, const function<void(size_t)> & body) {
+        threads = (unsigned int) min((size_t) resolveThreadCount(threads), tasks);
+        if (threads <= 1) {
+            for (size_t task = 0; task < tasks; ++task) {
+                body(task);
+            }
+            return;
+        }
+        
+        shared_ptr<ParallelForState> state = make_shared<ParallelForState>();
+        state->body = &body;
+        state->tasks = tasks;
+        state->next_task = 0;
+        state->failed = false;
+        state->done = 0;
+        
+        //a task of the pool itself, such as an asynchronous read or write, only gets the threads that are
+        //idle. The others are busy with tasks of their own, and helpers queued behind those would start
+        //after the work is done
+        TaskPool & pool = getComputePool();
+        unsigned int helpers = min(threads - 1, pool.getThreadCount());
+        if (pool.isWorkerThread()) {
+            helpers = min(helpers, pool.getIdleCount());
+        }
+        for (unsigned int i = 0; i < helpers; ++i) {
+            pool.submit([state] () { runParallelTasks(*state); });
+        }
+        runParallelTasks(*state);
+        
+        unique_lock<mutex> guard(state->lock);
+        state->all_done.wait(guard, [&state] () { return state->done == state->tasks; });
+        if (state->failure) {
+            rethrow_exception(state->failure);
+        }
+    }
+
+} //namespace imaging
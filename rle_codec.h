@@ -0,0 +1,318 @@
+//------------------------------------------------------------
+//
+// Low level layout of the CPI container, shared by the RLE
+// image reader and writer.
+//
+// Version 2 (assignment format):
+//   'C' 'P' 'I' <version:1> <endian:2 = 258> <width:2> <height:2> <block_length:2>
+//   followed by the (value, count) pairs of the RED, GREEN and BLUE planes, row by row.
+//
+// Version 3 extends the version 2 header with
+//   <flags:2> <band_rows:2>
+//   [CPI_ADAPTIVE] <segment_table:8>
+//   [CPI_TILED] <tile_size:2> <scan_order:2>
+//   [CPI_INDEXED] (3 * bands + 1) byte offsets of 8 bytes each
+//   [CPI_PYRAMID] <levels:2> (levels + 1) byte offsets of 8 bytes each, then the levels
+// With CPI_VARINT_COUNTS the count of every (value, count) pair is stored as an unsigned
+// LEB128 number (7 bits per byte, low bits first, high bit set on all but the last byte), 
+// so a run can be as long as a row. Otherwise counts are single bytes, as in version 2.
+// Every channel is split in bands of band_rows rows that are encoded independently.
+// The offset of band b of channel c is stored at index c * bands + b and is relative
+// to the start of the image data; the last entry is the size of the image data.
+// With CPI_ADAPTIVE the segment length and error threshold were picked by the writer for
+// every segment. The runs decode as usual; the choices are recorded in a segment table
+// that starts segment_table bytes after the start of the image data, where the runs end.
+// For every row of the RED, GREEN and BLUE planes it holds the number of segments of the 
+// row, then <length> <threshold:1> for each of them, all numbers in LEB128 form.
+// With CPI_DEDUP every segment starts with an op byte: CPI_SEGMENT_RUNS is followed by the
+// (value, count) pairs of the segment, CPI_SEGMENT_COPY by a LEB128 distance d: the segment
+// is a copy of the components d positions before it, counted in the decoded plane. Copies 
+// never reach back beyond the start of their band, so bands still decode independently.
+// With CPI_PREDICTED every segment starts with an op byte as well, and the op may also be 
+// CPI_SEGMENT_UP or CPI_SEGMENT_GRADIENT: the (value, count) pairs that follow decode to the
+// residuals of a prediction, which are added to it modulo 256. CPI_SEGMENT_UP predicts every
+// component from the one above it, CPI_SEGMENT_GRADIENT from left + above - above left, with
+// left and above left taken as 0 at the start of a row. Predicted segments never occur in 
+// the first row of a band. Unindexed files with CPI_DEDUP or CPI_PREDICTED have bands too.
+// With CPI_TILED every channel is split in square tiles of tile_size X tile_size components
+// (smaller at the right and bottom edges) instead of row segments. Tiles are stored row of 
+// tiles by row of tiles, left to right, and the components of a tile are visited in the
+// scan order (cpi_scan_order_t) to make its runs; runs never cross tiles. A band is a row
+// of tiles: band_rows equals tile_size.
+// With CPI_PYRAMID the image data is preceded by reduced copies of the image for previews:
+// level l is 1/2^l of the image in each direction (rounded up), every component the rounded
+// mean of the 2 X 2 components of level l - 1 it covers. Every level is stored as a complete
+// CPI image of its own, written with the settings of the full image. Level l starts at offset
+// l - 1 of the table, counted from the end of the table; the last entry is the size of all 
+// the levels, and the image data starts right after them.
+// All multi-byte fields are in the byte order of the writer, as the endian field tells.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include "Image.h"
+#include <vector>
+#include <iosfwd>
+#include <functional>
+
+namespace imaging
+{
+	// Feature flags of a version 3 header
+	enum cpi_flag_t
+	{
+		CPI_INDEXED = 0x0001,       // An offset table for every channel band follows the header
+		CPI_VARINT_COUNTS = 0x0002, // Run counts are variable length (LEB128) numbers
+		CPI_ADAPTIVE = 0x0004,      // Segments have their own length and threshold, listed in a segment table
+		CPI_DEDUP = 0x0008,         // Segments start with an op byte and may repeat an earlier segment
+		CPI_TILED = 0x0010,         // The channels are coded in square tiles instead of row segments
+		CPI_PREDICTED = 0x0020,     // Segments start with an op byte and may be residuals of a prediction
+		CPI_PYRAMID = 0x0040        // Reduced copies of the image precede the image data
+	};
+
+	// Most levels a CPI_PYRAMID file may have: enough to bring any image down to 1 X 1
+	static const unsigned int CPI_MAX_PYRAMID_LEVELS = 16;
+
+	// Order of the components of a tile of a CPI_TILED file
+	enum cpi_scan_order_t
+	{
+		CPI_SCAN_ROWS = 0,          // Row by row, left to right
+		CPI_SCAN_SERPENTINE = 1,    // Row by row, odd rows right to left
+		CPI_SCAN_ZORDER = 2,        // Morton order. Power of two tile sizes only
+		CPI_SCAN_HILBERT = 3,       // Hilbert curve. Power of two tile sizes only
+		CPI_SCAN_ORDER_COUNT
+	};
+
+	// Op byte of a segment of a CPI_DEDUP or CPI_PREDICTED file
+	enum cpi_segment_op_t
+	{
+		CPI_SEGMENT_RUNS = 0,       // (value, count) pairs follow
+		CPI_SEGMENT_COPY = 1,       // A back-reference distance follows (CPI_DEDUP only)
+		CPI_SEGMENT_UP = 2,         // Pairs of the residuals of the prediction from the row above follow (CPI_PREDICTED only)
+		CPI_SEGMENT_GRADIENT = 3    // Pairs of the residuals of the gradient prediction follow (CPI_PREDICTED only)
+	};
+
+	struct CPIHeader
+	{
+		unsigned char version;
+		unsigned short width, height;
+		unsigned short block_length;
+		unsigned short flags;       // Version 3 only, 0 for version 2
+		unsigned short band_rows;   // Version 3 only: rows per channel band
+		std::vector<unsigned long long> offsets; // CPI_INDEXED only: band offsets, see above
+		unsigned long long segment_table; // CPI_ADAPTIVE only: offset of the segment table in the image data
+		unsigned short tile_size;   // CPI_TILED only: side of a tile
+		unsigned short scan_order;  // CPI_TILED only: a cpi_scan_order_t
+		std::vector<unsigned long long> levels; // CPI_PYRAMID only: level offsets, see above
+		size_t size;                // Size of the header in bytes, i.e. the file offset of the image data
+
+		CPIHeader() : version(2), width(0), height(0), block_length(0), flags(0), band_rows(0), segment_table(0), 
+			tile_size(0), scan_order(CPI_SCAN_ROWS), size(0) {}
+
+		// True if every segment starts with an op byte (CPI_DEDUP or CPI_PREDICTED)
+		bool hasSegmentOps() const {return (flags & (CPI_DEDUP | CPI_PREDICTED)) != 0;}
+
+		// Number of bands per channel (1 when the image is not split in bands)
+		unsigned int getBandCount() const;
+
+		// Rows [first_row, last_row) covered by band number band (of any channel)
+		unsigned int getBandFirstRow(unsigned int band) const;
+		unsigned int getBandLastRow(unsigned int band) const;
+
+		// Number of bytes of runs, given the available bytes after the header: they
+		// stop at the segment table of an adaptive file, otherwise at the end of the file.
+		size_t getRunDataSize(size_t available) const;
+
+		// Number of reduced levels of a CPI_PYRAMID file, 0 for other files
+		unsigned int getLevelCount() const {return levels.empty() ? 0 : (unsigned int) levels.size() - 1;}
+
+		// File offset of the start of a reduced level, 1 to getLevelCount(), and the size of its data
+		size_t getLevelStart(unsigned int level) const {return size - (size_t) levels.back() + (size_t) levels[level - 1];}
+		size_t getLevelSize(unsigned int level) const {return (size_t) (levels[level] - levels[level - 1]);}
+	};
+
+	// A segment of an adaptive file, as listed in the segment table
+	struct CPISegment
+	{
+		unsigned int row;           // In stream order: row % height of channel row / height
+		unsigned short x, length;   // First component and number of components
+		Component threshold;        // Error threshold the runs of the segment were made with
+	};
+
+	// Parses a header from the first size bytes of a CPI file. Returns the size of the header,
+	// or 0 if the data is not a valid (or complete) version 2 or 3 header.
+	size_t parseCPIHeader(const unsigned char * data, size_t size, CPIHeader & header);
+
+	// Reads a complete header from the current position of the stream, skipping the levels of a
+	// CPI_PYRAMID file. Returns false on a read error or an invalid header.
+	bool readCPIHeader(std::istream & in, CPIHeader & header);
+
+	// Appends the binary form of the header to out. The version is taken from the header.
+	void serializeCPIHeader(const CPIHeader & header, std::vector<unsigned char> & out);
+
+	// Parses the segment table of an adaptive file. Every row must be covered exactly by its segments.
+	// Returns false if the table is incomplete or does not match the header.
+	bool parseSegmentTable(const unsigned char * data, size_t size, const CPIHeader & header, 
+		std::vector<CPISegment> & segments);
+
+	// Appends a number in LEB128 form
+	inline void appendVarint(std::vector<Component> & out, size_t value)
+	{
+		for (; value >= 0x80; value >>= 7) {
+			out.push_back((Component) (value | 0x80));
+		}
+		out.push_back((Component) value);
+	}
+
+	// Appends a run to an encoded stream. Byte counts longer than 255 are split in several pairs.
+	inline void appendRun(std::vector<Component> & out, Component value, size_t count, bool varint_counts)
+	{
+		if (varint_counts) {
+			out.push_back(value);
+			appendVarint(out, count);
+		} else {
+			for (; count > 0xFF; count -= 0xFF) {
+				out.push_back(value);
+				out.push_back(0xFF);
+			}
+			out.push_back(value);
+			out.push_back((Component) count);
+		}
+	}
+
+	// Expands the (value, count) pairs of src into dst, writing at most capacity components. 
+	// An incomplete trailing pair is ignored. Returns the number of components written; if that is less than
+	// capacity, up to 16 components after them may be set to 0. If consumed is given, it receives the
+	// number of bytes of the pairs that were decoded.
+	size_t decodeRuns(const unsigned char * src, size_t size, Component * dst, size_t capacity, 
+		bool varint_counts = false, size_t * consumed = nullptr);
+
+	// The scan order of the tiles of a CPI_TILED image: for every component of a tile, in order, its position
+	// (y << 16) | x in the tile. The edge tiles keep the order of the full tile, without the positions they 
+	// do not have. Orders are made on first use, for the full tile and the clipped ones.
+	class TileScans
+	{
+	protected:
+		unsigned short scan_order;
+		unsigned int tile_size;
+		std::vector<unsigned int> scans[4];  // Full, clipped at the right, at the bottom, at both
+		unsigned int widths[4], heights[4];
+
+	public:
+		TileScans(unsigned short order, unsigned int size);
+
+		const std::vector<unsigned int> & get(unsigned int tile_width, unsigned int tile_height);
+	};
+
+	// Decodes the tiles of consecutive bands of a CPI_TILED stream into dst, which receives the rows of the bands
+	// one after the other, width components each. first_band is the band the data starts at, counted over
+	// all channels (c * bands + b). Every band that fits in capacity is written; the components missing from a
+	// truncated stream are 0. Returns the number of components of the bands decoded in full, before the first
+	// incomplete one. If consumed is given, it receives the number of bytes of those bands.
+	size_t decodeTiles(const CPIHeader & header, const unsigned char * src, size_t size, unsigned int first_band,
+		Component * dst, size_t capacity, size_t * consumed = nullptr);
+
+	// Decodes the segments of a CPI_DEDUP or CPI_PREDICTED stream of rows of "width" components, split in segments 
+	// of block_length components. dst must be the start of a band: back-references before it, and predictions 
+	// in its first row, end the decoding. Returns the number of components written; as with decodeRuns, up to 16
+	// components after them may be set to 0.
+	size_t decodeSegments(const unsigned char * src, size_t size, Component * dst, size_t capacity, 
+		unsigned int width, unsigned short block_length, bool varint_counts = false);
+
+	// Hash table of the segments the writer has seen since the start of the band, to find segments
+	// that repeat an earlier one within an error margin (CPI_DEDUP). Each slot keeps the most recent
+	// segment of its hash. Segments are kept by address, so the band must stay in memory.
+	class SegmentDictionary
+	{
+	protected:
+		struct entry_t {const Component * data; size_t length;};
+		std::vector<entry_t> slots;
+		Component error_margin;
+
+		size_t hash(const Component * data, size_t length) const;
+
+	public:
+		// margin is the largest difference of two components that still counts as equal
+		SegmentDictionary(Component margin, unsigned int slot_bits = 12);
+
+		// Forgets every segment, at the start of a band
+		void clear();
+
+		// An earlier segment equal to the length components at data, or nullptr
+		const Component * find(const Component * data, size_t length) const;
+
+		void insert(const Component * data, size_t length);
+	};
+
+	// Number of components the (value, count) pairs of src expand to, i.e. the sum of their counts.
+	// Byte counts only.
+	size_t countRunComponents(const unsigned char * src, size_t size);
+
+	// Decodes a version 2 style stream of pairs with several threads: a first parallel pass sums the run 
+	// counts of equal slices of the stream, a prefix sum turns them into the first component of each slice
+	// and a second parallel pass expands every slice in place. Same result as decodeRuns. Byte counts only: 
+	// a stream of variable length counts cannot be split at an arbitrary pair.
+	size_t decodeRunsParallel(const unsigned char * src, size_t size, Component * dst, size_t capacity,
+		unsigned int threads);
+
+	// Incremental decoder of a stream of (value, count) pairs into rows of "width" components. The stream can
+	// be fed in pieces of any size (a pair may be split between two pieces); every row is passed to the callback
+	// as soon as it is complete, so only one row is kept in memory. Rows are numbered in stream order, i.e.
+	// row r is row r % height of channel r / height. Components beyond "rows" rows are ignored.
+	class RowDecoder
+	{
+	protected:
+		std::vector<Component> row;     // Row being filled, with 16 spare components for the decoder stores
+		size_t filled;                  // Components of the current row already decoded
+		size_t rows, rows_done;
+		int pending_value;              // Value byte of a split pair, -1 if none
+		size_t pending_count;           // Variable length count decoded so far
+		unsigned int pending_shift;     // Bits of pending_count decoded so far
+		bool varint_counts;
+		std::function<void(size_t, const Component *)> on_row;
+
+		// CPI_DEDUP and CPI_PREDICTED streams: row holds the rows of the current band,
+		// because copies and predictions read earlier rows of the band
+		enum segment_state_t {NO_SEGMENTS, SEGMENT_OP, SEGMENT_VALUE, SEGMENT_COUNT, SEGMENT_DISTANCE, SEGMENT_ERROR};
+		segment_state_t segment_state;
+		unsigned char segment_op;       // Op byte of the current segment
+		size_t segment_start;           // Offset of the current segment in the current row
+		size_t segment_left;            // Components of the current segment not decoded yet
+		size_t row_start;               // Offset of the current row in row
+		unsigned int width, height, band_rows;
+		unsigned short block_length;
+
+		void feedSegments(const unsigned char * data, size_t size);
+		void nextRow();
+
+	public:
+		RowDecoder(unsigned int width, size_t total_rows, const std::function<void(size_t, const Component *)> & callback,
+			bool varint = false);
+
+		// Decodes the next size bytes of the stream
+		void feed(const unsigned char * data, size_t size);
+
+		// Decodes a CPI_DEDUP or CPI_PREDICTED stream: segments of block_length components in bands of band_rows rows of
+		// planes of "image_height" rows. Call before the first feed.
+		void setSegments(unsigned short segment_length, unsigned int image_height, unsigned int rows_per_band);
+
+		// Expands a run into the current row (and the next ones, if it is longer)
+		void putRun(Component value, size_t count);
+
+		// Completes a truncated stream: the current row and all missing rows are emitted filled with zeros.
+		void finish();
+
+		size_t getRowsDone() const {return rows_done;}
+		bool isComplete() const {return rows_done == rows;}
+	};
+
+	// The number of threads to use for a requested count: 0 means one per hardware thread.
+	unsigned int resolveThreadCount(unsigned int requested);
+
+	// Calls body(task) for every task in [0, tasks) on up to "threads" threads: the calling one and threads of
+	// the compute pool (see task_pool.h), so never more than the pool has. When called from a task of the
+	// compute pool, only the threads of the pool that are idle help. Tasks are handed out in increasing
+	// order. If a task throws, no more tasks start, and the first exception is rethrown on the calling thread
+	// once every running task is done.
+	void parallelFor(size_t tasks, unsigned int threads, const std::function<void(size_t)> & body);
+
+} //namespace imaging
@@ -0,0 +1,94 @@
+//------------------------------------------------------------
+//
+// rle_convert: converts the images listed in a manifest to the
+// RLE format with the BatchConverter pipeline and reports how
+// busy each pipeline stage was, to help size the hosts.
+//
+// usage: rle_convert MANIFEST [--readers N] [--encoders N] [--writers N]
+//                    [--queue N] [--block N] [--threshold N] 
+//                    [--varint] [--index ROWS] [--predict] [--pyramid LEVELS]
+//                    [--metrics FILE]
+//
+// The manifest lists one "input output" pair per line. --metrics
+// writes the codec metrics of the run in the Prometheus text
+// format to FILE ("-" for the standard output).
+//
+//-------------------------------------------------------------
+
+#include "batch_converter.h"
+#include "rle_metrics.h"
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <string>
+
+using namespace std;
+using namespace imaging;
+
+static void printStage(const char * name, const BatchStageStats & stage, double wall_seconds) {
+    cout << "  " << name << ": " << stage.threads << " threads, " << stage.items << " images, "
+         << stage.busy_seconds << " s busy, utilization " << (int) (100 * stage.getUtilization(wall_seconds) + 0.5)
+         << "%" << endl;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        cerr << "usage: rle_convert MANIFEST [--readers N] [--encoders N] [--writers N] [--queue N]\n"
+             << "                   [--block N] [--threshold N] [--varint] [--index ROWS] [--predict]\n"
+             << "                   [--pyramid LEVELS] [--metrics FILE]" << endl;
+        return 1;
+    }
+    
+    BatchConverter converter;
+    RLEImageWriter & writer = converter.getWriterSettings();
+    string metrics_file;
+    
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        unsigned int value = i + 1 < argc ? (unsigned int) strtoul(argv[i + 1], nullptr, 10) : 0;
+        if (arg == "--readers") { converter.setReaderThreads(value); ++i; }
+        else if (arg == "--encoders") { converter.setEncoderThreads(value); ++i; }
+        else if (arg == "--writers") { converter.setWriterThreads(value); ++i; }
+        else if (arg == "--queue") { converter.setQueueCapacity(value); ++i; }
+        else if (arg == "--block") { writer.setBlockDimension(value); ++i; }
+        else if (arg == "--threshold") { writer.setThreshold((Component) value); ++i; }
+        else if (arg == "--index") { writer.setIndexBandRows(value); ++i; }
+        else if (arg == "--varint") { writer.setVariableLengthCounts(true); }
+        else if (arg == "--predict") { writer.setPrediction(true); }
+        else if (arg == "--pyramid") { writer.setPyramid(value); ++i; }
+        else if (arg == "--metrics" && i + 1 < argc) { metrics_file = argv[++i]; }
+        else {
+            cerr << "Unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    
+    vector<BatchJob> jobs;
+    if (!BatchConverter::loadManifest(argv[1], jobs)) {
+        cerr << "Cannot read manifest " << argv[1] << endl;
+        return 1;
+    }
+    
+    setMetricsEnabled(!metrics_file.empty());
+    BatchReport report = converter.run(jobs);
+    
+    cout << report.converted << " converted, " << report.failed << " failed in " 
+         << report.wall_seconds << " s" << endl;
+    printStage("read", report.read, report.wall_seconds);
+    printStage("encode", report.encode, report.wall_seconds);
+    printStage("write", report.write, report.wall_seconds);
+    for (const string & error : report.errors) {
+        cerr << error << endl;
+    }
+    
+    if (metrics_file == "-") {
+        getMetricsSnapshot().writePrometheus(cout);
+    } else if (!metrics_file.empty()) {
+        ofstream out(metrics_file);
+        getMetricsSnapshot().writePrometheus(out);
+        if (!out) {
+            cerr << "Cannot write metrics to " << metrics_file << endl;
+        }
+    }
+    return report.failed == 0 ? 0 : 2;
+}
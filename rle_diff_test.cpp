@@ -0,0 +1,576 @@
+//------------------------------------------------------------
+//
+// rle_diff_test: differential test of the RLE codec.
+//
+// Encodes synthetic images with a plain scalar implementation
+// of the version 2 format, and of its runs with variable
+// length counts (written here from the format description,
+// sharing no code with the codec), and checks that every
+// encoder variant of RLEImageWriter produces the same bytes:
+// the scalar and the vectorized kernels, the encoders of the
+// block lengths that have one, one or several threads, planar
+// and interleaved pixels, streamed rows and asynchronous
+// writes. Every decoder variant of
+// RLEImageReader (decode, read, mapped read, parallel read,
+// readStream, readInterleaved, readRegion, readRows,
+// readAsync) must then give back the pixels of the reference
+// decoder. The version 3 options (variable length counts,
+// index, adaptive mode, deduplication, prediction, tiles and
+// pyramid levels) have no reference encoder: their files must
+// be the same with either kernel and any thread count, decode
+// the same way with every decoder variant and stay within the
+// error bound of the original image.
+//
+// usage: rle_diff_test [--tmp DIR]
+//
+// The Block class, which the codec no longer uses, gets direct
+// checks of the operations whose off-by-one reads were fixed:
+// reverse, operator== with a margin, the iterator and
+// copyFromImage.
+//
+// Prints every mismatch and exits with 1 if there was any.
+//
+//-------------------------------------------------------------
+
+#include "Image.h"
+#include "vec2.h"
+#include "Block.h"
+#include "rle_format.h"
+#include "rle_simd.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+using namespace imaging;
+
+static unsigned int failures = 0;
+static string case_name;
+
+static void check(bool ok, const string & what) {
+    if (!ok) {
+        cout << "FAIL " << case_name << ": " << what << endl;
+        ++failures;
+    }
+}
+
+//small deterministic generator, so every run sees the same corpus
+static unsigned int nextRandom(unsigned int & state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+//generates a non interlaced image of the given kind
+static vector<Component> generateImage(const string & kind, unsigned int width, unsigned int height) {
+    vector<Component> data((size_t) width * height * 3);
+    unsigned int state = width * 131 + height * 7 + (unsigned int) kind.size();
+    size_t run_left = 0;
+    Component run_value = 0;
+
+    for (size_t c = 0; c < 3; ++c) {
+        Component * plane = data.data() + c * width * height;
+        for (unsigned int y = 0; y < height; ++y) {
+            for (unsigned int x = 0; x < width; ++x) {
+                Component v;
+                if (kind == "flat") {
+                    v = (Component) (40 + 80 * c);
+                } else if (kind == "gradient") {
+                    v = (Component) (255 * (x + y) / (width + height));
+                } else if (kind == "noise") {
+                    v = (Component) nextRandom(state);
+                } else if (kind == "document") {
+                    unsigned int line_y = y % 24, glyph_x = x % 64;
+                    bool ink = line_y >= 6 && line_y < 18 && ((glyph_x * 7 + line_y * 13) % 11 < 4) && x % 8 != 0;
+                    v = (Component) (ink ? 30 + 10 * c : 245);
+                } else {
+                    //"runs": runs of random length, some longer than 255 components, with values a few apart
+                    if (run_left == 0) {
+                        run_left = 1 + nextRandom(state) % (nextRandom(state) % 4 == 0 ? 700 : 12);
+                        run_value = (Component) (run_value + nextRandom(state) % 9);
+                    }
+                    --run_left;
+                    v = run_value;
+                }
+                plane[(size_t) y * width + x] = v;
+            }
+        }
+    }
+    return data;
+}
+
+template <typename T>
+static void appendField(vector<unsigned char> & out, T value) {
+    unsigned char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+//the reference encoder: a version 2 file, every row of every plane split in segments
+//of block_length components, each made of runs whose components are within threshold
+//of the first one, counts above 255 split in several pairs. With varint_counts it is
+//the version 3 file of the same runs, each count a single LEB128 number
+static vector<unsigned char> referenceEncode(const vector<Component> & pixels, unsigned int width, unsigned int height,
+        unsigned int block_length, Component threshold, bool varint_counts) {
+    vector<unsigned char> out = {'C', 'P', 'I', (unsigned char) (varint_counts ? 3 : 2)};
+    appendField<unsigned short>(out, 258);
+    appendField<unsigned short>(out, (unsigned short) width);
+    appendField<unsigned short>(out, (unsigned short) height);
+    appendField<unsigned short>(out, (unsigned short) block_length);
+    if (varint_counts) {
+        appendField<unsigned short>(out, CPI_VARINT_COUNTS);
+        appendField<unsigned short>(out, 0);
+    }
+
+    for (size_t row = 0; row < 3 * (size_t) height; ++row) {
+        const Component * src = pixels.data() + row * width;
+        for (size_t x = 0; x < width; x += block_length) {
+            size_t end = min((size_t) width, x + block_length);
+            size_t i = x;
+            while (i < end) {
+                size_t count = 1;
+                while (i + count < end && abs((int) src[i + count] - (int) src[i]) <= threshold) {
+                    ++count;
+                }
+                if (varint_counts) {
+                    out.push_back(src[i]);
+                    for (size_t left = count; ; left >>= 7) {
+                        out.push_back((unsigned char) ((left & 0x7F) | (left >= 0x80 ? 0x80 : 0)));
+                        if (left < 0x80) {
+                            break;
+                        }
+                    }
+                }
+                for (size_t left = varint_counts ? 0 : count; left > 0; ) {
+                    size_t pair = min(left, (size_t) 255);
+                    out.push_back(src[i]);
+                    out.push_back((unsigned char) pair);
+                    left -= pair;
+                }
+                i += count;
+            }
+        }
+    }
+    return out;
+}
+
+//the reference decoder of a version 2 file
+static vector<Component> referenceDecode(const vector<unsigned char> & file, unsigned int width, unsigned int height) {
+    vector<Component> pixels;
+    for (size_t i = 12; i + 1 < file.size(); i += 2) {
+        pixels.insert(pixels.end(), file[i + 1], file[i]);
+    }
+    pixels.resize((size_t) width * height * 3);
+    return pixels;
+}
+
+//a quarter of the image, the way the writer makes pyramid levels: the rounded mean of
+//every 2 X 2 components, the last row and column repeated when the size is odd
+static vector<Component> referenceHalve(const vector<Component> & pixels, unsigned int & width, unsigned int & height) {
+    unsigned int half_width = (width + 1) / 2, half_height = (height + 1) / 2;
+    vector<Component> half((size_t) half_width * half_height * 3);
+    for (size_t c = 0; c < 3; ++c) {
+        const Component * plane = pixels.data() + c * width * height;
+        for (unsigned int y = 0; y < half_height; ++y) {
+            for (unsigned int x = 0; x < half_width; ++x) {
+                unsigned int x0 = 2 * x, x1 = min(2 * x + 1, width - 1);
+                unsigned int y0 = 2 * y, y1 = min(2 * y + 1, height - 1);
+                unsigned int sum = plane[(size_t) y0 * width + x0] + plane[(size_t) y0 * width + x1] +
+                    plane[(size_t) y1 * width + x0] + plane[(size_t) y1 * width + x1];
+                half[c * half_width * half_height + (size_t) y * half_width + x] = (Component) ((sum + 2) / 4);
+            }
+        }
+    }
+    width = half_width;
+    height = half_height;
+    return half;
+}
+
+static vector<Component> interleave(const vector<Component> & pixels, unsigned int width, unsigned int height) {
+    size_t plane = (size_t) width * height;
+    vector<Component> rgb(3 * plane);
+    for (size_t i = 0; i < plane; ++i) {
+        for (size_t c = 0; c < 3; ++c) {
+            rgb[3 * i + c] = pixels[c * plane + i];
+        }
+    }
+    return rgb;
+}
+
+//the rectangle [x, x + w) X [y, y + h) of every plane, clipped to the image
+static vector<Component> crop(const vector<Component> & pixels, unsigned int width, unsigned int height,
+        unsigned int x, unsigned int y, unsigned int & w, unsigned int & h) {
+    w = x < width ? min(w, width - x) : 0;
+    h = y < height ? min(h, height - y) : 0;
+    vector<Component> result;
+    for (size_t c = 0; c < 3; ++c) {
+        for (unsigned int row = y; row < y + h; ++row) {
+            const Component * src = pixels.data() + c * width * height + (size_t) row * width + x;
+            result.insert(result.end(), src, src + w);
+        }
+    }
+    return result;
+}
+
+static vector<unsigned char> readFile(const string & filename) {
+    ifstream in(filename, ios_base::in | ios_base::binary);
+    return vector<unsigned char>(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+static void writeFile(const string & filename, const vector<unsigned char> & data) {
+    ofstream out(filename, ios_base::out | ios_base::binary | ios_base::trunc);
+    out.write((const char *) data.data(), data.size());
+}
+
+//true if image holds exactly the planes of expected; deletes the image
+static bool sameImage(Image * image, const vector<Component> & expected, unsigned int width, unsigned int height) {
+    unique_ptr<Image> owner(image);
+    return image != nullptr && image->getWidth() == width && image->getHeight() == height &&
+        equal(expected.begin(), expected.end(), image->getRawDataPtr());
+}
+
+//largest difference of two planes of the same size
+static int maxError(const Component * a, const vector<Component> & b) {
+    int error = 0;
+    for (size_t i = 0; i < b.size(); ++i) {
+        error = max(error, abs((int) a[i] - (int) b[i]));
+    }
+    return error;
+}
+
+class PlaneSource : public RLERowSource
+{
+protected:
+    const vector<Component> & pixels;
+    unsigned int width, height;
+public:
+    PlaneSource(const vector<Component> & data, unsigned int w, unsigned int h) : pixels(data), width(w), height(h) {}
+
+    virtual bool getRow(Image::channel_t channel, unsigned int y, Component * row) {
+        const Component * src = pixels.data() + ((size_t) channel * height + y) * width;
+        copy(src, src + width, row);
+        return true;
+    }
+};
+
+class PlaneSink : public RLERowSink
+{
+public:
+    vector<Component> pixels;
+    unsigned int width, height;
+    bool in_order;
+    size_t next_row;
+
+    PlaneSink() : width(0), height(0), in_order(true), next_row(0) {}
+
+    virtual void begin(unsigned int w, unsigned int h) {
+        width = w;
+        height = h;
+        pixels.assign((size_t) w * h * 3, 0);
+    }
+
+    virtual void putRow(Image::channel_t channel, unsigned int y, const Component * row) {
+        size_t index = (size_t) channel * height + y;
+        if (index != next_row++ || index >= 3 * (size_t) height) {
+            in_order = false;
+            return;
+        }
+        copy(row, row + width, pixels.begin() + index * width);
+    }
+};
+
+//checks that every decoder variant gives back expected from the file
+static void checkDecoders(const string & filename, const vector<Component> & expected, unsigned int width,
+        unsigned int height) {
+    vector<unsigned char> file = readFile(filename);
+    RLEImageReader reader;
+    reader.setVerbose(false);
+
+    check(sameImage(reader.decode(file.data(), file.size()), expected, width, height), "decode");
+    check(sameImage(reader.read(filename), expected, width, height), "read");
+    check(sameImage(reader.readAsync(filename).get(), expected, width, height), "readAsync");
+
+    //a buffer of a few bytes splits pairs between the reads
+    PlaneSink sink;
+    reader.setStreamBufferSize(7);
+    check(reader.readStream(filename, sink) && sink.in_order && sink.next_row == 3 * (size_t) height &&
+        sink.pixels == expected, "readStream");
+
+    vector<Component> rgb;
+    unsigned int read_width = 0, read_height = 0;
+    check(reader.readInterleaved(filename, rgb, read_width, read_height) && read_width == width &&
+        read_height == height && rgb == interleave(expected, width, height), "readInterleaved");
+
+    unsigned int x = width / 4, y = height / 3, w = width / 2 + 1, h = height / 2 + 1;
+    vector<Component> region = crop(expected, width, height, x, y, w, h);
+    check(sameImage(reader.readRegion(filename, x, y, width / 2 + 1, height / 2 + 1), region, w, h), "readRegion");
+
+    unsigned int rows_width = width, rows_height = height / 2 + 1;
+    vector<Component> rows = crop(expected, width, height, 0, y, rows_width, rows_height);
+    check(sameImage(reader.readRows(filename, y, height / 2 + 1), rows, rows_width, rows_height), "readRows");
+
+    reader.setThreadCount(3);
+    check(sameImage(reader.read(filename), expected, width, height), "read with 3 threads");
+    check(sameImage(reader.decode(file.data(), file.size()), expected, width, height), "decode with 3 threads");
+    check(sameImage(reader.readRegion(filename, x, y, width / 2 + 1, height / 2 + 1), region, w, h),
+        "readRegion with 3 threads");
+
+    reader.setThreadCount(1);
+    reader.setMemoryMapped(true);
+    check(sameImage(reader.read(filename), expected, width, height), "mapped read");
+    check(sameImage(reader.readRegion(filename, x, y, width / 2 + 1, height / 2 + 1), region, w, h), "mapped readRegion");
+}
+
+static Block makeBlock(const vector<Component> & values) {
+    Block block(values.size());
+    block.setData(values.data());
+    return block;
+}
+
+static bool holds(const Block & block, const vector<Component> & values) {
+    return block.getSize() == values.size() && equal(values.begin(), values.end(), block.getDataPtr());
+}
+
+//reverse, operator==, the iterator and copyFromImage, at the edges where they read past their data before
+static void checkBlocks() {
+    case_name = "Block";
+    for (const vector<Component> & values : vector<vector<Component> >{{7}, {1, 2}, {1, 2, 3, 4, 5}, vector<Component>(37, 9)}) {
+        vector<Component> reversed(values.rbegin(), values.rend());
+        check(holds(makeBlock(values).reverse(), reversed), "reverse of " + to_string(values.size()) + " components");
+    }
+
+    //the difference of the last pair is at the margin, across the boundary of the 16 and 32 component steps
+    vector<Component> low(37, 0), high(37, 0);
+    low[0] = 0; high[0] = 3;
+    low[36] = 255; high[36] = 252;
+    Block a = makeBlock(low), b = makeBlock(high);
+    for (Component margin = 2; margin <= 3; ++margin) {
+        a.setErrorMargin(margin);
+        b.setErrorMargin(margin);
+        string label = " with margin " + to_string((int) margin);
+        check((a == b) == (margin == 3) && (b == a) == (margin == 3), "operator==" + label);
+        check((a != b) == (margin != 3), "operator!=" + label);
+    }
+    a.setErrorMargin(0);
+    check(a == makeBlock(low) && !(a == makeBlock(vector<Component>(36, 0))), "operator== of sizes that differ");
+
+    Block sequence = makeBlock({10, 20, 30});
+    Block::iterator it = sequence.begin();
+    Block::iterator old = it++;
+    check(*old == 10 && *it == 20 && old != it, "iterator post-increment");
+    vector<Component> visited;
+    for (Block::iterator i = sequence.begin(); i != sequence.end(); i++) {
+        visited.push_back(*i);
+    }
+    check(holds(sequence, visited), "iterator traversal");
+
+    //a 10 X 4 image whose GREEN component at (x, y) is 100 + 10 * y + x
+    vector<Component> pixels(10 * 4 * 3, 0);
+    for (unsigned int y = 0; y < 4; ++y) {
+        for (unsigned int x = 0; x < 10; ++x) {
+            pixels[40 + y * 10 + x] = (Component) (100 + 10 * y + x);
+        }
+    }
+    Image image(10, 4, pixels.data(), false);
+    unique_ptr<Block> clipped(Block::copyFromImage(image, Image::GREEN, vecmath::ivec2(7, 3), 5));
+    check(clipped != nullptr && holds(*clipped, {137, 138, 139}), "copyFromImage clipped at the right edge");
+    unique_ptr<Block> inside(Block::copyFromImage(image, Image::GREEN, vecmath::ivec2(2, 1), 3));
+    check(inside != nullptr && holds(*inside, {112, 113, 114}), "copyFromImage inside the image");
+    check(unique_ptr<Block>(Block::copyFromImage(image, Image::GREEN, vecmath::ivec2(0, 4), 5)) == nullptr,
+        "copyFromImage past the last row");
+    check(unique_ptr<Block>(Block::copyFromImage(image, Image::BLUE, vecmath::ivec2(10, 0), 5)) == nullptr,
+        "copyFromImage past the right edge");
+    check(unique_ptr<Block>(Block::copyFromImage(image, Image::RED, vecmath::ivec2(0, 0), 0)) == nullptr,
+        "copyFromImage of no components");
+}
+
+//a writer option of version 3 files
+struct Variant
+{
+    const char * name;
+    //the runs are the same as version 2 files have, so the decoded pixels are those of the reference
+    bool same_runs;
+    //lossless writes only
+    bool lossless_only;
+    void (*configure)(RLEImageWriter & writer, Component threshold);
+};
+
+static const Variant VARIANTS[] = {
+    {"varint", true, false, [] (RLEImageWriter & w, Component) {w.setVariableLengthCounts(true);}},
+    {"index", true, false, [] (RLEImageWriter & w, Component) {w.setIndexBandRows(16);}},
+    {"index+varint", true, false, [] (RLEImageWriter & w, Component) {w.setIndexBandRows(7); w.setVariableLengthCounts(true);}},
+    {"adaptive", false, false, [] (RLEImageWriter & w, Component t) {w.setAdaptive(true); w.setQualityBound(t);}},
+    {"dedup", false, false, [] (RLEImageWriter & w, Component) {w.setDeduplication(true);}},
+    {"dedup+index", false, false, [] (RLEImageWriter & w, Component) {w.setDeduplication(true); w.setIndexBandRows(16);}},
+    {"predict", true, true, [] (RLEImageWriter & w, Component) {w.setPrediction(true);}},
+    {"predict+index", true, true, [] (RLEImageWriter & w, Component) {w.setPrediction(true); w.setIndexBandRows(16);}},
+    {"tiles rows", false, false, [] (RLEImageWriter & w, Component) {w.setTiles(16, CPI_SCAN_ROWS);}},
+    {"tiles serpentine", false, false, [] (RLEImageWriter & w, Component) {w.setTiles(8, CPI_SCAN_SERPENTINE);}},
+    {"tiles zorder+index", false, false, [] (RLEImageWriter & w, Component) {w.setTiles(16, CPI_SCAN_ZORDER); w.setIndexBandRows(1);}},
+    {"tiles hilbert+varint", false, false, [] (RLEImageWriter & w, Component) {w.setTiles(4, CPI_SCAN_HILBERT); w.setVariableLengthCounts(true);}},
+    {"pyramid", true, false, [] (RLEImageWriter & w, Component) {w.setPyramid(3);}},
+    {"pyramid+index", true, false, [] (RLEImageWriter & w, Component) {w.setPyramid(CPI_MAX_PYRAMID_LEVELS); w.setIndexBandRows(16);}}
+};
+
+//encodes the image with every encoder variant of the writer, expecting the bytes of the reference
+static void checkEncoders(const string & filename, const vector<Component> & pixels, unsigned int width,
+        unsigned int height, unsigned int block, Component threshold, bool varint_counts,
+        const vector<unsigned char> & expected) {
+    Image image(width, height, pixels.data(), false);
+    vector<Component> rgb = interleave(pixels, width, height);
+    RLEImageWriter writer;
+    writer.setVerbose(false);
+    writer.setBlockDimension(block);
+    writer.setThreshold(threshold);
+    writer.setVariableLengthCounts(varint_counts);
+    vector<unsigned char> encoded;
+
+    for (unsigned int threads : {1u, 3u, 0u}) {
+        writer.setThreadCount(threads);
+        string label = " with " + to_string(threads) + " threads";
+        writer.encode(image, encoded);
+        check(encoded == expected, "encode" + label);
+        writer.encodeInterleaved(width, height, rgb.data(), encoded);
+        check(encoded == expected, "encodeInterleaved" + label);
+        writer.write(filename, image);
+        check(readFile(filename) == expected, "write" + label);
+        check(writer.writeInterleaved(filename, width, height, rgb.data()) && readFile(filename) == expected,
+            "writeInterleaved" + label);
+        check(writer.writeAsync(filename, image).get() && readFile(filename) == expected, "writeAsync" + label);
+    }
+
+    PlaneSource source(pixels, width, height);
+    check(writer.writeStream(filename, width, height, source) && readFile(filename) == expected, "writeStream");
+}
+
+static void checkVariant(const Variant & variant, const string & filename, const vector<Component> & pixels,
+        unsigned int width, unsigned int height, unsigned int block, Component threshold,
+        const vector<Component> & reference) {
+    Image image(width, height, pixels.data(), false);
+    RLEImageWriter writer;
+    writer.setVerbose(false);
+    writer.setBlockDimension(block);
+    writer.setThreshold(threshold);
+    variant.configure(writer, threshold);
+
+    //the scalar kernels with one thread make the file the other encoders must match
+    setScalarKernels(true);
+    vector<unsigned char> expected, encoded;
+    writer.encode(image, expected);
+    setScalarKernels(false);
+    writer.encode(image, encoded);
+    check(encoded == expected, string(variant.name) + ": vectorized encode");
+    writer.setThreadCount(3);
+    writer.encode(image, encoded);
+    check(encoded == expected, string(variant.name) + ": encode with 3 threads");
+    vector<Component> rgb = interleave(pixels, width, height);
+    writer.encodeInterleaved(width, height, rgb.data(), encoded);
+    check(encoded == expected, string(variant.name) + ": encodeInterleaved");
+
+    RLEImageReader reader;
+    reader.setVerbose(false);
+    unique_ptr<Image> decoded(reader.decode(expected.data(), expected.size()));
+    check(decoded != nullptr, string(variant.name) + ": decode");
+    if (decoded == nullptr) {
+        return;
+    }
+    int error = maxError(decoded->getRawDataPtr(), pixels);
+    check(error <= threshold, string(variant.name) + ": error " + to_string(error) + " above the threshold");
+    if (variant.same_runs) {
+        check(equal(reference.begin(), reference.end(), decoded->getRawDataPtr()), string(variant.name) +
+            ": decoded pixels differ from the reference");
+    }
+
+    string saved = case_name;
+    case_name += " " + string(variant.name);
+    vector<Component> planes(decoded->getRawDataPtr(), decoded->getRawDataPtr() + pixels.size());
+    writeFile(filename, expected);
+    checkDecoders(filename, planes, width, height);
+
+    //every level of a lossless pyramid holds the reduced original
+    unsigned int level_width = width, level_height = height;
+    vector<Component> level = pixels;
+    for (unsigned int l = 1; threshold == 0 && l <= CPI_MAX_PYRAMID_LEVELS; ++l) {
+        Image * read = reader.readLevel(filename, l);
+        if (read == nullptr || (level_width == 1 && level_height == 1)) {
+            delete read;
+            break;
+        }
+        level = referenceHalve(level, level_width, level_height);
+        check(sameImage(read, level, level_width, level_height), "readLevel " + to_string(l));
+    }
+    case_name = saved;
+}
+
+int main(int argc, char ** argv) {
+    string tmp_dir = ".";
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--tmp" && i + 1 < argc) {
+            tmp_dir = argv[++i];
+        } else {
+            cerr << "usage: rle_diff_test [--tmp DIR]" << endl;
+            return 1;
+        }
+    }
+    string filename = tmp_dir + "/rle_diff_test.rle";
+
+    checkBlocks();
+
+    const char * kinds[] = {"flat", "gradient", "noise", "document", "runs"};
+    const unsigned int sizes[][2] = {{1, 1}, {7, 5}, {64, 48}, {131, 67}, {600, 9}};
+    //16, 32, 64 and 256 have encoders of their own (see rle_kernels.h)
+    const unsigned int blocks[] = {2, 16, 32, 64, 255, 256, 1000};
+    const Component thresholds[] = {0, 5};
+    unsigned int cases = 0;
+
+    for (const char * kind : kinds) {
+        for (const auto & size : sizes) {
+            unsigned int width = size[0], height = size[1];
+            vector<Component> pixels = generateImage(kind, width, height);
+            for (unsigned int block : blocks) {
+                for (Component threshold : thresholds) {
+                    stringstream name;
+                    name << kind << " " << width << "x" << height << " block " << block << " threshold " << (int) threshold;
+                    case_name = name.str();
+                    ++cases;
+
+                    vector<unsigned char> expected = referenceEncode(pixels, width, height, block, threshold, false);
+                    vector<Component> reference = referenceDecode(expected, width, height);
+
+                    //both count formats hold the same runs, so they decode to the same pixels
+                    for (bool varint_counts : {false, true}) {
+                        if (varint_counts) {
+                            expected = referenceEncode(pixels, width, height, block, threshold, true);
+                        }
+                        for (bool scalar : {true, false}) {
+                            setScalarKernels(scalar);
+                            case_name = name.str() + (varint_counts ? " varint" : "") + (scalar ? " scalar" : " vectorized");
+                            checkEncoders(filename, pixels, width, height, block, threshold, varint_counts, expected);
+                            writeFile(filename, expected);
+                            checkDecoders(filename, reference, width, height);
+                        }
+                    }
+                    setScalarKernels(false);
+
+                    case_name = name.str();
+                    for (const Variant & variant : VARIANTS) {
+                        if (!variant.lossless_only || threshold == 0) {
+                            checkVariant(variant, filename, pixels, width, height, block, threshold, reference);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    remove(filename.c_str());
+
+    cout << cases << " cases, " << failures << " failures (kernels: " << getRunScannerName() << ")" << endl;
+    return failures == 0 ? 0 : 1;
+}
@@ -2,117 +2,985 @@
 #include "Image.h"
 #include "vec2.h"
 #include "Block.h"
+#include "rle_simd.h"
+#include "rle_codec.h"
+#include "rle_kernels.h"
+#include "mapped_file.h"
+#include "output_file.h"
+#include "rle_metrics.h"
+#include "task_pool.h"
+#include "io_ring.h"
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
+#include <cmath>
+#include <memory>
 
 using namespace std;
 using namespace imaging;
 
-//helper function to read binary data
-static unsigned short readUnsignedShortBinary(istream &in) {
-    unsigned short * buffer = new unsigned short[1];
-    in.read((char*) buffer, 2);
-    unsigned short result = *buffer;
-    delete[] buffer;
-    return result;
+//bands of unindexed files written with deduplication or prediction, which copies
+//and predictions never cross
+static const unsigned short SEGMENT_BAND_ROWS = 64;
+
+//counts a failed call and prints the message unless the caller is quiet. The
+//caller still adds the log entry
+static void reportFailure(bool verbose, const string & message) {
+    if (verbose) {
+        cout << message << endl;
+    }
+    addMetric(COUNTER_ERRORS, 1);
 }
 
-//compression
-static vector<Component> * compress(Block * bl, Component err) {
-    vector<Component> * result = new vector<Component>();
-    Component current = *(bl->begin());
-    int count = 0;
-    Block::iterator end = bl->end();
+//compression of a single row segment. The runs are appended to out, so the caller 
+//can reuse the same buffer for every segment. Returns the number of runs
+static size_t compress(const BlockView & bl, Component err, bool varint_counts, vector<Component> & out) {
+    size_t length = bl.getSize();
+    if (length == 0) {
+        return 0;
+    }
+    size_t runs = 1;
+    
+    //contiguous segments: let the vectorized scanner find the end of each run
+    if (bl.getStride() == 1) {
+        const Component * data = bl.getDataPtr();
+        size_t i = 0;
+        while (i < length) {
+            size_t count = scanRun(data + i, length - i, err);
+            appendRun(out, data[i], count, varint_counts);
+            i += count;
+            ++runs;
+        }
+        return runs - 1;
+    }
+    
+    Component current = bl[0];
+    size_t count = 0;
     
-    int i = 0;
-    for (Block::iterator iter = bl->begin(); iter != end; ++iter) {
-        Component c = *iter;
+    for (size_t i = 0; i < length; ++i) {
+        Component c = bl[i];
         if (abs( ((int) c) - ((int) current) ) <= err ) {
             ++count;
         } else {
-            result->push_back(current);
-            result->push_back(count);
+            appendRun(out, current, count, varint_counts);
             count = 1;
             current = c;
+            ++runs;
+        }
+    }
+    appendRun(out, current, count, varint_counts);
+    return runs;
+}
+
+//number of runs the segment compresses to with threshold err, the same runs compress 
+//makes. If sse is given, it receives the sum of the squared errors of the components
+static size_t measureRuns(const BlockView & bl, Component err, double * sse) {
+    size_t length = bl.getSize();
+    size_t runs = 0;
+    double total = 0.0;
+    
+    for (size_t i = 0; i < length; ++runs) {
+        size_t count = 1;
+        if (bl.getStride() == 1) {
+            count = scanRun(bl.getDataPtr() + i, length - i, err);
+        } else {
+            while (i + count < length && abs( ((int) bl[i + count]) - ((int) bl[i]) ) <= err) {
+                ++count;
+            }
+        }
+        if (sse != nullptr && err > 0) {
+            for (size_t k = 1; k < count; ++k) {
+                double d = (int) bl[i + k] - (int) bl[i];
+                total += d * d;
+            }
+        }
+        i += count;
+    }
+    if (sse != nullptr) {
+        *sse = total;
+    }
+    return runs;
+}
+
+//decodes a tiled stream one row of tiles (band) at a time and hands its rows to the sink.
+//Where a band ends is known only once it is decoded, so a band that the bytes read so far
+//do not complete is decoded again after the next read. Each read is at least as large as
+//the bytes pending, so a band is decoded a few times at most. Returns false if the stream
+//ends early; the rows that are missing are 0
+static bool streamTiles(istream & in, const CPIHeader & header, size_t buffer_size, RLERowSink & sink,
+        unsigned long long & consumed) {
+    unsigned int bands = header.getBandCount();
+    vector<unsigned char> pending;
+    vector<Component> rows((size_t) header.band_rows * header.width);
+    size_t start = 0;
+    bool complete = true;
+    
+    for (unsigned int band = 0; band < 3 * bands; ++band) {
+        unsigned int first_row = header.getBandFirstRow(band % bands);
+        unsigned int last_row = header.getBandLastRow(band % bands);
+        size_t band_size = (size_t) (last_row - first_row) * header.width;
+        
+        while (complete) {
+            StageTimer decode_timer(STAGE_DECODE);
+            size_t used = 0;
+            size_t decoded = decodeTiles(header, pending.data() + start, pending.size() - start, band, rows.data(),
+                    band_size, &used);
+            decode_timer.stop();
+            if (decoded == band_size) {
+                start += used;
+                break;
+            }
+            if (!in) {
+                complete = false;
+                break;
+            }
+            //drop the bands already decoded and read more
+            pending.erase(pending.begin(), pending.begin() + start);
+            start = 0;
+            size_t kept = pending.size();
+            StageTimer read_timer(STAGE_PAYLOAD_READ);
+            pending.resize(kept + max(buffer_size, kept));
+            in.read((char*) pending.data() + kept, pending.size() - kept);
+            pending.resize(kept + (size_t) in.gcount());
+            consumed += (unsigned long long) in.gcount();
+        }
+        //the bands after the end of a truncated stream have no data at all
+        if (!complete) {
+            fill(rows.begin(), rows.end(), 0);
+        }
+        for (unsigned int y = first_row; y < last_row; ++y) {
+            sink.putRow((Image::channel_t) (band / bands), y, rows.data() + (size_t) (y - first_row) * header.width);
         }
-        i++;
     }
-//    cout << "block len " << i << endl;
-    result->push_back(current);
-    result->push_back(count);
+    return complete;
+}
+
+//picks the prediction of a segment that makes the fewest runs: none (CPI_SEGMENT_RUNS), the row
+//above or the gradient. The residuals of both predictions are left in residuals, the ones of the
+//gradient after the others. The segment starts at component x of its row
+static unsigned char choosePrediction(const Component * segment, const Component * above, size_t x, size_t length,
+        vector<Component> & residuals) {
+    //reused by every segment the thread encodes
+    static thread_local vector<unsigned long long> masks;
+    residuals.resize(2 * length);
+    Component * up = residuals.data();
+    Component * gradient = residuals.data() + length;
+    predictUp(segment, above, length, up);
+    predictGradient(segment, above, length, x > 0 ? segment[-1] : 0, x > 0 ? above[-1] : 0, gradient);
     
-    return result;
+    size_t runs = countLosslessRuns(segment, length, masks);
+    size_t up_runs = countLosslessRuns(up, length, masks);
+    size_t gradient_runs = countLosslessRuns(gradient, length, masks);
+    if (gradient_runs < up_runs && gradient_runs < runs) {
+        return CPI_SEGMENT_GRADIENT;
+    }
+    return up_runs < runs ? CPI_SEGMENT_UP : CPI_SEGMENT_RUNS;
 }
 
 namespace imaging {
 
-    //implementation of the rle image writer
+    //encodes a row as described by the header. The row is split in segments of block_length 
+    //components (the last one holds the remainder), compressed one after the other.
+    //Adaptive rows also append their entry of the segment table to segments. With 
+    //deduplication, dictionary holds the segments of the band before the row. With
+    //prediction, above is the row above in the band, nullptr for the first row of a band.
+    //Returns the number of runs written
+    size_t RLEImageWriter::encodeRow(const BlockView & row, const CPIHeader & header, vector<Component> & out,
+            vector<Component> & segments, SegmentDictionary * dictionary, const Component * above) const {
+        if (header.flags & CPI_ADAPTIVE) {
+            return encodeAdaptiveRow(row, header, out, segments);
+        }
+        size_t runs = 0;
+        
+        const Component * data = row.getDataPtr();
+        bool varint_counts = (header.flags & CPI_VARINT_COUNTS) != 0;
+        
+        //full segments of contiguous rows go to the kernel specialized for the block length,
+        //if there is one; the remainder at the end of the row to the generic encoder
+        SegmentKernel<Component>::type kernel = nullptr;
+        if (row.getStride() == 1) {
+            kernel = getSegmentKernel<Component>(header.block_length, threshold == 0, varint_counts);
+        }
+        
+        for (size_t x = 0; x < row.getSize(); x += header.block_length) {
+            size_t length = min((size_t) header.block_length, row.getSize() - x);
+            const Component * segment = data + x * row.getStride();
+            
+            if (header.hasSegmentOps()) {
+                out.push_back(CPI_SEGMENT_RUNS);
+                //a single run is about as short as a copy, and cheaper to find than a hash
+                if ((header.flags & CPI_DEDUP) && scanRun(segment, length, threshold) < length) {
+                    const Component * match = dictionary->find(segment, length);
+                    if (match != nullptr) {
+                        out.back() = CPI_SEGMENT_COPY;
+                        appendVarint(out, (size_t) (segment - match));
+                        continue;
+                    }
+                    //only segments stored as runs are added, so that the error of
+                    //a copy never builds up over a chain of copies
+                    dictionary->insert(segment, length);
+                }
+                //the same holds for predictions
+                bool predicted = (header.flags & CPI_PREDICTED) && above != nullptr && row.getStride() == 1;
+                if (predicted && scanRun(segment, length, 0) < length) {
+                    //reused by every segment the thread encodes
+                    static thread_local vector<Component> residuals;
+                    out.back() = choosePrediction(segment, above + x, x, length, residuals);
+                    if (out.back() != CPI_SEGMENT_RUNS) {
+                        segment = residuals.data() + (out.back() == CPI_SEGMENT_UP ? 0 : length);
+                    }
+                }
+            }
+            if (kernel != nullptr && length == header.block_length) {
+                runs += kernel(segment, threshold, out);
+            } else {
+                runs += compress(BlockView(segment, length, row.getStride()), threshold, varint_counts, out);
+            }
+        }
+        return runs;
+    }
+
+    //every block of block_length components is measured with 0 and three thresholds up to max_error,
+    //from the lowest up, and gets the lowest one whose runs are within 1/8 of the fewest found.
+    //Consecutive blocks with the same threshold become one segment. With a PSNR bound the
+    //squared error of the row up to component x may not exceed x times the allowed mean
+    size_t RLEImageWriter::encodeAdaptiveRow(const BlockView & row, const CPIHeader & header, vector<Component> & out,
+            vector<Component> & segments) const {
+        const Component * data = row.getDataPtr();
+        size_t width = row.getSize();
+        size_t stride = row.getStride();
+        bool varint_counts = (header.flags & CPI_VARINT_COUNTS) != 0;
+        
+        //0 and three steps up to max_error
+        Component candidates[4];
+        size_t candidate_count = 0;
+        candidates[candidate_count++] = 0;
+        for (unsigned int step = 4; step > 0; step >>= 1) {
+            Component t = (Component) (max_error / step);
+            if (t > candidates[candidate_count - 1]) {
+                candidates[candidate_count++] = t;
+            }
+        }
+        
+        bool bounded_mse = min_psnr > 0.0;
+        double max_mse = bounded_mse ? 255.0 * 255.0 / pow(10.0, min_psnr / 10.0) : 0.0;
+        double row_sse = 0.0;       //error of the segments written so far
+        double pending_sse = 0.0;   //estimated error of the open segment
+        
+        size_t segment_count = 0;
+        size_t table_start = segments.size();
+        size_t runs = 0;
+        
+        //writes the runs and the table entry of [begin, end). Merged blocks may end up with 
+        //other runs than the measured ones, so the bound is checked again for the whole segment
+        auto closeSegment = [&] (size_t begin, size_t end, size_t candidate) {
+            BlockView segment(data + begin * stride, end - begin, stride);
+            if (bounded_mse) {
+                double sse = 0.0;
+                for (; candidate > 0; --candidate) {
+                    measureRuns(segment, candidates[candidate], &sse);
+                    if (row_sse + sse <= max_mse * end) {
+                        break;
+                    }
+                }
+                row_sse += candidate > 0 ? sse : 0.0;
+            }
+            runs += compress(segment, candidates[candidate], varint_counts, out);
+            appendVarint(segments, end - begin);
+            segments.push_back(candidates[candidate]);
+            ++segment_count;
+        };
+        
+        size_t segment_begin = 0;
+        size_t segment_candidate = 0;
+        
+        for (size_t x = 0; x < width; x += header.block_length) {
+            size_t length = min((size_t) header.block_length, width - x);
+            BlockView block(data + x * stride, length, stride);
+            
+            //a threshold as large as the range of the block makes a single run
+            Component low = block[0], high = block[0];
+            for (size_t i = 1; i < length; ++i) {
+                low = min(low, block[i]);
+                high = max(high, block[i]);
+            }
+            
+            size_t runs[4];
+            double sse[4];
+            size_t measured = 0;
+            size_t fewest = length;
+            
+            //threshold 0 has no error, so at least that one is always measured
+            for (; measured < candidate_count; ++measured) {
+                if (candidates[measured] >= high - low && !bounded_mse) {
+                    runs[measured] = 1;
+                } else {
+                    runs[measured] = measureRuns(block, candidates[measured], bounded_mse ? &sse[measured] : nullptr);
+                }
+                if (bounded_mse && row_sse + pending_sse + sse[measured] > max_mse * (x + length)) {
+                    break;
+                }
+                fewest = min(fewest, runs[measured]);
+                if (runs[measured] == 1) {
+                    ++measured;
+                    break;
+                }
+            }
+            size_t chosen = 0;
+            while (runs[chosen] > fewest + fewest / 8) {
+                ++chosen;
+            }
+            
+            if (x > 0 && chosen != segment_candidate) {
+                closeSegment(segment_begin, x, segment_candidate);
+                segment_begin = x;
+                pending_sse = 0.0;
+            }
+            segment_candidate = chosen;
+            pending_sse += bounded_mse ? sse[chosen] : 0.0;
+        }
+        if (width > 0) {
+            closeSegment(segment_begin, width, segment_candidate);
+        }
+        
+        //the entry starts with the number of segments
+        vector<Component> count;
+        appendVarint(count, segment_count);
+        segments.insert(segments.begin() + table_start, count.begin(), count.end());
+        return runs;
+    }
+
+    //encodes a row of tiles: the height rows of width components at rows, one after the other.
+    //Every tile is gathered in scan order and compressed as one segment. Returns the number of runs
+    size_t RLEImageWriter::encodeTiles(const Component * rows, unsigned int width, unsigned int height,
+            const CPIHeader & header, vector<Component> & out) const {
+        bool varint_counts = (header.flags & CPI_VARINT_COUNTS) != 0;
+        TileScans scans(header.scan_order, header.tile_size);
+        //reused by every band the thread encodes
+        static thread_local vector<Component> tile;
+        tile.resize((size_t) header.tile_size * header.tile_size);
+        size_t runs = 0;
+        
+        for (size_t x = 0; x < width; x += header.tile_size) {
+            unsigned int tile_width = (unsigned int) min((size_t) header.tile_size, width - x);
+            const vector<unsigned int> & scan = scans.get(tile_width, height);
+            if (header.scan_order == CPI_SCAN_ROWS) {
+                for (unsigned int y = 0; y < height; ++y) {
+                    memcpy(tile.data() + (size_t) y * tile_width, rows + (size_t) y * width + x, tile_width);
+                }
+            } else {
+                for (size_t k = 0; k < scan.size(); ++k) {
+                    tile[k] = rows[(scan[k] >> 16) * width + x + (scan[k] & 0xFFFF)];
+                }
+            }
+            runs += compress(BlockView(tile.data(), scan.size()), threshold, varint_counts, out);
+        }
+        return runs;
+    }
+
+    void RLEImageWriter::setTiles(unsigned int size, cpi_scan_order_t order) {
+        tile_size = 0;
+        if (size > 0) {
+            for (tile_size = 4; tile_size < size && tile_size < 256; tile_size *= 2);
+        }
+        scan_order = (unsigned short) order;
+    }
+
+    //splits every channel in bands of band_rows rows and encodes each band in its own
+    //buffer on a pool of threads. band_buffers[chanel * bands + band] holds the result,
+    //so concatenating the buffers in order gives the sequential stream
+    void RLEImageWriter::encodeBands(const Image & src, const CPIHeader & header, unsigned int band_rows,
+            unsigned int threads) {
+        unsigned int bands = (src.getHeight() + band_rows - 1) / band_rows;
+        
+        band_buffers.resize(3 * (size_t) bands);
+        band_segments.resize(band_buffers.size());
+        parallelFor(band_buffers.size(), threads, [&] (size_t task) {
+            Image::channel_t chanel = (Image::channel_t) (task / bands);
+            unsigned int first_row = (unsigned int) (task % bands) * band_rows;
+            unsigned int last_row = min(first_row + band_rows, src.getHeight());
+            
+            band_buffers[task].clear();
+            band_segments[task].clear();
+            size_t runs = 0;
+            if (header.flags & CPI_TILED) {
+                const Component * plane = ((Image&) src).getRawDataPtr() + (size_t) chanel * src.getWidth() * src.getHeight();
+                runs = encodeTiles(plane + (size_t) first_row * src.getWidth(), src.getWidth(), last_row - first_row,
+                        header, band_buffers[task]);
+                addMetric(COUNTER_RUNS, runs);
+                return;
+            }
+            SegmentDictionary dictionary(dedup_margin, (header.flags & CPI_DEDUP) ? 12 : 0);
+            for (unsigned int y = first_row; y < last_row; ++y) {
+                BlockView row = BlockView::fromImage((Image&) src, chanel, ivec2(0, y), src.getWidth());
+                runs += encodeRow(row, header, band_buffers[task], band_segments[task], &dictionary,
+                        y > first_row ? row.getDataPtr() - src.getWidth() : nullptr);
+            }
+            addMetric(COUNTER_RUNS, runs);
+        });
+    }
+
+    //same as encodeBands for interleaved pixels, except that a task encodes the three channels
+    //of a band: every row is split in three channel rows just before they are encoded, so the
+    //pixels are read once and the channel rows are encoded while they are in the cache
+    void RLEImageWriter::encodeInterleavedBands(const Component * rgb, unsigned int width, unsigned int height,
+            const CPIHeader & header, unsigned int band_rows, unsigned int threads) {
+        unsigned int bands = (height + band_rows - 1) / band_rows;
+        //with deduplication the dictionaries point into the rows of the band, so all of them are kept,
+        //and tiles are made from all rows of the band. Predictions need the row above
+        bool tiled = (header.flags & CPI_TILED) != 0;
+        size_t kept_rows = (header.flags & (CPI_DEDUP | CPI_TILED)) ? band_rows : ((header.flags & CPI_PREDICTED) ? 2 : 1);
+        
+        band_buffers.resize(3 * (size_t) bands);
+        band_segments.resize(band_buffers.size());
+        parallelFor(bands, threads, [&] (size_t band) {
+            unsigned int first_row = (unsigned int) band * band_rows;
+            unsigned int last_row = min(first_row + band_rows, height);
+            
+            vector<Component> rows(3 * kept_rows * width);
+            vector<SegmentDictionary> dictionaries(3, SegmentDictionary(dedup_margin, (header.flags & CPI_DEDUP) ? 12 : 0));
+            for (size_t c = 0; c < 3; ++c) {
+                band_buffers[c * bands + band].clear();
+                band_segments[c * bands + band].clear();
+            }
+            
+            size_t runs = 0;
+            for (unsigned int y = first_row; y < last_row; ++y) {
+                Component * channel_rows[3];
+                for (size_t c = 0; c < 3; ++c) {
+                    channel_rows[c] = rows.data() + (c * kept_rows + (y - first_row) % kept_rows) * width;
+                }
+                splitChannels(rgb + 3 * (size_t) y * width, width, channel_rows[0], channel_rows[1], channel_rows[2]);
+                for (size_t c = 0; c < 3 && !tiled; ++c) {
+                    const Component * above = rows.data() + (c * kept_rows + (y - first_row + kept_rows - 1) % kept_rows) * width;
+                    runs += encodeRow(BlockView(channel_rows[c], width), header, band_buffers[c * bands + band],
+                            band_segments[c * bands + band], &dictionaries[c], y > first_row ? above : nullptr);
+                }
+            }
+            for (size_t c = 0; c < 3 && tiled; ++c) {
+                runs += encodeTiles(rows.data() + c * kept_rows * width, width, last_row - first_row, header,
+                        band_buffers[c * bands + band]);
+            }
+            addMetric(COUNTER_RUNS, runs);
+        });
+    }
+
+    //every setting, but none of the buffers or the log
+    RLEImageWriter RLEImageWriter::copySettings() const {
+        RLEImageWriter copy;
+        copy.block_length = block_length;
+        copy.threshold = threshold;
+        copy.varint_counts = varint_counts;
+        copy.thread_count = thread_count;
+        copy.index_band_rows = index_band_rows;
+        copy.adaptive = adaptive;
+        copy.max_error = max_error;
+        copy.min_psnr = min_psnr;
+        copy.dedup = dedup;
+        copy.dedup_margin = dedup_margin;
+        copy.prediction = prediction;
+        copy.verbose = verbose;
+        copy.tile_size = tile_size;
+        copy.scan_order = scan_order;
+        copy.pyramid_levels = pyramid_levels;
+        copy.output_policy = output_policy;
+        return copy;
+    }
+
+    //the header of a file written with the current settings. Any
+    //version 3 feature makes it a version 3 file
+    CPIHeader RLEImageWriter::makeHeader(unsigned int width, unsigned int height) const {
+        CPIHeader header;
+        header.width = width;
+        header.height = height;
+        header.block_length = block_length;
+        //the bands of a tiled file are its rows of tiles, with or without an index
+        if (tile_size > 0) {
+            header.flags |= CPI_TILED;
+            header.tile_size = tile_size;
+            header.scan_order = scan_order;
+            header.band_rows = tile_size;
+        }
+        if (index_band_rows > 0) {
+            header.flags |= CPI_INDEXED;
+            if (header.band_rows == 0) {
+                header.band_rows = index_band_rows;
+            }
+            header.offsets.assign(3 * (size_t) header.getBandCount() + 1, 0);
+        }
+        if (varint_counts) {
+            header.flags |= CPI_VARINT_COUNTS;
+        }
+        //tiles have no row segments to adapt or to repeat
+        if (adaptive && tile_size == 0) {
+            header.flags |= CPI_ADAPTIVE;
+        } else if (tile_size == 0) {
+            if (dedup) {
+                header.flags |= CPI_DEDUP;
+            }
+            //the reader predicts from the rows it decodes, which are the rows of the image only when lossless
+            if (prediction && threshold == 0 && (!dedup || dedup_margin == 0)) {
+                header.flags |= CPI_PREDICTED;
+            }
+            if (header.hasSegmentOps() && header.band_rows == 0) {
+                header.band_rows = SEGMENT_BAND_ROWS;
+            }
+        }
+        //a single pixel has nothing to reduce
+        if (pyramid_levels > 0 && width > 0 && height > 0 && (width > 1 || height > 1)) {
+            header.flags |= CPI_PYRAMID;
+        }
+        if (header.flags != 0) {
+            header.version = 3;
+        }
+        return header;
+    }
+
+    //halves a channel: every component of the result is the rounded mean of the 2 X 2 components under it,
+    //the edge ones repeated where the width or height is odd. Consecutive components of the channel are
+    //stride apart
+    static void halveChannel(const Component * src, size_t stride, unsigned int width, unsigned int height, 
+            Component * dst) {
+        unsigned int half_width = (width + 1) / 2;
+        unsigned int half_height = (height + 1) / 2;
+        for (unsigned int y = 0; y < half_height; ++y) {
+            const Component * top = src + (size_t) 2 * y * width * stride;
+            const Component * bottom = 2 * y + 1 < height ? top + (size_t) width * stride : top;
+            for (unsigned int x = 0; x < half_width; ++x) {
+                size_t left = (size_t) 2 * x * stride;
+                size_t right = 2 * x + 1 < width ? left + stride : left;
+                dst[(size_t) y * half_width + x] = (Component) ((top[left] + top[right] + bottom[left] + bottom[right] + 2) / 4);
+            }
+        }
+    }
+
+    //every level is halved from the one before it and encoded as an image of its own. pixels holds
+    //planar channels when stride is 1, interleaved ones when it is 3
+    void RLEImageWriter::encodePyramid(const Component * pixels, size_t stride, unsigned int width, unsigned int height,
+            CPIHeader & header) {
+        pyramid_data.clear();
+        if (!(header.flags & CPI_PYRAMID)) {
+            return;
+        }
+        
+        //the settings only: the buffers of this writer still hold the runs of the last image
+        RLEImageWriter level_writer = copySettings();
+        level_writer.pyramid_levels = 0;
+        vector<Component> level, next;
+        vector<unsigned char> encoded;
+        header.levels.assign(1, 0);
+        
+        for (unsigned int l = 0; l < pyramid_levels && (width > 1 || height > 1); ++l) {
+            unsigned int half_width = (width + 1) / 2;
+            unsigned int half_height = (height + 1) / 2;
+            size_t plane = (size_t) half_width * half_height;
+            next.resize(3 * plane);
+            for (size_t c = 0; c < 3; ++c) {
+                const Component * channel = stride == 1 ? pixels + c * width * height : pixels + c;
+                halveChannel(channel, stride, width, height, next.data() + c * plane);
+            }
+            
+            Image image(half_width, half_height, next.data(), false);
+            level_writer.encode(image, encoded);
+            pyramid_data.insert(pyramid_data.end(), encoded.begin(), encoded.end());
+            header.levels.push_back(pyramid_data.size());
+            
+            level.swap(next);
+            pixels = level.data();
+            stride = 1;
+            width = half_width;
+            height = half_height;
+        }
+    }
+
+    //rows per band for the band encoder: the index bands if there is an index,
+    //otherwise a few bands per thread, so that a slow band does not stall the pool
+    static unsigned int chooseBandRows(const CPIHeader & header, unsigned int threads) {
+        if (header.band_rows > 0) {
+            return header.band_rows;
+        }
+        unsigned int bands = max(1u, min((unsigned int) header.height, (4 * threads + 2) / 3));
+        return max(1u, (header.height + bands - 1) / bands);
+    }
+
+    //fills the offset table of an indexed header and the segment table offset
+    //of an adaptive one from the sizes of the band buffers
+    void RLEImageWriter::fillOffsets(CPIHeader & header) const {
+        header.segment_table = 0;
+        for (size_t i = 0; i < band_buffers.size(); ++i) {
+            header.segment_table += band_buffers[i].size();
+        }
+        if (!(header.flags & CPI_INDEXED)) {
+            return;
+        }
+        for (size_t i = 0; i < band_buffers.size() && i + 1 < header.offsets.size(); ++i) {
+            header.offsets[i + 1] = header.offsets[i] + band_buffers[i].size();
+        }
+    }
+
+    //queues the band buffers (and the segment tables) for the file after the header. The buffers
+    //live until the end of the write call, so they go out without a copy. Returns the bytes queued
+    unsigned long long RLEImageWriter::queueBands(OutputFile & out, const CPIHeader & header) const {
+        unsigned long long queued = 0;
+        for (size_t i = 0; i < band_buffers.size(); ++i) {
+            out.writeReference(band_buffers[i].data(), band_buffers[i].size());
+            queued += band_buffers[i].size();
+        }
+        for (size_t i = 0; i < band_segments.size() && (header.flags & CPI_ADAPTIVE); ++i) {
+            out.writeReference(band_segments[i].data(), band_segments[i].size());
+            queued += band_segments[i].size();
+        }
+        return queued;
+    }
+
+    //the header followed by the band buffers, as queueBands writes them
+    void RLEImageWriter::serializeBands(const CPIHeader & header, std::vector<unsigned char> & out) const {
+        out.clear();
+        serializeCPIHeader(header, out);
+        out.insert(out.end(), pyramid_data.begin(), pyramid_data.end());
+        for (size_t i = 0; i < band_buffers.size(); ++i) {
+            out.insert(out.end(), band_buffers[i].begin(), band_buffers[i].end());
+        }
+        for (size_t i = 0; i < band_segments.size() && (header.flags & CPI_ADAPTIVE); ++i) {
+            out.insert(out.end(), band_segments[i].begin(), band_segments[i].end());
+        }
+    }
+
+    //same contents as the file write produces, built in memory
+    void RLEImageWriter::encode(const Image & src, std::vector<unsigned char> & out) {
+        CPIHeader header = makeHeader(src.getWidth(), src.getHeight());
+        unsigned int threads = resolveThreadCount(thread_count);
+        encodePyramid(((Image&) src).getRawDataPtr(), 1, src.getWidth(), src.getHeight(), header);
+        
+        //the band buffers keep their capacity from the previous image
+        StageTimer timer(STAGE_ENCODE);
+        if (src.getHeight() > 0) {
+            encodeBands(src, header, chooseBandRows(header, threads), threads);
+            fillOffsets(header);
+        } else {
+            band_buffers.clear();
+            band_segments.clear();
+        }
+        
+        serializeBands(header, out);
+        addMetric(COUNTER_ENCODE_IN_BYTES, (unsigned long long) src.getWidth() * src.getHeight() * 3);
+        addMetric(COUNTER_ENCODE_OUT_BYTES, out.size());
+    }
+
+    void RLEImageWriter::encodeInterleaved(unsigned int width, unsigned int height, const Component * rgb,
+            std::vector<unsigned char> & out) {
+        CPIHeader header = makeHeader(width, height);
+        unsigned int threads = resolveThreadCount(thread_count);
+        encodePyramid(rgb, 3, width, height, header);
+        
+        StageTimer timer(STAGE_ENCODE);
+        if (height > 0) {
+            encodeInterleavedBands(rgb, width, height, header, chooseBandRows(header, threads), threads);
+            fillOffsets(header);
+        } else {
+            band_buffers.clear();
+            band_segments.clear();
+        }
+        
+        serializeBands(header, out);
+        addMetric(COUNTER_ENCODE_IN_BYTES, (unsigned long long) width * height * 3);
+        addMetric(COUNTER_ENCODE_OUT_BYTES, out.size());
+    }
+
+    //implementation of the rle image writer. The sequential path hands every row to the
+    //file as soon as it is encoded, so its encode time includes the buffered writes
     void RLEImageWriter::write(std::string filename, const Image & src) {
-        ofstream cpiImageOut(filename, ios_base::out | ios_base::binary);
-        if (cpiImageOut) {
-            unsigned char v = 2;
-            unsigned short e = 258;
-            unsigned short w = src.getWidth();
-            unsigned short h = src.getHeight();
-            unsigned short b = block_length;
-
-            //write out the header
-            cpiImageOut << 'C' << 'P' << 'I';
-            cpiImageOut.put(v);
-            cpiImageOut.write((char*) &e, 2);
-            cpiImageOut.write((char*) &w, 2);
-            cpiImageOut.write((char*) &h, 2);
-            cpiImageOut.write((char*) &b, 2);
+        OutputFile cpiImageOut;
+        if (cpiImageOut.open(filename, output_policy)) {
+            CPIHeader header = makeHeader(src.getWidth(), src.getHeight());
+            encodePyramid(((Image&) src).getRawDataPtr(), 1, src.getWidth(), src.getHeight(), header);
+            StageTimer encode_timer(STAGE_ENCODE);
+            unsigned long long written = 0;
+            
+            //encode the image in independent bands when they are needed for the index, the
+            //tiles or the worker threads. Otherwise go row by row, reusing a single buffer
+            unsigned int threads = resolveThreadCount(thread_count);
+            bool banded = (threads > 1 || (header.flags & (CPI_INDEXED | CPI_TILED))) && src.getHeight() > 0;
+            
+            if (banded) {
+                encodeBands(src, header, chooseBandRows(header, threads), threads);
+                fillOffsets(header);
+                encode_timer.stop();
+            }
+            
+            //write out the header and the reduced levels
+            vector<unsigned char> header_data;
+            serializeCPIHeader(header, header_data);
+            cpiImageOut.write((char*) header_data.data(), header_data.size());
+            cpiImageOut.write((char*) pyramid_data.data(), pyramid_data.size());
+            
             //write out image data 
             //arranged in data blocks
-            int n_blocks = (int) ceil ( src.getWidth() / (float) block_length );
-            int b_last = src.getWidth() - (n_blocks-1) * block_length;
-            ivec2 size(src.getWidth(), src.getHeight());
-            
-            vector<Image::channel_t> chanels = {Image::RED,Image::GREEN, Image::BLUE};
-            
-            for (Image::channel_t chanel : chanels) {
-                ivec2 pos(0, 0);
-                bvec2 cmp = pos < size;
-                while (cmp.y) {
-                    int curr_block = 0;
-                    for (int i = 1; i < n_blocks; ++i) {
-                        Block * b = Block::copyFromImage((Image&) src, chanel, pos, block_length);
-                        pos.x += block_length;
-                        vector<Component> * compr = compress(b, threshold);
-                        cpiImageOut.write((char*) compr->data(), compr->size());
-                        delete compr;
-                        delete b;
-                        
+            if (banded) {
+                written = queueBands(cpiImageOut, header);
+            } else {
+                vector<Image::channel_t> chanels = {Image::RED,Image::GREEN, Image::BLUE};
+                
+                //a row never encodes to more than 2 components per pixel, so after the first
+                //image the buffer does not grow any more
+                encode_buffer.reserve(2 * src.getWidth());
+                segment_buffer.clear();
+                SegmentDictionary dictionary(dedup_margin, (header.flags & CPI_DEDUP) ? 12 : 0);
+                size_t runs = 0;
+                
+                for (Image::channel_t chanel : chanels) {
+                    for (unsigned int y = 0; y < src.getHeight(); ++y) {
+                        if (header.band_rows > 0 && y % header.band_rows == 0) {
+                            dictionary.clear();
+                        }
+                        encode_buffer.clear();
+                        BlockView row = BlockView::fromImage((Image&) src, chanel, ivec2(0, y), src.getWidth());
+                        bool band_start = header.band_rows == 0 || y % header.band_rows == 0;
+                        runs += encodeRow(row, header, encode_buffer, segment_buffer, &dictionary,
+                                band_start ? nullptr : row.getDataPtr() - src.getWidth());
+                        cpiImageOut.write((char*) encode_buffer.data(), encode_buffer.size());
+                        header.segment_table += encode_buffer.size();
                     }
-                    Block * b = Block::copyFromImage((Image&) src, chanel, pos, b_last);
-                    vector<Component> * compr = compress(b, threshold);
-                    cpiImageOut.write((char*) compr->data(), compr->size());
-                    delete compr;
-                    delete b;
-                    
-                    pos.x = 0;
-                    pos.y++;
-                    cmp = pos < size;
-                }
-            }
-            cout << "w: " << src.getWidth() << " h: " << src.getHeight() << endl;
+                }
+                addMetric(COUNTER_RUNS, runs);
+                encode_timer.stop();
+                written = header.segment_table;
+                
+                //the segment table goes after the runs, whose size is known only now
+                if (header.flags & CPI_ADAPTIVE) {
+                    cpiImageOut.write((char*) segment_buffer.data(), segment_buffer.size());
+                    written += segment_buffer.size();
+                    header_data.clear();
+                    serializeCPIHeader(header, header_data);
+                    cpiImageOut.writeAt(0, header_data.data(), header_data.size());
+                }
+            }
+            
+            StageTimer write_timer(STAGE_WRITE);
+            if (!cpiImageOut.close()) {
+                reportFailure(verbose, "Cannot write file.\n");
+                addLogEntry("Cannot write file " + filename);
+            }
+            write_timer.stop();
+            addMetric(COUNTER_ENCODE_IN_BYTES, (unsigned long long) src.getWidth() * src.getHeight() * 3);
+            addMetric(COUNTER_ENCODE_OUT_BYTES, header_data.size() + pyramid_data.size() + written);
+            if (verbose) {
+                cout << "w: " << src.getWidth() << " h: " << src.getHeight() << endl;
+            }
         } else {
-            cout << "Cannot open file.\n" << endl;
+            reportFailure(verbose, "Cannot open file.\n");
             addLogEntry("Cannot open file " + filename);
         }
     }
 
+    bool RLEImageWriter::writeInterleaved(std::string filename, unsigned int width, unsigned int height,
+            const Component * rgb) {
+        OutputFile cpiImageOut;
+        if (!cpiImageOut.open(filename, output_policy)) {
+            reportFailure(verbose, "Cannot open file.\n");
+            addLogEntry("Cannot open file " + filename);
+            return false;
+        }
+        
+        CPIHeader header = makeHeader(width, height);
+        unsigned int threads = resolveThreadCount(thread_count);
+        encodePyramid(rgb, 3, width, height, header);
+        
+        StageTimer encode_timer(STAGE_ENCODE);
+        if (height > 0) {
+            encodeInterleavedBands(rgb, width, height, header, chooseBandRows(header, threads), threads);
+            fillOffsets(header);
+        } else {
+            band_buffers.clear();
+            band_segments.clear();
+        }
+        encode_timer.stop();
+        
+        vector<unsigned char> header_data;
+        serializeCPIHeader(header, header_data);
+        cpiImageOut.write((char*) header_data.data(), header_data.size());
+        cpiImageOut.write((char*) pyramid_data.data(), pyramid_data.size());
+        unsigned long long written = pyramid_data.size() + queueBands(cpiImageOut, header);
+        
+        StageTimer write_timer(STAGE_WRITE);
+        if (!cpiImageOut.close()) {
+            reportFailure(verbose, "Cannot write file.\n");
+            addLogEntry("Cannot write file " + filename);
+            return false;
+        }
+        write_timer.stop();
+        addMetric(COUNTER_ENCODE_IN_BYTES, (unsigned long long) width * height * 3);
+        addMetric(COUNTER_ENCODE_OUT_BYTES, header_data.size() + written);
+        if (verbose) {
+            cout << "w: " << width << " h: " << height << endl;
+        }
+        return true;
+    }
+
+    //the image is encoded on a compute thread and the file written through the ring (or on an
+    //I/O thread), which gets only the encoded bytes. Failures of either, exceptions included,
+    //end in done(false)
+    void RLEImageWriter::writeAsync(std::string filename, const Image & src, const std::function<void(bool)> & done) const {
+        RLEImageWriter writer = copySettings();
+        const Image * image = &src;
+        getComputePool().submit([writer, filename, image, done] () mutable {
+            shared_ptr<vector<unsigned char> > data;
+            try {
+                data = make_shared<vector<unsigned char> >();
+                writer.encode(*image, *data);
+            } catch (const exception &) {
+                data.reset();
+            }
+            if (!data) {
+                reportFailure(writer.verbose, "Cannot encode image.\n");
+                done(false);
+                return;
+            }
+            
+            bool verbose = writer.verbose;
+            writeFileAsync(filename, writer.output_policy, data, [verbose, done] (bool written) {
+                if (!written) {
+                    reportFailure(verbose, "Cannot write file.\n");
+                }
+                done(written);
+            });
+        });
+    }
+
+    std::future<bool> RLEImageWriter::writeAsync(std::string filename, const Image & src) const {
+        shared_ptr<promise<bool> > result = make_shared<promise<bool> >();
+        writeAsync(filename, src, [result] (bool written) {
+            result->set_value(written);
+        });
+        return result->get_future();
+    }
+
+    //decodes the data of one or more consecutive bands, starting at the start of band first_band
+    //(counted over all channels, as the offset table does)
+    size_t RLEImageReader::decodeBand(const CPIHeader & header, const unsigned char * data, size_t size,
+            Component * decoded, size_t capacity, unsigned int first_band) {
+        bool varint_counts = (header.flags & CPI_VARINT_COUNTS) != 0;
+        if (header.flags & CPI_TILED) {
+            return decodeTiles(header, data, size, first_band, decoded, capacity);
+        }
+        if (header.hasSegmentOps()) {
+            return decodeSegments(data, size, decoded, capacity, header.width, header.block_length, varint_counts);
+        }
+        return decodeRuns(data, size, decoded, capacity, varint_counts);
+    }
+
+    //decodes the image data that follows the header into a non interlaced
+    //buffer of width * height * 3 components
+    void RLEImageReader::decodeImage(const CPIHeader & header, const unsigned char * data, size_t dataSize,
+            Component * decoded) {
+        size_t size = (size_t) header.width * header.height * 3;
+        unsigned int threads = resolveThreadCount(thread_count);
+        
+        bool varint_counts = (header.flags & CPI_VARINT_COUNTS) != 0;
+        bool segmented = header.hasSegmentOps() || (header.flags & CPI_TILED);
+        
+        //the bands of an indexed file follow each other, so the whole
+        //stream decodes in one pass either way
+        if (threads <= 1 || ((varint_counts || segmented) && !(header.flags & CPI_INDEXED))) {
+            decodeBand(header, data, dataSize, decoded, size);
+        } else if (header.flags & CPI_INDEXED) {
+            //every band lands in its own slice of the output
+            unsigned int bands = header.getBandCount();
+            size_t plane_size = (size_t) header.width * header.height;
+            parallelFor(3 * (size_t) bands, threads, [&] (size_t task) {
+                unsigned int band = (unsigned int) (task % bands);
+                size_t begin = (size_t) min(header.offsets[task], (unsigned long long) dataSize);
+                size_t end = (size_t) min(header.offsets[task + 1], (unsigned long long) dataSize);
+                size_t first = (task / bands) * plane_size + (size_t) header.getBandFirstRow(band) * header.width;
+                size_t length = (size_t) (header.getBandLastRow(band) - header.getBandFirstRow(band)) * header.width;
+                decodeBand(header, data + begin, end - begin, decoded + first, length, (unsigned int) task);
+            });
+        } else {
+            decodeRunsParallel(data, dataSize, decoded, size, threads);
+        }
+    }
+
+    //decodes the image data that follows the header into width * height interleaved pixels.
+    //Indexed files: a task decodes the three channels of a band into a buffer of its own and
+    //interleaves them from there. Other files go through the row decoder, whose rows are stored
+    //to every third component of the pixels as they come
+    void RLEImageReader::decodeInterleaved(const CPIHeader & header, const unsigned char * data, size_t dataSize,
+            Component * rgb) {
+        size_t width = header.width;
+        
+        if (header.flags & CPI_INDEXED) {
+            unsigned int bands = header.getBandCount();
+            parallelFor(bands, resolveThreadCount(thread_count), [&] (size_t band) {
+                unsigned int first_row = header.getBandFirstRow((unsigned int) band);
+                size_t length = (size_t) (header.getBandLastRow((unsigned int) band) - first_row) * width;
+                //reused by every band the thread decodes
+                static thread_local vector<Component> planes;
+                planes.resize(3 * length);
+                for (size_t c = 0; c < 3; ++c) {
+                    size_t entry = c * bands + band;
+                    size_t begin = (size_t) min(header.offsets[entry], (unsigned long long) dataSize);
+                    size_t end = (size_t) min(header.offsets[entry + 1], (unsigned long long) dataSize);
+                    Component * plane = planes.data() + c * length;
+                    //missing data of a truncated file is 0
+                    size_t decoded = decodeBand(header, data + begin, end - begin, plane, length, (unsigned int) entry);
+                    fill(plane + decoded, plane + length, 0);
+                }
+                mergeChannels(planes.data(), planes.data() + length, planes.data() + 2 * length, length,
+                        rgb + 3 * (size_t) first_row * width);
+            });
+            return;
+        }
+        
+        unsigned int height = header.height;
+        //tiles are not made row by row: the planes are decoded first
+        if (header.flags & CPI_TILED) {
+            size_t plane_size = width * height;
+            vector<Component> planes(3 * plane_size);
+            decodeBand(header, data, dataSize, planes.data(), planes.size());
+            mergeChannels(planes.data(), planes.data() + plane_size, planes.data() + 2 * plane_size, plane_size, rgb);
+            return;
+        }
+        RowDecoder decoder(header.width, 3 * (size_t) height, [&] (size_t row, const Component * line) {
+            Component * pixels = rgb + 3 * (row % height) * width + row / height;
+            for (size_t x = 0; x < width; ++x) {
+                pixels[3 * x] = line[x];
+            }
+        }, (header.flags & CPI_VARINT_COUNTS) != 0);
+        if (header.hasSegmentOps()) {
+            decoder.setSegments(header.block_length, header.height, header.band_rows);
+        }
+        decoder.feed(data, dataSize);
+        decoder.finish();
+    }
+
+    //the limit is checked before anything the size of the image is allocated
+    bool RLEImageReader::checkImageSize(const CPIHeader & header, const std::string & source) {
+        unsigned long long pixels = (unsigned long long) header.width * header.height;
+        if (max_pixels == 0 || pixels <= max_pixels) {
+            return true;
+        }
+        reportFailure(verbose, "CPI image too large");
+        addLogEntry("CPI image of " + to_string(header.width) + " X " + to_string(header.height) + 
+                " pixels over the size limit in " + source);
+        return false;
+    }
+
+    void RLEImageReader::reportOutOfMemory(const std::string & source) {
+        reportFailure(verbose, "Not enough memory for CPI image");
+        addLogEntry("Not enough memory to decode " + source);
+    }
+
     //implemetation of the rle image reader 
     Image * RLEImageReader::read(std::string filename) {
-        ifstream rleImageIn(filename);
+        if (memory_mapped) {
+            return readMapped(filename);
+        }
+        
+        ifstream rleImageIn(filename, ios_base::in | ios_base::binary);
 
         if (rleImageIn) {
-            Image *img;
-            unsigned short w, h;
-            unsigned short endian;
-            unsigned short maxBlockSize;
+            CPIHeader header;
             long sizeOfFile;
 
             //get file size
@@ -120,60 +988,582 @@ namespace imaging {
             sizeOfFile = rleImageIn.tellg();
             rleImageIn.seekg(0, ifstream::beg);
 
-            //read format info
-            char * headerChar = new char[4];
-            rleImageIn.read(headerChar, 4);
-            endian = readUnsignedShortBinary(rleImageIn);
-            if (!(
-                    (headerChar[0] == 'C') && (headerChar[1] == 'P') && (headerChar[2] == 'I') &&
-                    (headerChar[3] == 2) && (endian == 258)
-                    )) {
-                cout << "Wrong CPI Format" << endl;
+            //read format info and metadata
+            StageTimer header_timer(STAGE_HEADER_PARSE);
+            if (!readCPIHeader(rleImageIn, header)) {
+                reportFailure(verbose, "Wrong CPI Format");
                 addLogEntry("False CPI image");
-                delete[] headerChar;
                 return nullptr;
             }
-            //read metadata
-            w = readUnsignedShortBinary(rleImageIn);
-            h = readUnsignedShortBinary(rleImageIn);
-            maxBlockSize = readUnsignedShortBinary(rleImageIn);
+            header_timer.stop();
+            if (!checkImageSize(header, filename)) {
+                return nullptr;
+            }
 
-            //read image data
-            long size = w * h * 3;
+            try {
+                //read image data
+                size_t size = (size_t) header.width * header.height * 3;
+                size_t dataSize = header.getRunDataSize(sizeOfFile - (long) header.size);
 
-            unsigned char* imageChar = new unsigned char[sizeOfFile - rleImageIn.tellg()];
-            unsigned char* decodedImageChar = new unsigned char[size];
+                StageTimer read_timer(STAGE_PAYLOAD_READ);
+                vector<unsigned char> imageChar(dataSize);
+                vector<Component> decodedImageChar(size);
+                rleImageIn.read((char*) imageChar.data(), dataSize);
+                read_timer.stop();
 
+                //decode rle data
+                StageTimer decode_timer(STAGE_DECODE);
+                decodeImage(header, imageChar.data(), dataSize, decodedImageChar.data());
+                decode_timer.stop();
+                addMetric(COUNTER_DECODE_IN_BYTES, dataSize);
+                addMetric(COUNTER_DECODE_OUT_BYTES, size);
+
+                //create image object
+                return new Image(header.width, header.height, decodedImageChar.data(), false);
+            } catch (const bad_alloc &) {
+                reportOutOfMemory(filename);
+                return nullptr;
+            }
+
+        } else {
+            reportFailure(verbose, string("Cannot open rle image file.\n") + filename);
+            addLogEntry("Cannot open rle image file " + filename);
+            return nullptr;
+        }
+    }
+
+    //the header is parsed and the runs are decoded straight from the mapped pages
+    //mapping the file counts as the payload read, the pages themselves are read during the decode
+    Image * RLEImageReader::readMapped(std::string filename) {
+        MappedFile mapped;
+        StageTimer map_timer(STAGE_PAYLOAD_READ);
+        if (!mapped.open(filename, MappedFile::SEQUENTIAL)) {
+            reportFailure(verbose, string("Cannot open rle image file.\n") + filename);
+            addLogEntry("Cannot open rle image file " + filename);
+            return nullptr;
+        }
+        map_timer.stop();
+        
+        return decode(mapped.getDataPtr(), mapped.getSize());
+    }
+
+    std::shared_ptr<const Image> RLEImageReader::readShared(std::string filename) {
+        if (cache == nullptr) {
+            return shared_ptr<const Image>(read(filename));
+        }
+        return cache->get(filename, [&] () { return read(filename); });
+    }
+
+    Image * RLEImageReader::decode(const unsigned char * data, size_t size) {
+        CPIHeader header;
+        StageTimer header_timer(STAGE_HEADER_PARSE);
+        if (!parseCPIHeader(data, size, header)) {
+            reportFailure(verbose, "Wrong CPI Format");
+            addLogEntry("False CPI image");
+            return nullptr;
+        }
+        header_timer.stop();
+        if (!checkImageSize(header, "CPI data")) {
+            return nullptr;
+        }
+        
+        try {
+            StageTimer decode_timer(STAGE_DECODE);
+            size_t dataSize = header.getRunDataSize(size - header.size);
+            vector<Component> decodedImageChar((size_t) header.width * header.height * 3);
+            decodeImage(header, data + header.size, dataSize, decodedImageChar.data());
+            decode_timer.stop();
+            addMetric(COUNTER_DECODE_IN_BYTES, dataSize);
+            addMetric(COUNTER_DECODE_OUT_BYTES, decodedImageChar.size());
             
-            unsigned int dataSize = sizeOfFile - rleImageIn.tellg();
-            rleImageIn.read((char*) imageChar, dataSize);
+            return new Image(header.width, header.height, decodedImageChar.data(), false);
+        } catch (const bad_alloc &) {
+            reportOutOfMemory("CPI data");
+            return nullptr;
+        }
+    }
 
-            unsigned int decodedCharLength = 0;
-            unsigned int charCount;
-            unsigned int j = 0;
-            //decode rle data
-            for (unsigned int i = 1; i < dataSize; i += 2) {
-                charCount = (int) imageChar[i]; //to stoiheio pou mas deixnei poses fores na epanalifthei o arithmos
-                while ((decodedCharLength < charCount) && (j < size)) {
-                    decodedImageChar[j] = imageChar[i - 1]; //dwse to proigoumeno stoixeo ston kainourgio pinaka
-                    j++;
-                    decodedCharLength++;
-                }
-                decodedCharLength = 0;
+    //the whole file goes to memory through the ring (or on an I/O thread), then it is decoded
+    //on a compute thread, so neither ever waits for the other kind of work
+    //failures of either thread, exceptions included, end in done(nullptr)
+    void RLEImageReader::readAsync(std::string filename, const std::function<void(Image *)> & done) const {
+        RLEImageReader reader(*this);
+        readFileAsync(filename, [reader, filename, done] (FileData data) {
+            if (!data) {
+                reportFailure(reader.verbose, string("Cannot open rle image file.\n") + filename);
+                done(nullptr);
+                return;
             }
+            
+            getComputePool().submit([reader, done, data] () mutable {
+                Image * image;
+                try {
+                    image = reader.decode(data->data(), data->size());
+                } catch (const exception &) {
+                    reportFailure(reader.verbose, "Cannot decode CPI image");
+                    image = nullptr;
+                }
+                done(image);
+            });
+        });
+    }
 
-            //create image object
-            img = new Image(w, h, decodedImageChar, false);
+    std::future<Image *> RLEImageReader::readAsync(std::string filename) const {
+        shared_ptr<promise<Image *> > result = make_shared<promise<Image *> >();
+        readAsync(filename, [result] (Image * image) {
+            result->set_value(image);
+        });
+        return result->get_future();
+    }
 
-            delete[] headerChar;
-            delete[] imageChar;
-            delete[] decodedImageChar;
-            return img;
+    //a level is a complete image of its own: only its bytes are read (or mapped) and decoded
+    Image * RLEImageReader::readLevel(std::string filename, unsigned int level) {
+        if (level == 0) {
+            return read(filename);
+        }
+        
+        ifstream rleImageIn;
+        MappedFile mapped;
+        if (memory_mapped) {
+            mapped.open(filename, MappedFile::RANDOM);
+        } else {
+            rleImageIn.open(filename, ios_base::in | ios_base::binary);
+        }
+        if (!rleImageIn.is_open() && mapped.getDataPtr() == nullptr) {
+            reportFailure(verbose, string("Cannot open rle image file.\n") + filename);
+            addLogEntry("Cannot open rle image file " + filename);
+            return nullptr;
+        }
+        
+        CPIHeader header;
+        StageTimer header_timer(STAGE_HEADER_PARSE);
+        if (memory_mapped ? !parseCPIHeader(mapped.getDataPtr(), mapped.getSize(), header) 
+                          : !readCPIHeader(rleImageIn, header)) {
+            reportFailure(verbose, "Wrong CPI Format");
+            addLogEntry("False CPI image");
+            return nullptr;
+        }
+        header_timer.stop();
+        
+        if (level > header.getLevelCount()) {
+            addLogEntry("No level " + to_string(level) + " in " + filename);
+            return nullptr;
+        }
+        
+        const unsigned char * data;
+        vector<unsigned char> encoded;
+        if (memory_mapped) {
+            data = mapped.getDataPtr() + header.getLevelStart(level);
+        } else {
+            StageTimer read_timer(STAGE_PAYLOAD_READ);
+            encoded.resize(header.getLevelSize(level));
+            rleImageIn.seekg(header.getLevelStart(level), ifstream::beg);
+            rleImageIn.read((char*) encoded.data(), encoded.size());
+            read_timer.stop();
+            if (!rleImageIn) {
+                reportFailure(verbose, "Truncated CPI image");
+                addLogEntry("Truncated CPI image " + filename);
+                return nullptr;
+            }
+            data = encoded.data();
+        }
+        
+        //every level is a complete image of its own, which must have the size of the level
+        unsigned int width = header.width, height = header.height;
+        for (unsigned int l = 0; l < level; ++l) {
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+        CPIHeader level_header;
+        if (!parseCPIHeader(data, header.getLevelSize(level), level_header) || level_header.width != width ||
+                level_header.height != height) {
+            reportFailure(verbose, "Wrong CPI level");
+            addLogEntry("Wrong level " + to_string(level) + " in " + filename);
+            return nullptr;
+        }
+        return decode(data, header.getLevelSize(level));
+    }
 
+    //decodes only the bands of each channel that overlap the region when the file
+    //has an index; older files are decoded completely and cropped
+    Image * RLEImageReader::readRegion(std::string filename, unsigned int x, unsigned int y,
+            unsigned int width, unsigned int height) {
+        ifstream rleImageIn;
+        MappedFile mapped;
+        if (memory_mapped) {
+            mapped.open(filename, MappedFile::RANDOM);
         } else {
-            cout << "Cannot open rle image file.\n" << "" << filename << endl;
+            rleImageIn.open(filename, ios_base::in | ios_base::binary);
+        }
+        if (!rleImageIn.is_open() && mapped.getDataPtr() == nullptr) {
+            reportFailure(verbose, string("Cannot open rle image file.\n") + filename);
             addLogEntry("Cannot open rle image file " + filename);
             return nullptr;
         }
+        
+        CPIHeader header;
+        StageTimer header_timer(STAGE_HEADER_PARSE);
+        if (memory_mapped ? !parseCPIHeader(mapped.getDataPtr(), mapped.getSize(), header) 
+                          : !readCPIHeader(rleImageIn, header)) {
+            reportFailure(verbose, "Wrong CPI Format");
+            addLogEntry("False CPI image");
+            return nullptr;
+        }
+        header_timer.stop();
+        if (!checkImageSize(header, filename)) {
+            return nullptr;
+        }
+        
+        //clip the region to the image
+        if (x >= header.width || y >= header.height || width == 0 || height == 0) {
+            addLogEntry("Empty region requested from " + filename);
+            return nullptr;
+        }
+        width = min(width, header.width - x);
+        height = min(height, header.height - y);
+        
+        try {
+            vector<Component> region((size_t) width * height * 3);
+            
+            if (!(header.flags & CPI_INDEXED)) {
+                rleImageIn.close();
+                mapped.close();
+                Image * full = read(filename);
+                if (full == nullptr) {
+                    return nullptr;
+                }
+                for (size_t c = 0; c < 3; ++c) {
+                    const Component * plane = full->getRawDataPtr() + c * header.width * header.height;
+                    for (unsigned int row = 0; row < height; ++row) {
+                        const Component * line = plane + (size_t) (y + row) * header.width + x;
+                        copy(line, line + width, region.begin() + (c * height + row) * width);
+                    }
+                }
+                delete full;
+                return new Image(width, height, region.data(), false);
+            }
+            
+            unsigned int bands = header.getBandCount();
+            unsigned int first_band = y / header.band_rows;
+            unsigned int last_band = (y + height - 1) / header.band_rows;
+            vector<unsigned char> encoded;
+            vector<Component> decoded((size_t) header.band_rows * header.width);
+            
+            //the offsets come from the file: a band past its end is never read or allocated
+            unsigned long long available;
+            if (memory_mapped) {
+                available = mapped.getSize() - header.size;
+            } else {
+                rleImageIn.seekg(0, ifstream::end);
+                available = (unsigned long long) rleImageIn.tellg() - header.size;
+            }
+            
+            //let the kernel start paging in the bands of all three channels
+            for (size_t c = 0; c < 3 && memory_mapped; ++c) {
+                unsigned long long begin = header.offsets[c * bands + first_band];
+                mapped.willNeed(header.size + begin, header.offsets[c * bands + last_band + 1] - begin);
+            }
+            
+            for (size_t c = 0; c < 3; ++c) {
+                for (unsigned int band = first_band; band <= last_band; ++band) {
+                    size_t entry = c * bands + band;
+                    unsigned long long begin = header.offsets[entry];
+                    unsigned long long length = header.offsets[entry + 1] - begin;
+                
+                    const unsigned char * band_data;
+                
+                    StageTimer read_timer(STAGE_PAYLOAD_READ);
+                    if (header.offsets[entry + 1] > available) {
+                        band_data = nullptr;
+                    } else if (memory_mapped) {
+                        band_data = mapped.getDataPtr() + header.size + begin;
+                    } else {
+                        encoded.resize(length);
+                        rleImageIn.seekg(header.size + begin, ifstream::beg);
+                        rleImageIn.read((char*) encoded.data(), length);
+                        band_data = rleImageIn ? encoded.data() : nullptr;
+                    }
+                    read_timer.stop();
+                    if (band_data == nullptr) {
+                        reportFailure(verbose, "Truncated CPI image");
+                        addLogEntry("Truncated CPI image " + filename);
+                        return nullptr;
+                    }
+                
+                    unsigned int band_first_row = header.getBandFirstRow(band);
+                    unsigned int band_last_row = header.getBandLastRow(band);
+                    size_t band_size = (size_t) (band_last_row - band_first_row) * header.width;
+                    StageTimer decode_timer(STAGE_DECODE);
+                    decodeBand(header, band_data, length, decoded.data(), band_size, (unsigned int) entry);
+                    decode_timer.stop();
+                    addMetric(COUNTER_DECODE_IN_BYTES, length);
+                    addMetric(COUNTER_DECODE_OUT_BYTES, band_size);
+                
+                    //copy the rows of the band that are inside the region
+                    unsigned int row_begin = max(y, band_first_row);
+                    unsigned int row_end = min(y + height, band_last_row);
+                    for (unsigned int row = row_begin; row < row_end; ++row) {
+                        const Component * line = decoded.data() + (size_t) (row - band_first_row) * header.width + x;
+                        copy(line, line + width, region.begin() + (c * height + row - y) * width);
+                    }
+                }
+            }
+            
+            return new Image(width, height, region.data(), false);
+        } catch (const bad_alloc &) {
+            reportOutOfMemory(filename);
+            return nullptr;
+        }
+    }
+
+    Image * RLEImageReader::readRows(std::string filename, unsigned int first_row, unsigned int rows) {
+        return readRegion(filename, 0, first_row, 0xFFFFu, rows);
+    }
+
+    //the payload is mapped or read in one piece, as read does
+    bool RLEImageReader::readInterleaved(std::string filename, std::vector<Component> & rgb, unsigned int & width,
+            unsigned int & height) {
+        ifstream rleImageIn;
+        MappedFile mapped;
+        StageTimer open_timer(STAGE_PAYLOAD_READ);
+        if (memory_mapped) {
+            mapped.open(filename, MappedFile::SEQUENTIAL);
+        } else {
+            rleImageIn.open(filename, ios_base::in | ios_base::binary);
+        }
+        if (!rleImageIn.is_open() && mapped.getDataPtr() == nullptr) {
+            reportFailure(verbose, string("Cannot open rle image file.\n") + filename);
+            addLogEntry("Cannot open rle image file " + filename);
+            return false;
+        }
+        open_timer.stop();
+        
+        CPIHeader header;
+        StageTimer header_timer(STAGE_HEADER_PARSE);
+        if (memory_mapped ? !parseCPIHeader(mapped.getDataPtr(), mapped.getSize(), header) 
+                          : !readCPIHeader(rleImageIn, header)) {
+            reportFailure(verbose, "Wrong CPI Format");
+            addLogEntry("False CPI image");
+            return false;
+        }
+        header_timer.stop();
+        if (!checkImageSize(header, filename)) {
+            return false;
+        }
+        
+        try {
+            const unsigned char * data;
+            size_t dataSize;
+            vector<unsigned char> encoded;
+            if (memory_mapped) {
+                data = mapped.getDataPtr() + header.size;
+                dataSize = header.getRunDataSize(mapped.getSize() - header.size);
+            } else {
+                StageTimer read_timer(STAGE_PAYLOAD_READ);
+                rleImageIn.seekg(0, ifstream::end);
+                long sizeOfFile = rleImageIn.tellg();
+                rleImageIn.seekg(header.size, ifstream::beg);
+                dataSize = header.getRunDataSize(sizeOfFile - (long) header.size);
+                encoded.resize(dataSize);
+                rleImageIn.read((char*) encoded.data(), dataSize);
+                data = encoded.data();
+            }
+            
+            StageTimer decode_timer(STAGE_DECODE);
+            rgb.resize((size_t) header.width * header.height * 3);
+            decodeInterleaved(header, data, dataSize, rgb.data());
+            decode_timer.stop();
+            addMetric(COUNTER_DECODE_IN_BYTES, dataSize);
+            addMetric(COUNTER_DECODE_OUT_BYTES, rgb.size());
+        } catch (const bad_alloc &) {
+            rgb.clear();
+            reportOutOfMemory(filename);
+            return false;
+        }
+        width = header.width;
+        height = header.height;
+        return true;
+    }
+
+    //the segment table runs from its offset to the end of the file
+    bool RLEImageReader::readSegments(std::string filename, std::vector<CPISegment> & segments) {
+        ifstream rleImageIn(filename, ios_base::in | ios_base::binary);
+        if (!rleImageIn) {
+            reportFailure(verbose, string("Cannot open rle image file.\n") + filename);
+            addLogEntry("Cannot open rle image file " + filename);
+            return false;
+        }
+        
+        CPIHeader header;
+        if (!readCPIHeader(rleImageIn, header)) {
+            reportFailure(verbose, "Wrong CPI Format");
+            addLogEntry("False CPI image");
+            return false;
+        }
+        if (!(header.flags & CPI_ADAPTIVE)) {
+            addLogEntry("No segment table in " + filename);
+            return false;
+        }
+        
+        rleImageIn.seekg(0, ifstream::end);
+        unsigned long long sizeOfFile = (unsigned long long) rleImageIn.tellg();
+        unsigned long long begin = header.size + header.segment_table;
+        vector<unsigned char> table(begin < sizeOfFile ? (size_t) (sizeOfFile - begin) : 0);
+        rleImageIn.seekg(begin, ifstream::beg);
+        rleImageIn.read((char*) table.data(), table.size());
+        
+        if (!rleImageIn || !parseSegmentTable(table.data(), table.size(), header, segments)) {
+            reportFailure(verbose, "Truncated CPI image");
+            addLogEntry("Bad segment table in " + filename);
+            return false;
+        }
+        return true;
+    }
+
+    //the rows are requested one at a time and encoded into the row buffer, which is written
+    //out right away. The offset table of an indexed file is filled in at the end
+    bool RLEImageWriter::writeStream(std::string filename, unsigned int width, unsigned int height,
+            RLERowSource & source) {
+        OutputFile cpiImageOut;
+        if (!cpiImageOut.open(filename, output_policy)) {
+            reportFailure(verbose, "Cannot open file.\n");
+            addLogEntry("Cannot open file " + filename);
+            return false;
+        }
+        
+        //the levels would need the whole image before the first row
+        CPIHeader header = makeHeader(width, height);
+        header.flags &= ~CPI_PYRAMID;
+        
+        vector<unsigned char> header_data;
+        serializeCPIHeader(header, header_data);
+        cpiImageOut.write((char*) header_data.data(), header_data.size());
+        
+        //with deduplication the rows of the current band are kept, since the
+        //dictionary points into them. Tiles are encoded once all rows of their band are in.
+        //Predictions need the row above
+        bool tiled = (header.flags & CPI_TILED) != 0;
+        size_t kept_rows = (header.flags & (CPI_DEDUP | CPI_TILED)) ? header.band_rows : ((header.flags & CPI_PREDICTED) ? 2 : 1);
+        vector<Component> rows(kept_rows * width);
+        unsigned long long written = 0;
+        encode_buffer.reserve(2 * (size_t) width);
+        segment_buffer.clear();
+        SegmentDictionary dictionary(dedup_margin, (header.flags & CPI_DEDUP) ? 12 : 0);
+        size_t runs = 0;
+        
+        for (size_t c = 0; c < 3; ++c) {
+            for (unsigned int y = 0; y < height; ++y) {
+                if ((header.flags & CPI_INDEXED) && y % header.band_rows == 0) {
+                    header.offsets[c * header.getBandCount() + y / header.band_rows] = written;
+                }
+                if (header.band_rows > 0 && y % header.band_rows == 0) {
+                    dictionary.clear();
+                }
+                Component * row = rows.data() + (y % kept_rows) * width;
+                if (!source.getRow((Image::channel_t) c, y, row)) {
+                    addLogEntry("Row source failed while writing " + filename);
+                    addMetric(COUNTER_ERRORS, 1);
+                    return false;
+                }
+                
+                StageTimer encode_timer(STAGE_ENCODE);
+                encode_buffer.clear();
+                if (!tiled) {
+                    bool band_start = header.band_rows == 0 || y % header.band_rows == 0;
+                    const Component * above = rows.data() + ((y + kept_rows - 1) % kept_rows) * width;
+                    runs += encodeRow(BlockView(row, width), header, encode_buffer, segment_buffer, &dictionary,
+                            band_start ? nullptr : above);
+                } else if ((y + 1) % header.band_rows == 0 || y + 1 == height) {
+                    runs += encodeTiles(rows.data(), width, y % header.band_rows + 1, header, encode_buffer);
+                }
+                encode_timer.stop();
+                cpiImageOut.write((char*) encode_buffer.data(), encode_buffer.size());
+                written += encode_buffer.size();
+            }
+        }
+        addMetric(COUNTER_RUNS, runs);
+        
+        if (header.flags & CPI_ADAPTIVE) {
+            cpiImageOut.write((char*) segment_buffer.data(), segment_buffer.size());
+            header.segment_table = written;
+        }
+        if (header.flags & (CPI_INDEXED | CPI_ADAPTIVE)) {
+            if (header.flags & CPI_INDEXED) {
+                header.offsets.back() = written;
+            }
+            header_data.clear();
+            serializeCPIHeader(header, header_data);
+            cpiImageOut.writeAt(0, header_data.data(), header_data.size());
+        }
+        
+        StageTimer write_timer(STAGE_WRITE);
+        if (!cpiImageOut.close()) {
+            addLogEntry("Cannot write file " + filename);
+            addMetric(COUNTER_ERRORS, 1);
+            return false;
+        }
+        write_timer.stop();
+        addMetric(COUNTER_ENCODE_IN_BYTES, (unsigned long long) width * height * 3);
+        addMetric(COUNTER_ENCODE_OUT_BYTES, header_data.size() + written + segment_buffer.size());
+        return true;
+    }
+
+    //reads the stream in pieces of stream_buffer_size bytes and decodes them one row at a time
+    bool RLEImageReader::readStream(std::string filename, RLERowSink & sink) {
+        ifstream rleImageIn(filename, ios_base::in | ios_base::binary);
+        if (!rleImageIn) {
+            reportFailure(verbose, string("Cannot open rle image file.\n") + filename);
+            addLogEntry("Cannot open rle image file " + filename);
+            return false;
+        }
+        
+        CPIHeader header;
+        StageTimer header_timer(STAGE_HEADER_PARSE);
+        if (!readCPIHeader(rleImageIn, header)) {
+            reportFailure(verbose, "Wrong CPI Format");
+            addLogEntry("False CPI image");
+            return false;
+        }
+        header_timer.stop();
+        
+        sink.begin(header.width, header.height);
+        
+        unsigned int height = header.height;
+        if (header.flags & CPI_TILED) {
+            unsigned long long consumed = 0;
+            bool complete = streamTiles(rleImageIn, header, stream_buffer_size, sink, consumed);
+            addMetric(COUNTER_DECODE_IN_BYTES, consumed);
+            addMetric(COUNTER_DECODE_OUT_BYTES, (unsigned long long) header.width * height * 3);
+            if (!complete) {
+                addLogEntry("Truncated CPI image " + filename);
+            }
+            return true;
+        }
+        RowDecoder decoder(header.width, 3 * (size_t) height, [&] (size_t row, const Component * data) {
+            sink.putRow((Image::channel_t) (row / height), (unsigned int) (row % height), data);
+        }, (header.flags & CPI_VARINT_COUNTS) != 0);
+        if (header.hasSegmentOps()) {
+            decoder.setSegments(header.block_length, header.height, header.band_rows);
+        }
+        
+        //the decode time includes the sink, which gets the rows as they are decoded
+        vector<unsigned char> buffer(stream_buffer_size);
+        unsigned long long consumed = 0;
+        while (rleImageIn && !decoder.isComplete()) {
+            StageTimer read_timer(STAGE_PAYLOAD_READ);
+            rleImageIn.read((char*) buffer.data(), buffer.size());
+            read_timer.stop();
+            StageTimer decode_timer(STAGE_DECODE);
+            decoder.feed(buffer.data(), (size_t) rleImageIn.gcount());
+            consumed += (unsigned long long) rleImageIn.gcount();
+        }
+        addMetric(COUNTER_DECODE_IN_BYTES, consumed);
+        addMetric(COUNTER_DECODE_OUT_BYTES, (unsigned long long) header.width * height * 3);
+        
+        if (!decoder.isComplete()) {
+            addLogEntry("Truncated CPI image " + filename);
+            decoder.finish();
+        }
+        return true;
     }
 }
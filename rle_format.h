@@ -9,9 +9,38 @@
 
 #pragma once
 #include "Image.h"
+#include "Block.h"
+#include "output_file.h"
+#include "rle_codec.h"
+#include "image_cache.h"
+#include <vector>
+#include <future>
+#include <functional>
 
 namespace imaging
 {
+
+	// Supplies the rows of an image to RLEImageWriter::writeStream. Rows are requested in file order: all rows
+	// of the RED channel top to bottom, then GREEN, then BLUE.
+	class RLERowSource
+	{
+	public:
+		// Copies the width components of row y of the channel to row. Returning false aborts the write.
+		virtual bool getRow(Image::channel_t channel, unsigned int y, Component * row) = 0;
+		virtual ~RLERowSource() {}
+	};
+
+	// Receives the decoded rows of RLEImageReader::readStream, in the same order as RLERowSource.
+	class RLERowSink
+	{
+	public:
+		// Called once with the image dimensions, before any row.
+		virtual void begin(unsigned int /*width*/, unsigned int /*height*/) {}
+		// row points to width components and is only valid during the call.
+		virtual void putRow(Image::channel_t channel, unsigned int y, const Component * row) = 0;
+		virtual ~RLERowSink() {}
+	};
+
 	// The RLE Image Writer breaks up the image into blocks of maximum size 1 X "block_length" (row blocks, i.e. line segments)
 	// and encodes each one using run length encoding with an error "threshold" (see algorithm description and format specification 
 	// in assignment document). Therefore, the class is extended with the setBlockDimension and setThreshold to configure these
@@ -22,21 +51,225 @@ namespace imaging
 	protected:
 		unsigned short block_length;     
 		Component threshold;
+		bool varint_counts;
+		unsigned int thread_count;
+		unsigned short index_band_rows;
+		bool adaptive;
+		Component max_error;
+		double min_psnr;
+		bool dedup;
+		Component dedup_margin;
+		bool prediction;
+		bool verbose;
+		unsigned short tile_size;
+		unsigned short scan_order;
+		unsigned int pyramid_levels;
+		OutputPolicy output_policy;
+		std::vector<Component> encode_buffer; // Reused output buffer for the encoded runs of a row
+		std::vector<Component> segment_buffer; // Segment table entries of the rows encoded by encode_buffer
+		std::vector<std::vector<Component> > band_buffers; // Reused per band output buffers of the parallel encoder
+		std::vector<std::vector<Component> > band_segments; // Segment table entries of every band
+		std::vector<unsigned char> pyramid_data; // The encoded reduced levels of the image
+
+		// A writer with the settings of this one and no buffers, for work on other threads or other images
+		RLEImageWriter copySettings() const;
+		CPIHeader makeHeader(unsigned int width, unsigned int height) const;
+		size_t encodeRow(const BlockView & row, const CPIHeader & header, std::vector<Component> & out,
+			std::vector<Component> & segments, SegmentDictionary * dictionary, const Component * above) const;
+		size_t encodeAdaptiveRow(const BlockView & row, const CPIHeader & header, std::vector<Component> & out,
+			std::vector<Component> & segments) const;
+		void encodeBands(const Image & src, const CPIHeader & header, unsigned int band_rows, unsigned int threads);
+		size_t encodeTiles(const Component * rows, unsigned int width, unsigned int height, const CPIHeader & header,
+			std::vector<Component> & out) const;
+		void encodeInterleavedBands(const Component * rgb, unsigned int width, unsigned int height, const CPIHeader & header,
+			unsigned int band_rows, unsigned int threads);
+		void fillOffsets(CPIHeader & header) const;
+		unsigned long long queueBands(OutputFile & out, const CPIHeader & header) const;
+		void serializeBands(const CPIHeader & header, std::vector<unsigned char> & out) const;
+		void encodePyramid(const Component * pixels, size_t stride, unsigned int width, unsigned int height, CPIHeader & header);
 
 	public:
-		void setBlockDimension(unsigned int dim) {block_length = dim>2 ? dim : 2; }
+		void setBlockDimension(unsigned int dim) {block_length = dim>2 ? (dim<0xFFFF ? dim : 0xFFFF) : 2; }
 		void setThreshold(Component value) {threshold = value;}
+		// Writes a version 3 file whose run counts are variable length numbers instead of single bytes, so the
+		// runs of long blocks (up to a whole row, see setBlockDimension) are not split every 255 components.
+		void setVariableLengthCounts(bool enable) {varint_counts = enable;}
+		// Number of threads used to encode an image. The channels are split in row bands that are encoded 
+		// independently and then written in file order, so the output is the same as with a single thread.
+		// 0 uses one thread per hardware thread. Default is 1 (no worker threads).
+		void setThreadCount(unsigned int count) {thread_count = count;}
+		// Writes a version 3 file whose channels are split in bands of the given number of rows, with a table of
+		// the byte offset of each band after the header, so readers can decode parts of the image without
+		// going through the whole stream. 0 (default) writes a version 2 file without an index.
+		void setIndexBandRows(unsigned int rows) {index_band_rows = rows < 0xFFFF ? rows : 0xFFFF;}
+		// Writes a version 3 file whose segments each get their own error threshold and length instead of
+		// the fixed threshold and block length. Every block_length components of a row are measured with four
+		// thresholds up to the quality bound, and the lowest one that comes close to the fewest runs is used;
+		// neighbouring blocks with the same threshold are merged in one longer segment. The choices are stored
+		// in the file (see rle_codec.h). Default is off.
+		void setAdaptive(bool enable) {adaptive = enable;}
+		// Quality bound of the adaptive mode: no component is off by more than max_error and, if min_psnr
+		// is positive, the PSNR of every row is at least min_psnr dB. Default is lossless (0, 0).
+		void setQualityBound(Component max_error_value, double min_psnr_value = 0.0) {max_error = max_error_value; min_psnr = min_psnr_value;}
+		// Writes a version 3 file where a segment equal to one seen earlier in its band (every component within
+		// margin) is stored as a reference to it instead of its runs. Copies may add up to margin to the error of the
+		// threshold. Unindexed files get bands of 64 rows. Does not apply in adaptive mode. Default is off.
+		void setDeduplication(bool enable, Component margin = 0) {dedup = enable; dedup_margin = margin;}
+		// Writes a version 3 file where every segment after the first row of a band may be stored as the residuals
+		// of a prediction from the row above, or from the left, above and above left components (gradient), 
+		// whichever makes the fewest runs. Gradients and rows that repeat the row above become runs of zeros. Unindexed 
+		// files get bands of 64 rows. Applies to lossless writes only: not with a threshold, a deduplication margin, 
+		// adaptive mode or tiles. Default is off.
+		void setPrediction(bool enable) {prediction = enable;}
+		// Writes a version 3 file whose channels are coded in square tiles of size X size components instead of
+		// row segments, each tile visited in the given scan order (see rle_codec.h). The size is rounded up to a 
+		// power of two between 4 and 256; 0 (default) turns tiles off. Every row of tiles is a band of its own, so 
+		// with an index (setIndexBandRows, whose row count then does not apply) readers can reach every row of 
+		// tiles directly and decode them in parallel. The block length, adaptive mode and deduplication do not 
+		// apply to tiles.
+		void setTiles(unsigned int size, cpi_scan_order_t order = CPI_SCAN_ROWS);
+		// Writes a version 3 file that stores up to the given number of reduced copies of the image (1/2, 1/4, ... 
+		// in each direction, see rle_codec.h) ahead of the image data, each encoded with the same settings, so 
+		// previews can be read without decoding the full image (see RLEImageReader::readLevel). Levels stop at 1 X 1;
+		// at most CPI_MAX_PYRAMID_LEVELS. writeStream does not write them. 0 (default) writes no levels.
+		void setPyramid(unsigned int levels) {pyramid_levels = levels < CPI_MAX_PYRAMID_LEVELS ? levels : CPI_MAX_PYRAMID_LEVELS;}
+		// Controls how the file is written: the size of the buffers that gather the encoded data before it goes 
+		// out with vectored writes, direct I/O and whether the file is synced to disk when closed.
+		void setOutputPolicy(const OutputPolicy & policy) {output_policy = policy;}
+		const OutputPolicy & getOutputPolicy() const {return output_policy;}
+		// Prints the size of every image written and any failure to the standard output. Failures go to the 
+		// log either way; the time and size of every call can be collected instead (see rle_metrics.h). Default is on.
+		void setVerbose(bool enable) {verbose = enable;}
 		virtual void write(std::string filename, const Image & src);
+		// Encodes the image into out, which receives exactly the bytes write would store in the file.
+		void encode(const Image & src, std::vector<unsigned char> & out);
+		// Writes an image of the given size whose rows are pulled from source one at a time, so only a row of the
+		// image and a row of encoded data are in memory (a row of tiles of each with setTiles). The thread count 
+		// does not apply here.
+		// Returns false if the file cannot be written or the source fails.
+		bool writeStream(std::string filename, unsigned int width, unsigned int height, RLERowSource & source);
+		// Writes an image whose pixels are interleaved (RGBRGB..., width * height pixels, row by row) instead of 
+		// in channel planes like Image. The file is the same write would produce for the planar image. Each row 
+		// is split in its three channels right before it is encoded, so there is no separate conversion pass over
+		// the image. Always encodes in bands (see setThreadCount). Returns false if the file cannot be written.
+		bool writeInterleaved(std::string filename, unsigned int width, unsigned int height, const Component * rgb);
+		// Same as encode, for interleaved pixels (see writeInterleaved).
+		void encodeInterleaved(unsigned int width, unsigned int height, const Component * rgb, std::vector<unsigned char> & out);
+		// Encodes the image on the compute threads and writes the file through io_uring, or on the I/O threads
+		// where it is not available (see io_ring.h and task_pool.h), without blocking the caller. src must stay
+		// alive and unchanged until the call completes. The future gets true once the file is written, false if it
+		// cannot be. Every call works on a copy of the writer, so any number of them may be in flight; their
+		// failures are counted in the metrics (see rle_metrics.h) but not logged here. With a thread count above 1
+		// the bands of the image are shared with the compute threads that are idle.
+		std::future<bool> writeAsync(std::string filename, const Image & src) const;
+		// Same as writeAsync, calling done with the result on an I/O thread (or the completion thread of the ring)
+		// instead. done must not wait for another asynchronous call.
+		void writeAsync(std::string filename, const Image & src, const std::function<void(bool)> & done) const;
 		RLEImageWriter(std::string extension = "rle") 
-			: ImageWriter(extension), block_length(32), threshold(0) {}
+			: ImageWriter(extension), block_length(32), threshold(0), varint_counts(false), thread_count(1), index_band_rows(0),
+			  adaptive(false), max_error(0), min_psnr(0.0), dedup(false), dedup_margin(0), prediction(false), verbose(true), tile_size(0),
+			  scan_order(CPI_SCAN_ROWS), pyramid_levels(0) {}
 	};
 
 	class RLEImageReader : public ImageReader
 	{
+	protected:
+		unsigned int thread_count;
+		size_t stream_buffer_size;
+		bool memory_mapped;
+		bool verbose;
+		ImageCache * cache;
+		unsigned long long max_pixels;
+
+		size_t decodeBand(const CPIHeader & header, const unsigned char * data, size_t size, Component * decoded, size_t capacity,
+			unsigned int first_band = 0);
+		void decodeImage(const CPIHeader & header, const unsigned char * data, size_t size, Component * decoded);
+		void decodeInterleaved(const CPIHeader & header, const unsigned char * data, size_t size, Component * rgb);
+		Image * readMapped(std::string filename);
+		bool checkImageSize(const CPIHeader & header, const std::string & source);
+		void reportOutOfMemory(const std::string & source);
+
 	public:
+		// Number of threads used to decode an image. Indexed files are decoded band by band, each thread
+		// writing its own part of the image. Other files are split in equal slices after a pass that sums the
+		// run counts of each slice. 0 uses one thread per hardware thread. Default is 1.
+		void setThreadCount(unsigned int count) {thread_count = count;}
+
+		// Reads files through a read-only memory mapping: the header is parsed and the runs are decoded 
+		// directly from the mapped pages, with no intermediate copy of the file. The pages are shared through
+		// the page cache by every process reading the same file. Applies to read and readRegion. Default is off.
+		// The file must not shrink while it is read: touching a mapped page past the new end of the file raises
+		// SIGBUS on POSIX systems, which ends the process. Leave this off for files that other processes may
+		// truncate or rewrite in place.
+		void setMemoryMapped(bool enable) {memory_mapped = enable;}
+
+		// Prints read failures to the standard output as well as to the log. Default is on.
+		void setVerbose(bool enable) {verbose = enable;}
+
+		// Files whose header declares more pixels than this fail to read before any of the image is allocated,
+		// and so does a read that runs out of memory. 0 is no limit. readStream, whose memory does not depend on
+		// the image size, ignores it. Default is 2^28 (16384 X 16384).
+		void setMaxPixelCount(unsigned long long pixels) {max_pixels = pixels;}
+
 		virtual Image * read(std::string filename);
+
+		// Serves readShared from the cache, which may be shared by any number of readers and threads.
+		// nullptr, the default, reads every time.
+		void setCache(ImageCache * image_cache) {cache = image_cache;}
+
+		// Same as read, but the image is shared read-only with the cache (see setCache). A file that has not
+		// changed since it was cached is not read again.
+		std::shared_ptr<const Image> readShared(std::string filename);
+
+		// Decodes only a reduced level of a file written with setPyramid: level l is 1/2^l of the image in each 
+		// direction, rounded up, and level 0 is the image itself (as read returns it). Only the data of the level
+		// is read. Returns nullptr if the file cannot be read, has no such level or the level is not of that size.
+		Image * readLevel(std::string filename, unsigned int level);
+
+		// Decodes an image from the bytes of a whole file held in memory (as RLEImageWriter::encode makes them).
+		// Returns nullptr if they do not hold a valid image.
+		Image * decode(const unsigned char * data, size_t size);
+
+		// Reads the file through io_uring, or on the I/O threads where it is not available, and decodes it on the
+		// compute threads (see io_ring.h and task_pool.h), without blocking the caller. The future gets the image
+		// read would return, or nullptr; the caller owns it. Every call works on a copy of the reader, so any number
+		// of them may be in flight; their failures are counted in the metrics (see rle_metrics.h) but not logged
+		// here. The file is read, not mapped. With a thread count above 1 the bands of the image are shared with
+		// the compute threads that are idle.
+		std::future<Image *> readAsync(std::string filename) const;
+		// Same as readAsync, calling done with the image on a compute thread instead. done must not wait for another
+		// asynchronous call.
+		void readAsync(std::string filename, const std::function<void(Image *)> & done) const;
+
+		// Decodes only the region [x, x+width) X [y, y+height) of the image, clipped to the image bounds.
+		// For indexed (version 3) files only the bands that overlap the region are read and decoded.
+		// Returns nullptr if the file cannot be read or the clipped region is empty.
+		Image * readRegion(std::string filename, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+
+		// Decodes the full width rows [first_row, first_row+rows) of the image. See readRegion.
+		Image * readRows(std::string filename, unsigned int first_row, unsigned int rows);
+
+		// Decodes the image into interleaved pixels (RGBRGB..., see RLEImageWriter::writeInterleaved) instead of
+		// an Image. rgb is resized to width * height * 3 components. Indexed files are decoded band by band, the
+		// three channels of a band together, and each band is interleaved while it is in the cache; the bands are
+		// shared by the threads (see setThreadCount). Other files are decoded one row at a time, every row stored
+		// straight to its components of the pixels. Returns false if the file cannot be read.
+		bool readInterleaved(std::string filename, std::vector<Component> & rgb, unsigned int & width, unsigned int & height);
+
+		// Lists the segments of an adaptive file with the threshold each one was encoded with.
+		// Returns false if the file cannot be read or was not written in adaptive mode.
+		bool readSegments(std::string filename, std::vector<CPISegment> & segments);
+
+		// Decodes the image row by row into sink, reading the file through a fixed buffer of 
+		// setStreamBufferSize bytes, so memory use does not depend on the image size. Tiled files are decoded
+		// a row of tiles at a time, and the buffer grows to hold the encoded data of one. The rows of a
+		// truncated file are completed with zeros. Returns false if the file cannot be read.
+		bool readStream(std::string filename, RLERowSink & sink);
+		void setStreamBufferSize(size_t bytes) {stream_buffer_size = bytes > 0 ? bytes : 1;}
+
 		RLEImageReader(std::string extension = "rle")
-			: ImageReader(extension) {}
+			: ImageReader(extension), thread_count(1), stream_buffer_size(64 * 1024), memory_mapped(false), verbose(true),
+			  cache(nullptr), max_pixels(1ull << 28) {}
 	};
 
 } //namespace imaging
@@ -0,0 +1,341 @@
+//------------------------------------------------------------
+//
+// rle_fuzz: fuzz targets of the read entry points of
+// RLEImageReader.
+//
+// Built once per entry point, RLE_FUZZ_ENTRY picking which:
+//   rle_fuzz_read     read
+//   rle_fuzz_mapped   read of a memory mapped file
+//   rle_fuzz_region   readRegion (file read or mapped)
+//   rle_fuzz_level    readLevel (file read or mapped)
+//   rle_fuzz_stream   readStream
+//   rle_fuzz_decode   decode
+// The first FUZZ_PARAMETER_SIZE bytes of an input are the
+// parameters of the call (thread count, mapping, region,
+// level, stream buffer size); the rest is the CPI data,
+// written to a file for the entry points that read one. Reads
+// are limited to FUZZ_MAX_PIXELS pixels, so a header that
+// claims a huge image fails fast instead of running the
+// fuzzer out of memory or time.
+//
+// With RLE_FUZZ_LIBFUZZER defined the file is a libFuzzer
+// target (LLVMFuzzerTestOneInput, see IMAGING_LIBFUZZER in
+// CMakeLists.txt). Otherwise it has its own driver:
+//
+// usage: rle_fuzz_<entry> [-runs=N] [-seed=N] [-save=DIR] [FILE...]
+//
+// Every FILE is run once as an input (so AFL can run the
+// target with @@). Without files, N inputs (default 10000)
+// are made from the seed: small images encoded with random
+// writer settings, most of them then damaged with random byte
+// changes, truncations and repeated pieces. -save=DIR also
+// writes them to DIR, as a seed corpus for libFuzzer or AFL.
+// A failed check aborts the process.
+//
+//-------------------------------------------------------------
+
+#include "Image.h"
+#include "rle_format.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace imaging;
+
+enum fuzz_entry_t {FUZZ_READ, FUZZ_MAPPED, FUZZ_REGION, FUZZ_LEVEL, FUZZ_STREAM, FUZZ_DECODE};
+
+#ifndef RLE_FUZZ_ENTRY
+#define RLE_FUZZ_ENTRY FUZZ_READ
+#endif
+
+static const char * ENTRY_NAMES[] = {"read", "mapped", "region", "level", "stream", "decode"};
+
+//parameter bytes ahead of the CPI data: flags, then the region x, y, width and height
+static const size_t FUZZ_PARAMETER_SIZE = 5;
+
+static const unsigned long long FUZZ_MAX_PIXELS = 1 << 20;
+
+#define FUZZ_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            cerr << "rle_fuzz_" << ENTRY_NAMES[RLE_FUZZ_ENTRY] << ": check failed: " #condition << endl; \
+            abort(); \
+        } \
+    } while (0)
+
+//one file per process, so parallel fuzzer jobs in the same directory do not share it
+static const string & getInputFilename() {
+    static const string filename = [] () {
+        stringstream name;
+        name << "rle_fuzz_" << ENTRY_NAMES[RLE_FUZZ_ENTRY];
+#if defined(__unix__) || defined(__APPLE__)
+        name << "_" << getpid();
+#endif
+        name << ".rle";
+        return name.str();
+    } ();
+    return filename;
+}
+
+//checks that the rows come in file order, inside the image announced by begin
+class CheckingSink : public RLERowSink
+{
+protected:
+    unsigned int width, height;
+    size_t rows;
+    bool begun;
+public:
+    CheckingSink() : width(0), height(0), rows(0), begun(false) {}
+
+    virtual void begin(unsigned int w, unsigned int h) {
+        FUZZ_CHECK(!begun);
+        begun = true;
+        width = w;
+        height = h;
+    }
+
+    virtual void putRow(Image::channel_t channel, unsigned int y, const Component * row) {
+        FUZZ_CHECK(begun);
+        FUZZ_CHECK((size_t) channel * height + y == rows);
+        FUZZ_CHECK(y < height && (unsigned int) channel < 3);
+        //touches every component, for the address sanitizer
+        unsigned int sum = 0;
+        for (unsigned int x = 0; x < width; ++x) {
+            sum += row[x];
+        }
+        FUZZ_CHECK(sum <= 255u * width);
+        ++rows;
+    }
+
+    size_t getRows() const {return rows;}
+};
+
+static void checkImage(Image * image, unsigned int max_width, unsigned int max_height) {
+    unique_ptr<Image> owner(image);
+    if (image != nullptr) {
+        FUZZ_CHECK(image->getWidth() <= max_width && image->getHeight() <= max_height);
+        FUZZ_CHECK(image->getRawDataPtr() != nullptr);
+    }
+}
+
+static void runInput(const uint8_t * data, size_t size) {
+    if (size < FUZZ_PARAMETER_SIZE) {
+        return;
+    }
+    uint8_t flags = data[0];
+    unsigned int x = data[1], y = data[2], w = data[3], h = data[4];
+    data += FUZZ_PARAMETER_SIZE;
+    size -= FUZZ_PARAMETER_SIZE;
+
+    RLEImageReader reader;
+    reader.setVerbose(false);
+    reader.setMaxPixelCount(FUZZ_MAX_PIXELS);
+    reader.setThreadCount(flags & 1 ? 3 : 1);
+
+    //the limit of the header, for the checks of the results; readStream has no limit of its own
+    CPIHeader header;
+    bool valid = parseCPIHeader(data, size, header) != 0;
+    if (RLE_FUZZ_ENTRY == FUZZ_STREAM && valid && (unsigned long long) header.width * header.height > FUZZ_MAX_PIXELS) {
+        return;
+    }
+    unsigned int max_width = valid ? header.width : 0xFFFF, max_height = valid ? header.height : 0xFFFF;
+
+    if (RLE_FUZZ_ENTRY == FUZZ_DECODE) {
+        checkImage(reader.decode(data, size), max_width, max_height);
+        return;
+    }
+
+    const string & filename = getInputFilename();
+    {
+        ofstream out(filename, ios_base::out | ios_base::binary | ios_base::trunc);
+        out.write((const char *) data, size);
+        FUZZ_CHECK(out.good());
+    }
+
+    switch (RLE_FUZZ_ENTRY) {
+    case FUZZ_MAPPED:
+        reader.setMemoryMapped(true);
+        checkImage(reader.read(filename), max_width, max_height);
+        break;
+    case FUZZ_REGION:
+        reader.setMemoryMapped((flags & 2) != 0);
+        checkImage(reader.readRegion(filename, x, y, w, h), w, h);
+        break;
+    case FUZZ_LEVEL:
+        reader.setMemoryMapped((flags & 2) != 0);
+        checkImage(reader.readLevel(filename, flags >> 4), max_width, max_height);
+        break;
+    case FUZZ_STREAM: {
+        //small buffers split the pairs and headers between reads
+        CheckingSink sink;
+        reader.setStreamBufferSize(1 + (flags >> 2) * (flags >> 2));
+        //every row of the image comes, even from a truncated file. Rows without components may be left out
+        if (reader.readStream(filename, sink)) {
+            FUZZ_CHECK(valid && (header.width == 0 || sink.getRows() == 3 * (size_t) header.height));
+        }
+        break;
+    }
+    default:
+        checkImage(reader.read(filename), max_width, max_height);
+        break;
+    }
+}
+
+#ifdef RLE_FUZZ_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    runInput(data, size);
+    return 0;
+}
+
+#else
+
+//small deterministic generator, so a seed always makes the same inputs
+static unsigned int nextRandom(unsigned int & state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+//a valid CPI file of a small image, with random writer settings
+static vector<unsigned char> makeFile(unsigned int & state) {
+    unsigned int width = 1 + nextRandom(state) % 48, height = 1 + nextRandom(state) % 48;
+    vector<Component> pixels((size_t) width * height * 3);
+    unsigned int smoothness = nextRandom(state) % 4;
+    Component value = 0;
+    for (Component & c : pixels) {
+        if (nextRandom(state) % 8 >= smoothness * 2) {
+            value = (Component) nextRandom(state);
+        }
+        c = value;
+    }
+    Image image(width, height, pixels.data(), false);
+
+    RLEImageWriter writer;
+    writer.setVerbose(false);
+    unsigned int options = nextRandom(state);
+    writer.setBlockDimension(2 + nextRandom(state) % 64);
+    writer.setThreshold(options & 1 ? (Component) (nextRandom(state) % 8) : 0);
+    writer.setVariableLengthCounts((options & 2) != 0);
+    writer.setIndexBandRows(options & 4 ? 1 + nextRandom(state) % 16 : 0);
+    writer.setAdaptive((options & 0x18) == 0x08);
+    writer.setDeduplication((options & 0x18) == 0x10);
+    writer.setPrediction((options & 0x18) == 0x18);
+    if (options & 0x20) {
+        writer.setTiles(4 << (nextRandom(state) % 3), (cpi_scan_order_t) (nextRandom(state) % CPI_SCAN_ORDER_COUNT));
+    }
+    writer.setPyramid(options & 0x40 ? 1 + nextRandom(state) % 4 : 0);
+
+    vector<unsigned char> file;
+    writer.encode(image, file);
+    return file;
+}
+
+//changes a few bytes of the file, cuts it short or repeats a piece of it
+static void damage(vector<unsigned char> & file, unsigned int & state) {
+    static const unsigned char interesting[] = {0, 1, 2, 3, 0x7F, 0x80, 0xFE, 0xFF};
+    unsigned int changes = 1 + nextRandom(state) % 4;
+    for (unsigned int i = 0; i < changes && !file.empty(); ++i) {
+        //the header is where most of the checks are, so it gets half the changes
+        size_t at = nextRandom(state) % 2 ? nextRandom(state) % min(file.size(), (size_t) 64) : nextRandom(state) % file.size();
+        switch (nextRandom(state) % 5) {
+        case 0:
+            file[at] ^= (unsigned char) (1 << (nextRandom(state) % 8));
+            break;
+        case 1:
+            file[at] = interesting[nextRandom(state) % sizeof(interesting)];
+            break;
+        case 2:
+            file[at] = (unsigned char) nextRandom(state);
+            break;
+        case 3:
+            file.resize(at);
+            break;
+        default: {
+            size_t length = min(file.size() - at, (size_t) (1 + nextRandom(state) % 32));
+            vector<unsigned char> piece(file.begin() + at, file.begin() + at + length);
+            file.insert(file.begin() + nextRandom(state) % file.size(), piece.begin(), piece.end());
+            break;
+        }
+        }
+    }
+}
+
+static bool readInput(const string & filename, vector<unsigned char> & input) {
+    ifstream in(filename, ios_base::in | ios_base::binary);
+    if (!in) {
+        return false;
+    }
+    input.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return true;
+}
+
+int main(int argc, char ** argv) {
+    unsigned long runs = 10000;
+    unsigned int seed = 1;
+    string save_dir;
+    vector<string> files;
+
+    //the options are spelled as for libFuzzer, so tests can run either build the same way
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 6, "-runs=") == 0) {
+            runs = strtoul(arg.c_str() + 6, nullptr, 10);
+        } else if (arg.compare(0, 6, "-seed=") == 0) {
+            seed = (unsigned int) strtoul(arg.c_str() + 6, nullptr, 10);
+        } else if (arg.compare(0, 6, "-save=") == 0) {
+            save_dir = arg.substr(6);
+        } else if (!arg.empty() && arg[0] == '-') {
+            cerr << "usage: rle_fuzz_" << ENTRY_NAMES[RLE_FUZZ_ENTRY] << " [-runs=N] [-seed=N] [-save=DIR] [FILE...]" << endl;
+            return 1;
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    vector<unsigned char> input;
+    for (const string & filename : files) {
+        if (!readInput(filename, input)) {
+            cerr << "cannot read " << filename << endl;
+            return 1;
+        }
+        runInput(input.data(), input.size());
+    }
+
+    unsigned int state = seed;
+    for (unsigned long run = 0; files.empty() && run < runs; ++run) {
+        input.clear();
+        for (size_t i = 0; i < FUZZ_PARAMETER_SIZE; ++i) {
+            input.push_back((unsigned char) nextRandom(state));
+        }
+        vector<unsigned char> file = makeFile(state);
+        //a quarter of the inputs stay valid
+        if (nextRandom(state) % 4 != 0) {
+            damage(file, state);
+        }
+        input.insert(input.end(), file.begin(), file.end());
+
+        if (!save_dir.empty()) {
+            ofstream out(save_dir + "/input_" + to_string(run), ios_base::out | ios_base::binary | ios_base::trunc);
+            out.write((const char *) input.data(), input.size());
+        }
+        runInput(input.data(), input.size());
+    }
+
+    remove(getInputFilename().c_str());
+    cout << "rle_fuzz_" << ENTRY_NAMES[RLE_FUZZ_ENTRY] << ": " << (files.empty() ? runs : files.size()) << " inputs" << endl;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,200 @@
+//------------------------------------------------------------
+//
+// Segment encoders specialized at compile time for the common
+// block lengths, for lossless coding and for the count format.
+// With the length known, the lossless kernel finds all run
+// starts of a segment in one vectorized pass and the loops have
+// a constant trip count; the runs go to a stack buffer sized
+// for the worst case, with no per run checks. The component type
+// is a template parameter, so the same kernels can serve 16-bit
+// planes: values are stored with sizeof(T) bytes.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include "Image.h"
+#include "rle_simd.h"
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+namespace imaging
+{
+	// Index of the lowest set bit of a non zero mask
+	inline unsigned int lowestSetBit64(unsigned long long mask)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, mask);
+		return (unsigned int) index;
+#else
+		return (unsigned int) __builtin_ctzll(mask);
+#endif
+	}
+
+	// Number of set bits of a mask
+	inline unsigned int countSetBits64(unsigned long long mask)
+	{
+#ifdef _MSC_VER
+		return (unsigned int) __popcnt64(mask);
+#else
+		return (unsigned int) __builtin_popcountll(mask);
+#endif
+	}
+
+	// Number of lossless runs of the length components at src: the run starts marked by markRunStarts, plus
+	// the first run. masks is scratch space.
+	inline size_t countLosslessRuns(const Component * src, size_t length, std::vector<unsigned long long> & masks)
+	{
+		if (length == 0) {
+			return 0;
+		}
+		masks.resize((length + 63) / 64);
+		markRunStarts(src, length, masks.data());
+		size_t runs = 1;
+		for (size_t w = 0; w < masks.size(); ++w) {
+			runs += countSetBits64(masks[w]);
+		}
+		return runs;
+	}
+
+	// Writes a (value, count) pair at out and returns the end of it. Same pairs as appendRun.
+	template <typename T, bool VarintCounts>
+	inline Component * putRun(Component * out, T value, size_t count)
+	{
+		if (!VarintCounts) {
+			for (; count > 0xFF; count -= 0xFF) {
+				memcpy(out, &value, sizeof(T));
+				out += sizeof(T);
+				*out++ = 0xFF;
+			}
+		}
+		memcpy(out, &value, sizeof(T));
+		out += sizeof(T);
+		if (VarintCounts) {
+			for (; count >= 0x80; count >>= 7) {
+				*out++ = (Component) (count | 0x80);
+			}
+		}
+		*out++ = (Component) count;
+		return out;
+	}
+
+	// Run start masks (see markRunStarts) of any component type; the 8-bit one is vectorized
+	template <typename T>
+	inline void findRunStarts(const T * src, size_t length, unsigned long long * masks)
+	{
+		for (size_t w = 0; w < (length + 63) / 64; ++w) {
+			masks[w] = 0;
+		}
+		for (size_t i = 1; i < length; ++i) {
+			if (src[i] != src[i - 1]) {
+				masks[i / 64] |= 1ull << (i % 64);
+			}
+		}
+	}
+
+	inline void findRunStarts(const Component * src, size_t length, unsigned long long * masks)
+	{
+		markRunStarts(src, length, masks);
+	}
+
+	// Length of the run at src[0] with an error threshold (see scanRun) for any component type
+	template <typename T>
+	inline size_t findRunLength(const T * src, size_t length, T threshold)
+	{
+		size_t i = 1;
+		while (i < length && abs( ((int) src[i]) - ((int) src[0]) ) <= threshold) {
+			++i;
+		}
+		return i;
+	}
+
+	inline size_t findRunLength(const Component * src, size_t length, Component threshold)
+	{
+		return scanRun(src, length, threshold);
+	}
+
+	// Appends the runs of the BlockLen components at src to out, exactly as the generic encoder does, and
+	// returns the number of runs. The lossless kernel ignores the threshold.
+	template <typename T, size_t BlockLen, bool Lossless, bool VarintCounts>
+	size_t encodeSegment(const T * src, T threshold, std::vector<Component> & out)
+	{
+		//worst case: a run per component, with a 2 byte count at most
+		Component encoded[BlockLen * (sizeof(T) + (VarintCounts ? 2 : 1))];
+		Component * end = encoded;
+		size_t runs = 1;
+
+		if (Lossless) {
+			const size_t words = (BlockLen + 63) / 64;
+			unsigned long long masks[words];
+			findRunStarts(src, BlockLen, masks);
+
+			size_t run_start = 0;
+			for (size_t w = 0; w < words; ++w) {
+				for (unsigned long long mask = masks[w]; mask != 0; mask &= mask - 1) {
+					size_t i = w * 64 + lowestSetBit64(mask);
+					end = putRun<T, VarintCounts>(end, src[run_start], i - run_start);
+					run_start = i;
+					++runs;
+				}
+			}
+			end = putRun<T, VarintCounts>(end, src[run_start], BlockLen - run_start);
+		} else {
+			//smooth areas: the whole segment is often a single run
+			size_t first = findRunLength(src, BlockLen, threshold);
+			if (first == BlockLen && (VarintCounts ? BlockLen < 0x80 : BlockLen <= 0xFF)) {
+				const Component * value = (const Component *) src;
+				for (size_t b = 0; b < sizeof(T); ++b) {
+					out.push_back(value[b]);
+				}
+				out.push_back((Component) BlockLen);
+				return 1;
+			}
+			end = putRun<T, VarintCounts>(end, src[0], first);
+			for (size_t i = first; i < BlockLen; ) {
+				size_t count = findRunLength(src + i, BlockLen - i, threshold);
+				end = putRun<T, VarintCounts>(end, src[i], count);
+				i += count;
+				++runs;
+			}
+		}
+		out.insert(out.end(), encoded, end);
+		return runs;
+	}
+
+	template <typename T>
+	struct SegmentKernel
+	{
+		typedef size_t (*type)(const T *, T, std::vector<Component> &);
+
+		template <size_t BlockLen>
+		static type select(bool lossless, bool varint_counts)
+		{
+			if (lossless) {
+				return varint_counts ? encodeSegment<T, BlockLen, true, true> : encodeSegment<T, BlockLen, true, false>;
+			}
+			return varint_counts ? encodeSegment<T, BlockLen, false, true> : encodeSegment<T, BlockLen, false, false>;
+		}
+	};
+
+	// The specialized encoder of full segments of block_length components, or nullptr if there is none for
+	// that length (16, 32, 64 and 256 are covered).
+	template <typename T>
+	typename SegmentKernel<T>::type getSegmentKernel(size_t block_length, bool lossless, bool varint_counts)
+	{
+		switch (block_length) {
+		case 16:
+			return SegmentKernel<T>::template select<16>(lossless, varint_counts);
+		case 32:
+			return SegmentKernel<T>::template select<32>(lossless, varint_counts);
+		case 64:
+			return SegmentKernel<T>::template select<64>(lossless, varint_counts);
+		case 256:
+			return SegmentKernel<T>::template select<256>(lossless, varint_counts);
+		default:
+			return nullptr;
+		}
+	}
+
+} //namespace imaging
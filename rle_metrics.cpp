@@ -0,0 +1,184 @@
+#include "rle_metrics.h"
+#include <ostream>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+namespace imaging {
+
+    static atomic<bool> metrics_enabled(false);
+
+    //counters of one thread. Only the owner adds to them, so the atomic
+    //adds never contend; they only keep snapshots and resets exact
+    struct MetricsBlock {
+        atomic<unsigned long long> calls[STAGE_COUNT];
+        atomic<unsigned long long> nanoseconds[STAGE_COUNT];
+        atomic<unsigned long long> counters[COUNTER_COUNT];
+
+        MetricsBlock() {
+            clear();
+        }
+
+        void clear() {
+            for (size_t i = 0; i < STAGE_COUNT; ++i) {
+                calls[i] = 0;
+                nanoseconds[i] = 0;
+            }
+            for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+                counters[i] = 0;
+            }
+        }
+
+        void addTo(CodecMetrics & total) const {
+            for (size_t i = 0; i < STAGE_COUNT; ++i) {
+                total.calls[i] += calls[i].load(memory_order_relaxed);
+                total.nanoseconds[i] += nanoseconds[i].load(memory_order_relaxed);
+            }
+            for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+                total.counters[i] += counters[i].load(memory_order_relaxed);
+            }
+        }
+    };
+
+    //the blocks of the running threads, plus the totals of the threads that have ended
+    struct MetricsRegistry {
+        mutex lock;
+        vector<MetricsBlock *> blocks;
+        CodecMetrics retired;
+    };
+
+    static MetricsRegistry & getRegistry() {
+        //never destroyed: threads may still end after static destruction
+        static MetricsRegistry * registry = new MetricsRegistry();
+        return *registry;
+    }
+
+    //registers the block of a thread on first use and folds it in the totals when the thread ends
+    struct ThreadMetrics {
+        MetricsBlock block;
+
+        ThreadMetrics() {
+            MetricsRegistry & registry = getRegistry();
+            lock_guard<mutex> guard(registry.lock);
+            registry.blocks.push_back(&block);
+        }
+
+        ~ThreadMetrics() {
+            MetricsRegistry & registry = getRegistry();
+            lock_guard<mutex> guard(registry.lock);
+            block.addTo(registry.retired);
+            registry.blocks.erase(find(registry.blocks.begin(), registry.blocks.end(), &block));
+        }
+    };
+
+    static MetricsBlock & getThreadBlock() {
+        static thread_local ThreadMetrics metrics;
+        return metrics.block;
+    }
+
+    CodecMetrics::CodecMetrics() {
+        fill(calls, calls + STAGE_COUNT, 0ull);
+        fill(nanoseconds, nanoseconds + STAGE_COUNT, 0ull);
+        fill(counters, counters + COUNTER_COUNT, 0ull);
+    }
+
+    double CodecMetrics::getCompressionRatio() const {
+        if (counters[COUNTER_ENCODE_OUT_BYTES] == 0) {
+            return 0.0;
+        }
+        return (double) counters[COUNTER_ENCODE_IN_BYTES] / counters[COUNTER_ENCODE_OUT_BYTES];
+    }
+
+    const char * CodecMetrics::getStageName(codec_stage_t stage) {
+        static const char * names[STAGE_COUNT] = {"header_parse", "payload_read", "decode", "encode", "write"};
+        return names[stage];
+    }
+
+    const char * CodecMetrics::getCounterName(codec_counter_t counter) {
+        static const char * names[COUNTER_COUNT] = {"runs", "encode_in_bytes", "encode_out_bytes",
+            "decode_in_bytes", "decode_out_bytes", "errors", "cache_hits", "cache_misses"};
+        return names[counter];
+    }
+
+    void CodecMetrics::writePrometheus(ostream & out, const string & prefix) const {
+        out << "# HELP " << prefix << "_stage_calls_total Calls of each codec stage.\n"
+            << "# TYPE " << prefix << "_stage_calls_total counter\n";
+        for (size_t i = 0; i < STAGE_COUNT; ++i) {
+            out << prefix << "_stage_calls_total{stage=\"" << getStageName((codec_stage_t) i) << "\"} "
+                << calls[i] << "\n";
+        }
+        out << "# HELP " << prefix << "_stage_seconds_total Time spent in each codec stage.\n"
+            << "# TYPE " << prefix << "_stage_seconds_total counter\n";
+        for (size_t i = 0; i < STAGE_COUNT; ++i) {
+            out << prefix << "_stage_seconds_total{stage=\"" << getStageName((codec_stage_t) i) << "\"} "
+                << getSeconds((codec_stage_t) i) << "\n";
+        }
+        for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+            string name = prefix + "_" + getCounterName((codec_counter_t) i) + "_total";
+            out << "# TYPE " << name << " counter\n" << name << " " << counters[i] << "\n";
+        }
+        out << "# HELP " << prefix << "_compression_ratio Image bytes per encoded byte.\n"
+            << "# TYPE " << prefix << "_compression_ratio gauge\n"
+            << prefix << "_compression_ratio " << getCompressionRatio() << "\n";
+    }
+
+    void setMetricsEnabled(bool enable) {
+        metrics_enabled.store(enable, memory_order_relaxed);
+    }
+
+    bool isMetricsEnabled() {
+        return metrics_enabled.load(memory_order_relaxed);
+    }
+
+    void addMetric(codec_counter_t counter, unsigned long long value) {
+        if (isMetricsEnabled()) {
+            getThreadBlock().counters[counter].fetch_add(value, memory_order_relaxed);
+        }
+    }
+
+    void addStageTime(codec_stage_t stage, unsigned long long nanoseconds) {
+        if (isMetricsEnabled()) {
+            MetricsBlock & block = getThreadBlock();
+            block.calls[stage].fetch_add(1, memory_order_relaxed);
+            block.nanoseconds[stage].fetch_add(nanoseconds, memory_order_relaxed);
+        }
+    }
+
+    CodecMetrics getMetricsSnapshot() {
+        MetricsRegistry & registry = getRegistry();
+        lock_guard<mutex> guard(registry.lock);
+        CodecMetrics total = registry.retired;
+        for (const MetricsBlock * block : registry.blocks) {
+            block->addTo(total);
+        }
+        return total;
+    }
+
+    void resetMetrics() {
+        MetricsRegistry & registry = getRegistry();
+        lock_guard<mutex> guard(registry.lock);
+        registry.retired = CodecMetrics();
+        for (MetricsBlock * block : registry.blocks) {
+            block->clear();
+        }
+    }
+
+    StageTimer::StageTimer(codec_stage_t timed_stage)
+        : stage(timed_stage), running(isMetricsEnabled()) {
+        if (running) {
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    void StageTimer::stop() {
+        if (running) {
+            running = false;
+            addStageTime(stage, (unsigned long long) chrono::duration_cast<chrono::nanoseconds>(
+                    chrono::steady_clock::now() - start).count());
+        }
+    }
+
+} //namespace imaging
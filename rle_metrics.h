@@ -0,0 +1,91 @@
+//------------------------------------------------------------
+//
+// Counters and timers of the RLE codec. Every thread adds to
+// its own block of counters, so the hot paths never share a
+// cache line; a snapshot sums the blocks of all threads (and
+// of the threads that have ended). Metrics are off by default
+// and cost a flag test per call while off.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include <iosfwd>
+#include <string>
+#include <chrono>
+
+namespace imaging
+{
+	// Timed stages of a read or write call
+	enum codec_stage_t
+	{
+		STAGE_HEADER_PARSE,     // Reading and validating the header
+		STAGE_PAYLOAD_READ,     // Reading (or mapping) the encoded data
+		STAGE_DECODE,           // Expanding the runs
+		STAGE_ENCODE,           // Making the runs
+		STAGE_WRITE,            // Handing the encoded data to the file and closing it
+		STAGE_COUNT
+	};
+
+	enum codec_counter_t
+	{
+		COUNTER_RUNS,               // Runs emitted by the encoder
+		COUNTER_ENCODE_IN_BYTES,    // Image bytes encoded
+		COUNTER_ENCODE_OUT_BYTES,   // Encoded bytes produced, headers included
+		COUNTER_DECODE_IN_BYTES,    // Encoded bytes decoded
+		COUNTER_DECODE_OUT_BYTES,   // Image bytes decoded
+		COUNTER_ERRORS,             // Failed calls
+		COUNTER_CACHE_HITS,         // Reads served by an ImageCache
+		COUNTER_CACHE_MISSES,       // Reads an ImageCache had to decode
+		COUNTER_COUNT
+	};
+
+	struct CodecMetrics
+	{
+		unsigned long long calls[STAGE_COUNT];
+		unsigned long long nanoseconds[STAGE_COUNT];
+		unsigned long long counters[COUNTER_COUNT];
+
+		CodecMetrics();
+
+		double getSeconds(codec_stage_t stage) const {return nanoseconds[stage] * 1e-9;}
+
+		// Image bytes per encoded byte over all encodes, 0 if nothing was encoded
+		double getCompressionRatio() const;
+
+		static const char * getStageName(codec_stage_t stage);
+		static const char * getCounterName(codec_counter_t counter);
+
+		// Writes the metrics in the Prometheus text exposition format, every name starting with prefix
+		void writePrometheus(std::ostream & out, const std::string & prefix = "rle") const;
+	};
+
+	void setMetricsEnabled(bool enable);
+	bool isMetricsEnabled();
+
+	// Adds to a counter of the calling thread. Does nothing while metrics are off.
+	void addMetric(codec_counter_t counter, unsigned long long value);
+
+	// Counts a call of a stage that took the given time. Does nothing while metrics are off.
+	void addStageTime(codec_stage_t stage, unsigned long long nanoseconds);
+
+	// Sum of the metrics of all threads so far
+	CodecMetrics getMetricsSnapshot();
+
+	void resetMetrics();
+
+	// Times a stage from construction to stop() or destruction
+	class StageTimer
+	{
+	protected:
+		codec_stage_t stage;
+		bool running;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		explicit StageTimer(codec_stage_t timed_stage);
+		~StageTimer() {stop();}
+
+		void stop();
+	};
+
+} //namespace imaging
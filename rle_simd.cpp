@@ -0,0 +1,579 @@
+#include "rle_simd.h"
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RLE_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(RLE_HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RLE_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace std;
+
+namespace imaging {
+
+    //index of the lowest set bit of a non zero mask
+    static inline unsigned int lowestSetBit(unsigned int mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (unsigned int) index;
+#else
+        return (unsigned int) __builtin_ctz(mask);
+#endif
+    }
+
+    //scalar kernel, also used for the tail of the vector kernels
+    static size_t scanRunScalar(const Component * src, size_t start, size_t length, Component threshold) {
+        const Component head = src[0];
+        size_t i = start;
+        if (threshold == 0) {
+            while (i < length && src[i] == head) {
+                ++i;
+            }
+        } else {
+            while (i < length && abs( ((int) src[i]) - ((int) head) ) <= threshold) {
+                ++i;
+            }
+        }
+        return i;
+    }
+
+    static size_t scanRunGeneric(const Component * src, size_t length, Component threshold) {
+        return scanRunScalar(src, 0, length, threshold);
+    }
+
+    static bool segmentsEqualScalar(const Component * a, const Component * b, size_t start, size_t length,
+            Component margin) {
+        for (size_t i = start; i < length; ++i) {
+            if (abs( ((int) a[i]) - ((int) b[i]) ) > margin) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void markRunStartsScalar(const Component * src, size_t start, size_t length, unsigned long long * masks) {
+        for (size_t i = max(start, (size_t) 1); i < length; ++i) {
+            if (src[i] != src[i - 1]) {
+                masks[i / 64] |= 1ull << (i % 64);
+            }
+        }
+    }
+
+    static void markRunStartsGeneric(const Component * src, size_t length, unsigned long long * masks) {
+        fill(masks, masks + (length + 63) / 64, 0ull);
+        markRunStartsScalar(src, 0, length, masks);
+    }
+
+    static bool segmentsEqualGeneric(const Component * a, const Component * b, size_t length, Component margin) {
+        return segmentsEqualScalar(a, b, 0, length, margin);
+    }
+
+    static void splitChannelsScalar(const Component * rgb, size_t start, size_t pixels, Component * red,
+            Component * green, Component * blue) {
+        for (size_t i = start; i < pixels; ++i) {
+            red[i] = rgb[3 * i];
+            green[i] = rgb[3 * i + 1];
+            blue[i] = rgb[3 * i + 2];
+        }
+    }
+
+    static void splitChannelsGeneric(const Component * rgb, size_t pixels, Component * red, Component * green,
+            Component * blue) {
+        splitChannelsScalar(rgb, 0, pixels, red, green, blue);
+    }
+
+    static void mergeChannelsScalar(const Component * red, const Component * green, const Component * blue,
+            size_t start, size_t pixels, Component * rgb) {
+        for (size_t i = start; i < pixels; ++i) {
+            rgb[3 * i] = red[i];
+            rgb[3 * i + 1] = green[i];
+            rgb[3 * i + 2] = blue[i];
+        }
+    }
+
+    static void mergeChannelsGeneric(const Component * red, const Component * green, const Component * blue,
+            size_t pixels, Component * rgb) {
+        mergeChannelsScalar(red, green, blue, 0, pixels, rgb);
+    }
+
+    static void predictUpScalar(const Component * src, const Component * above, size_t start, size_t length,
+            Component * residual) {
+        for (size_t i = start; i < length; ++i) {
+            residual[i] = (Component) (src[i] - above[i]);
+        }
+    }
+
+    static void predictUpGeneric(const Component * src, const Component * above, size_t length, Component * residual) {
+        predictUpScalar(src, above, 0, length, residual);
+    }
+
+    static void reconstructUpScalar(Component * row, const Component * above, size_t start, size_t length) {
+        for (size_t i = start; i < length; ++i) {
+            row[i] = (Component) (row[i] + above[i]);
+        }
+    }
+
+    static void reconstructUpGeneric(Component * row, const Component * above, size_t length) {
+        reconstructUpScalar(row, above, 0, length);
+    }
+
+    static void predictGradientScalar(const Component * src, const Component * above, size_t start, size_t length,
+            Component left, Component upleft, Component * residual) {
+        for (size_t i = start; i < length; ++i) {
+            Component l = i > 0 ? src[i - 1] : left;
+            Component ul = i > 0 ? above[i - 1] : upleft;
+            residual[i] = (Component) (src[i] - l - above[i] + ul);
+        }
+    }
+
+    static void predictGradientGeneric(const Component * src, const Component * above, size_t length, Component left,
+            Component upleft, Component * residual) {
+        predictGradientScalar(src, above, 0, length, left, upleft, residual);
+    }
+
+    static void reconstructGradientScalar(Component * row, const Component * above, size_t start, size_t length,
+            Component left, Component upleft) {
+        for (size_t i = start; i < length; ++i) {
+            Component l = i > 0 ? row[i - 1] : left;
+            Component ul = i > 0 ? above[i - 1] : upleft;
+            row[i] = (Component) (row[i] + l + above[i] - ul);
+        }
+    }
+
+    static void reconstructGradientGeneric(Component * row, const Component * above, size_t length, Component left,
+            Component upleft) {
+        reconstructGradientScalar(row, above, 0, length, left, upleft);
+    }
+
+#ifdef RLE_HAVE_SSE2
+    //compares 16 components per step. |c - head| is computed with two saturated
+    //subtractions, so that the unsigned components never wrap around
+    static size_t scanRunSSE2(const Component * src, size_t start, size_t length, Component threshold) {
+        const __m128i head = _mm_set1_epi8((char) src[0]);
+        size_t i = start;
+        
+        if (threshold == 0) {
+            for (; i + 16 <= length; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+                unsigned int mismatch = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, head)) ^ 0xFFFFu;
+                if (mismatch) {
+                    return i + lowestSetBit(mismatch);
+                }
+            }
+        } else {
+            const __m128i err = _mm_set1_epi8((char) threshold);
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= length; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+                __m128i diff = _mm_or_si128(_mm_subs_epu8(v, head), _mm_subs_epu8(head, v));
+                __m128i over = _mm_subs_epu8(diff, err); // non zero where diff > threshold
+                unsigned int mismatch = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) ^ 0xFFFFu;
+                if (mismatch) {
+                    return i + lowestSetBit(mismatch);
+                }
+            }
+        }
+        return scanRunScalar(src, i, length, threshold);
+    }
+
+    static size_t scanRunSSE2(const Component * src, size_t length, Component threshold) {
+        return scanRunSSE2(src, 0, length, threshold);
+    }
+
+    //same test as the run kernel, with the components of b in place of the head
+    static bool segmentsEqualSSE2(const Component * a, const Component * b, size_t start, size_t length,
+            Component margin) {
+        const __m128i err = _mm_set1_epi8((char) margin);
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = start;
+        
+        for (; i + 16 <= length; i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, err), zero)) != 0xFFFF) {
+                return false;
+            }
+        }
+        return segmentsEqualScalar(a, b, i, length, margin);
+    }
+
+    static bool segmentsEqualSSE2(const Component * a, const Component * b, size_t length, Component margin) {
+        return segmentsEqualSSE2(a, b, 0, length, margin);
+    }
+
+    //every step compares 16 components with the ones before them. The first step
+    //has no component before it: its bit 0 is cleared instead
+    static void markRunStartsSSE2(const Component * src, size_t start, size_t length, unsigned long long * masks) {
+        size_t i = start;
+        if (i == 0 && length >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) src);
+            unsigned int changed = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_slli_si128(v, 1))) ^ 0xFFFFu;
+            masks[0] |= changed & ~1u;
+            i = 16;
+        }
+        for (; i >= 16 && i + 16 <= length; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i previous = _mm_loadu_si128((const __m128i *) (src + i - 1));
+            unsigned long long changed = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(v, previous)) ^ 0xFFFFu;
+            masks[i / 64] |= changed << (i % 64);
+        }
+        markRunStartsScalar(src, i, length, masks);
+    }
+
+    static void markRunStartsSSE2(const Component * src, size_t length, unsigned long long * masks) {
+        fill(masks, masks + (length + 63) / 64, 0ull);
+        markRunStartsSSE2(src, 0, length, masks);
+    }
+
+    //the predictions wrap around modulo 256, as the byte adds do
+    static void predictUpSSE2(const Component * src, const Component * above, size_t length, Component * residual) {
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i up = _mm_loadu_si128((const __m128i *) (above + i));
+            _mm_storeu_si128((__m128i *) (residual + i), _mm_sub_epi8(v, up));
+        }
+        predictUpScalar(src, above, i, length, residual);
+    }
+
+    static void reconstructUpSSE2(Component * row, const Component * above, size_t length) {
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+            __m128i up = _mm_loadu_si128((const __m128i *) (above + i));
+            _mm_storeu_si128((__m128i *) (row + i), _mm_add_epi8(v, up));
+        }
+        reconstructUpScalar(row, above, i, length);
+    }
+
+    //the first component has no neighbours in src: it goes through the scalar code
+    static void predictGradientSSE2(const Component * src, const Component * above, size_t length, Component left,
+            Component upleft, Component * residual) {
+        if (length == 0) {
+            return;
+        }
+        predictGradientScalar(src, above, 0, 1, left, upleft, residual);
+        size_t i = 1;
+        for (; i + 16 <= length; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+            __m128i l = _mm_loadu_si128((const __m128i *) (src + i - 1));
+            __m128i up = _mm_loadu_si128((const __m128i *) (above + i));
+            __m128i ul = _mm_loadu_si128((const __m128i *) (above + i - 1));
+            _mm_storeu_si128((__m128i *) (residual + i), _mm_add_epi8(_mm_sub_epi8(_mm_sub_epi8(v, l), up), ul));
+        }
+        predictGradientScalar(src, above, i, length, left, upleft, residual);
+    }
+
+    //row[i] = row[i-1] + d[i] with d[i] = residual[i] + above[i] - above[i-1]: the d of 16 components are
+    //added up by shifted adds, and the last component of the step before is added to all of them
+    static void reconstructGradientSSE2(Component * row, const Component * above, size_t length, Component left,
+            Component upleft) {
+        if (length == 0) {
+            return;
+        }
+        reconstructGradientScalar(row, above, 0, 1, left, upleft);
+        __m128i carry = _mm_set1_epi8((char) row[0]);
+        size_t i = 1;
+        for (; i + 16 <= length; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+            __m128i up = _mm_loadu_si128((const __m128i *) (above + i));
+            __m128i ul = _mm_loadu_si128((const __m128i *) (above + i - 1));
+            v = _mm_sub_epi8(_mm_add_epi8(v, up), ul);
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+            v = _mm_add_epi8(v, carry);
+            _mm_storeu_si128((__m128i *) (row + i), v);
+            carry = _mm_set1_epi8((char) row[i + 15]);
+        }
+        reconstructGradientScalar(row, above, i, length, left, upleft);
+    }
+#endif
+
+#ifdef RLE_HAVE_AVX2
+    //same as the SSE2 kernel, 32 components per step
+    __attribute__((target("avx2")))
+    static size_t scanRunAVX2(const Component * src, size_t length, Component threshold) {
+        //short segments never touch the 256 bit registers
+        if (length < 32) {
+            return scanRunSSE2(src, 0, length, threshold);
+        }
+        
+        const __m256i head = _mm256_set1_epi8((char) src[0]);
+        size_t i = 0;
+        
+        if (threshold == 0) {
+            for (; i + 32 <= length; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+                unsigned int mismatch = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, head));
+                if (mismatch) {
+                    return i + lowestSetBit(mismatch);
+                }
+            }
+        } else {
+            const __m256i err = _mm256_set1_epi8((char) threshold);
+            const __m256i zero = _mm256_setzero_si256();
+            for (; i + 32 <= length; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+                __m256i diff = _mm256_or_si256(_mm256_subs_epu8(v, head), _mm256_subs_epu8(head, v));
+                __m256i over = _mm256_subs_epu8(diff, err);
+                unsigned int mismatch = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(over, zero));
+                if (mismatch) {
+                    return i + lowestSetBit(mismatch);
+                }
+            }
+        }
+        //the tail runs legacy SSE code: clear the upper register halves first, or 
+        //every SSE instruction after this call pays for the AVX state transition
+        _mm256_zeroupper();
+        return scanRunSSE2(src, i, length, threshold);
+    }
+
+    //32 components per step, starting at 16 so that the first one has a component before it
+    __attribute__((target("avx2")))
+    static void markRunStartsAVX2(const Component * src, size_t length, unsigned long long * masks) {
+        fill(masks, masks + (length + 63) / 64, 0ull);
+        if (length < 48) {
+            markRunStartsSSE2(src, 0, length, masks);
+            return;
+        }
+        
+        markRunStartsSSE2(src, 0, 16, masks);
+        size_t i = 16;
+        for (; i + 32 <= length; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+            __m256i previous = _mm256_loadu_si256((const __m256i *) (src + i - 1));
+            unsigned long long changed = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, previous));
+            masks[i / 64] |= changed << (i % 64);
+            if (i % 64 > 32) {
+                masks[i / 64 + 1] |= changed >> (64 - i % 64);
+            }
+        }
+        //see scanRunAVX2
+        _mm256_zeroupper();
+        markRunStartsSSE2(src, i, length, masks);
+    }
+
+    __attribute__((target("avx2")))
+    static bool segmentsEqualAVX2(const Component * a, const Component * b, size_t length, Component margin) {
+        if (length < 32) {
+            return segmentsEqualSSE2(a, b, 0, length, margin);
+        }
+        
+        const __m256i err = _mm256_set1_epi8((char) margin);
+        const __m256i zero = _mm256_setzero_si256();
+        size_t i = 0;
+        bool equal = true;
+        
+        for (; i + 32 <= length && equal; i += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+            equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(diff, err), zero)) == -1;
+        }
+        //see scanRunAVX2
+        _mm256_zeroupper();
+        return equal && segmentsEqualSSE2(a, b, i, length, margin);
+    }
+#endif
+
+#ifdef RLE_HAVE_AVX2
+    //shuffle masks of 16 pixels (48 bytes, 3 registers). SPLIT_MASKS[c][k] moves the components of
+    //channel c held in register k of the interleaved pixels to their place in the channel; -1 gives 0
+    static const signed char SPLIT_MASKS[3][3][16] = {
+        {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+        {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+        {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}}
+    };
+
+    //the other way around: MERGE_MASKS[k][c] places the components of channel c in register k of the pixels
+    static const signed char MERGE_MASKS[3][3][16] = {
+        {{0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+         {-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+         {-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1}},
+        {{-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+         {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+         {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1}},
+        {{-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+         {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+         {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15}}
+    };
+
+    static inline __attribute__((target("ssse3"))) __m128i loadMask(const signed char * mask) {
+        return _mm_loadu_si128((const __m128i *) mask);
+    }
+
+    //16 pixels per step: every channel register is the union of three byte shuffles
+    __attribute__((target("ssse3")))
+    static void splitChannelsSSSE3(const Component * rgb, size_t pixels, Component * red, Component * green,
+            Component * blue) {
+        Component * planes[3] = {red, green, blue};
+        size_t i = 0;
+        for (; i + 16 <= pixels; i += 16) {
+            __m128i in[3];
+            for (size_t k = 0; k < 3; ++k) {
+                in[k] = _mm_loadu_si128((const __m128i *) (rgb + 3 * i + 16 * k));
+            }
+            for (size_t c = 0; c < 3; ++c) {
+                __m128i out = _mm_or_si128(_mm_or_si128(
+                        _mm_shuffle_epi8(in[0], loadMask(SPLIT_MASKS[c][0])),
+                        _mm_shuffle_epi8(in[1], loadMask(SPLIT_MASKS[c][1]))),
+                        _mm_shuffle_epi8(in[2], loadMask(SPLIT_MASKS[c][2])));
+                _mm_storeu_si128((__m128i *) (planes[c] + i), out);
+            }
+        }
+        splitChannelsScalar(rgb, i, pixels, red, green, blue);
+    }
+
+    __attribute__((target("ssse3")))
+    static void mergeChannelsSSSE3(const Component * red, const Component * green, const Component * blue,
+            size_t pixels, Component * rgb) {
+        size_t i = 0;
+        for (; i + 16 <= pixels; i += 16) {
+            __m128i in[3] = {
+                _mm_loadu_si128((const __m128i *) (red + i)),
+                _mm_loadu_si128((const __m128i *) (green + i)),
+                _mm_loadu_si128((const __m128i *) (blue + i))
+            };
+            for (size_t k = 0; k < 3; ++k) {
+                __m128i out = _mm_or_si128(_mm_or_si128(
+                        _mm_shuffle_epi8(in[0], loadMask(MERGE_MASKS[k][0])),
+                        _mm_shuffle_epi8(in[1], loadMask(MERGE_MASKS[k][1]))),
+                        _mm_shuffle_epi8(in[2], loadMask(MERGE_MASKS[k][2])));
+                _mm_storeu_si128((__m128i *) (rgb + 3 * i + 16 * k), out);
+            }
+        }
+        mergeChannelsScalar(red, green, blue, i, pixels, rgb);
+    }
+#endif
+
+    typedef size_t (*scan_kernel_t)(const Component *, size_t, Component);
+    typedef bool (*equal_kernel_t)(const Component *, const Component *, size_t, Component);
+    typedef void (*mark_kernel_t)(const Component *, size_t, unsigned long long *);
+    typedef void (*split_kernel_t)(const Component *, size_t, Component *, Component *, Component *);
+    typedef void (*merge_kernel_t)(const Component *, const Component *, const Component *, size_t, Component *);
+    typedef void (*predict_up_kernel_t)(const Component *, const Component *, size_t, Component *);
+    typedef void (*reconstruct_up_kernel_t)(Component *, const Component *, size_t);
+    typedef void (*predict_gradient_kernel_t)(const Component *, const Component *, size_t, Component, Component, Component *);
+    typedef void (*reconstruct_gradient_kernel_t)(Component *, const Component *, size_t, Component, Component);
+
+    struct RunScanner {
+        scan_kernel_t kernel;
+        equal_kernel_t equal;
+        mark_kernel_t mark;
+        split_kernel_t split;
+        merge_kernel_t merge;
+        predict_up_kernel_t predict_up;
+        reconstruct_up_kernel_t reconstruct_up;
+        predict_gradient_kernel_t predict_gradient;
+        reconstruct_gradient_kernel_t reconstruct_gradient;
+        const char * name;
+    };
+
+    static const RunScanner SCALAR_SCANNER = {scanRunGeneric, segmentsEqualGeneric, markRunStartsGeneric,
+        splitChannelsGeneric, mergeChannelsGeneric, predictUpGeneric, reconstructUpGeneric, predictGradientGeneric,
+        reconstructGradientGeneric, "scalar"};
+    
+    static atomic<bool> scalar_kernels(false);
+    
+    //picks the kernel once, on first use
+    static const RunScanner & getRunScanner() {
+        static const RunScanner scanner = [] () {
+            RunScanner result = SCALAR_SCANNER;
+#ifdef RLE_HAVE_SSE2
+            result.kernel = scanRunSSE2;
+            result.equal = segmentsEqualSSE2;
+            result.mark = markRunStartsSSE2;
+            result.predict_up = predictUpSSE2;
+            result.reconstruct_up = reconstructUpSSE2;
+            result.predict_gradient = predictGradientSSE2;
+            result.reconstruct_gradient = reconstructGradientSSE2;
+            result.name = "sse2";
+#endif
+#ifdef RLE_HAVE_AVX2
+            //the channel shuffles need no more than SSSE3
+            if (__builtin_cpu_supports("ssse3")) {
+                result.split = splitChannelsSSSE3;
+                result.merge = mergeChannelsSSSE3;
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                result.kernel = scanRunAVX2;
+                result.equal = segmentsEqualAVX2;
+                result.mark = markRunStartsAVX2;
+                result.name = "avx2";
+            }
+#endif
+            return result;
+        } ();
+        return scalar_kernels.load(memory_order_relaxed) ? SCALAR_SCANNER : scanner;
+    }
+
+    size_t scanRun(const Component * src, size_t length, Component threshold) {
+        if (length == 0) {
+            return 0;
+        }
+        return getRunScanner().kernel(src, length, threshold);
+    }
+
+    bool segmentsEqual(const Component * a, const Component * b, size_t length, Component margin) {
+        return getRunScanner().equal(a, b, length, margin);
+    }
+
+    void markRunStarts(const Component * src, size_t length, unsigned long long * masks) {
+        getRunScanner().mark(src, length, masks);
+    }
+
+    void splitChannels(const Component * rgb, size_t pixels, Component * red, Component * green, Component * blue) {
+        getRunScanner().split(rgb, pixels, red, green, blue);
+    }
+
+    void mergeChannels(const Component * red, const Component * green, const Component * blue, size_t pixels,
+            Component * rgb) {
+        getRunScanner().merge(red, green, blue, pixels, rgb);
+    }
+
+    void predictUp(const Component * src, const Component * above, size_t length, Component * residual) {
+        getRunScanner().predict_up(src, above, length, residual);
+    }
+
+    void reconstructUp(Component * row, const Component * above, size_t length) {
+        getRunScanner().reconstruct_up(row, above, length);
+    }
+
+    void predictGradient(const Component * src, const Component * above, size_t length, Component left,
+            Component upleft, Component * residual) {
+        getRunScanner().predict_gradient(src, above, length, left, upleft, residual);
+    }
+
+    void reconstructGradient(Component * row, const Component * above, size_t length, Component left, Component upleft) {
+        getRunScanner().reconstruct_gradient(row, above, length, left, upleft);
+    }
+
+    const char * getRunScannerName() {
+        return getRunScanner().name;
+    }
+
+    void setScalarKernels(bool enable) {
+        scalar_kernels = enable;
+    }
+
+} //namespace imaging
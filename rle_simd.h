@@ -0,0 +1,58 @@
+//------------------------------------------------------------
+//
+// Vectorized kernels used by the RLE codec. Every kernel has a
+// scalar fallback; the fastest variant supported by the CPU
+// is selected once, at runtime.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include "Image.h"
+
+namespace imaging
+{
+	// Returns the length of the run that starts at src[0], i.e. the number of leading components c of the
+	// "length" contiguous components of src for which |c - src[0]| <= threshold. The result is always in 
+	// [1, length] (0 if length is 0). A threshold of 0 uses a plain equality test (lossless fast path).
+	size_t scanRun(const Component * src, size_t length, Component threshold);
+
+	// Returns true if |a[i] - b[i]| <= margin for each of the "length" components of a and b. A margin of 0
+	// uses a plain equality test. Stops at the first pair that differs.
+	bool segmentsEqual(const Component * a, const Component * b, size_t length, Component margin);
+
+	// Sets bit i % 64 of masks[i / 64] for every i in [1, length) where src[i] != src[i-1], i.e. where a lossless
+	// run starts, and clears the other bits, bit 0 included. masks must hold (length + 63) / 64 words.
+	void markRunStarts(const Component * src, size_t length, unsigned long long * masks);
+
+	// Copies the components of "pixels" interleaved RGB pixels (RGBRGB...) to three separate channels.
+	void splitChannels(const Component * rgb, size_t pixels, Component * red, Component * green, Component * blue);
+
+	// Interleaves "pixels" components of each of three channels into RGB pixels. The inverse of splitChannels.
+	void mergeChannels(const Component * red, const Component * green, const Component * blue, size_t pixels,
+		Component * rgb);
+
+	// Residuals of the prediction of a row segment from the row above (CPI_SEGMENT_UP): 
+	// residual[i] = src[i] - above[i], modulo 256.
+	void predictUp(const Component * src, const Component * above, size_t length, Component * residual);
+
+	// Inverse of predictUp, in place: row[i] += above[i], modulo 256.
+	void reconstructUp(Component * row, const Component * above, size_t length);
+
+	// Residuals of the gradient prediction of a row segment (CPI_SEGMENT_GRADIENT): 
+	// residual[i] = src[i] - (src[i-1] + above[i] - above[i-1]), modulo 256, where left and upleft stand in
+	// for src[-1] and above[-1].
+	void predictGradient(const Component * src, const Component * above, size_t length, Component left,
+		Component upleft, Component * residual);
+
+	// Inverse of predictGradient, in place. Every component depends on the one before it: the vectorized
+	// variant adds the rows and then makes a prefix sum of every 16 components in 4 steps.
+	void reconstructGradient(Component * row, const Component * above, size_t length, Component left, Component upleft);
+
+	// Name of the run scanner selected for this CPU ("avx2", "sse2" or "scalar"). Useful for logs and benchmarks.
+	const char * getRunScannerName();
+
+	// Makes every kernel above use its scalar variant instead of the one selected for the CPU, e.g. to compare
+	// their results. Both give the same output. Calls already running may finish with either. Default is off.
+	void setScalarKernels(bool enable);
+
+} //namespace imaging
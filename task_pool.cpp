@@ -0,0 +1,108 @@
+#include "task_pool.h"
+#include "rle_codec.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace imaging {
+
+    //threads of the I/O pool: enough to keep several requests queued at the disk
+    static const unsigned int IO_THREADS = 4;
+
+    //the pool the calling thread is a worker of, if any
+    static thread_local const TaskPool * current_pool = nullptr;
+
+    //a pool runs with the threads it could start
+    TaskPool::TaskPool(unsigned int threads) : stopping(false), idle(0) {
+        try {
+            workers.reserve(max(1u, threads));
+            for (unsigned int i = 0; i < max(1u, threads); ++i) {
+                workers.push_back(thread([this] () { work(); }));
+            }
+        } catch (const exception &) {
+        }
+    }
+
+    TaskPool::~TaskPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        not_empty.notify_all();
+        for (thread & worker : workers) {
+            worker.join();
+        }
+    }
+
+    void TaskPool::submit(const function<void()> & task) {
+        if (workers.empty()) {
+            run(task);
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push_back(task);
+        }
+        not_empty.notify_one();
+    }
+
+    void TaskPool::submit(function<void()> && task) {
+        if (workers.empty()) {
+            run(task);
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            tasks.push_back(std::move(task));
+        }
+        not_empty.notify_one();
+    }
+
+    //the queue is drained before the threads stop
+    void TaskPool::work() {
+        current_pool = this;
+        for (;;) {
+            function<void()> task;
+            {
+                unique_lock<mutex> guard(lock);
+                ++idle;
+                not_empty.wait(guard, [&] () { return !tasks.empty() || stopping; });
+                --idle;
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            run(task);
+        }
+    }
+
+    //the threads that wait for a task and have none queued for them yet
+    unsigned int TaskPool::getIdleCount() {
+        lock_guard<mutex> guard(lock);
+        return idle > tasks.size() ? (unsigned int) (idle - tasks.size()) : 0;
+    }
+
+    bool TaskPool::isWorkerThread() const {
+        return current_pool == this;
+    }
+
+    void TaskPool::run(const function<void()> & task) {
+        try {
+            task();
+        } catch (...) {
+        }
+    }
+
+    TaskPool & getComputePool() {
+        static TaskPool pool(resolveThreadCount(0));
+        return pool;
+    }
+
+    TaskPool & getIOPool() {
+        static TaskPool pool(IO_THREADS);
+        return pool;
+    }
+
+} //namespace imaging
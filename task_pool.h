@@ -0,0 +1,67 @@
+//------------------------------------------------------------
+//
+// Fixed pools of worker threads for the asynchronous read and
+// write calls of the RLE reader and writer. File I/O and the
+// encode/decode work go to separate pools: the I/O threads
+// spend their time blocked on the disk, so a handful of them
+// keep many files in flight, while the compute pool has one
+// thread per core and never waits on a file. Where io_uring
+// is available the I/O pool is not used (see io_ring.h). The compute pool
+// also runs the band work of parallelFor (rle_codec.h), so the
+// multithreaded encoders and decoders start no threads of
+// their own.
+//
+//-------------------------------------------------------------
+
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace imaging
+{
+	class TaskPool
+	{
+	protected:
+		std::mutex lock;
+		std::condition_variable not_empty;
+		std::deque<std::function<void()> > tasks;
+		std::vector<std::thread> workers;
+		bool stopping;
+		unsigned int idle;          // Threads waiting for a task
+
+		void work();
+		static void run(const std::function<void()> & task);
+
+	public:
+		// Starts the given number of threads (at least 1). If no thread can be started, submit runs every task
+		// on the calling thread instead.
+		explicit TaskPool(unsigned int threads);
+
+		// Runs the tasks still queued, then joins the threads
+		~TaskPool();
+
+		// Queues a task. Tasks start in the order they were submitted, on any of the threads. Tasks report their
+		// own failures: an exception that escapes one is dropped, so that it does not take the thread down.
+		void submit(const std::function<void()> & task);
+		void submit(std::function<void()> && task);
+
+		unsigned int getThreadCount() const {return (unsigned int) workers.size();}
+
+		// Number of threads that would start a task submitted now without waiting for another one to finish
+		unsigned int getIdleCount();
+
+		// true when called from a task running on this pool
+		bool isWorkerThread() const;
+	};
+
+	// The pool of the encode and decode work of asynchronous calls and of parallelFor: one thread per hardware thread.
+	TaskPool & getComputePool();
+
+	// The pool of the file reads and writes of asynchronous calls where io_uring is not used (see io_ring.h): 4 threads.
+	TaskPool & getIOPool();
+
+} //namespace imaging